@@ -0,0 +1,458 @@
+// Multi-threaded kvdb benchmarks.  The database is created afresh in
+// bench.db, or as an LSM tree in bench.lsm with -l, with -n keys of
+// -v-byte values before every run.
+//
+// Workloads:
+//   get       threads look up random keys with kvdb_get
+//   view      the same through kvdb_get_view, without copying
+//   get-put   get, while one more thread keeps overwriting random keys
+//   a to f    the core workloads of YCSB, where every thread draws its
+//             operations at random in these proportions, on keys drawn
+//             from a zipfian distribution (the latest keys first in d):
+//               a  50% reads, 50% updates
+//               b  95% reads, 5% updates
+//               c  reads only
+//               d  95% reads, 5% inserts
+//               e  95% scans of 1 to 100 keys, 5% inserts
+//               f  50% reads, 50% read-modify-writes
+//
+// Output is one CSV line:
+//   workload,threads,keys,ops,seconds,ops_per_sec,p50_us,p95_us,p99_us,
+//   p999_us,max_us,file_bytes,write_amp
+// where ops and latencies count the operations of the reader threads
+// only, and write_amp divides the bytes the process wrote to files from
+// the start of the run through kvdb_close by the bytes of the keys and
+// values it put.
+#define _GNU_SOURCE
+#include "kvdb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define BENCH_FILE      "bench.db"
+#define BENCH_DIR       "bench.lsm"
+#define LOAD_BATCH      1000
+#define ZIPF_THETA      0.99
+#define MAX_SCAN        100
+
+static int num_threads = 1;
+static double run_time = 1.0;
+static long num_keys = 100000;
+static int value_length = 100;
+static int use_lsm = 0;
+static int done_flag = 0;
+static kvdb_t db;
+
+#define is_done()   __atomic_load_n(&done_flag, __ATOMIC_RELAXED)
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t rng(uint64_t *seed) {
+  *seed ^= *seed >> 12;
+  *seed ^= *seed << 25;
+  *seed ^= *seed >> 27;
+  return *seed * 0x2545f4914f6cdd1dull;
+}
+
+// uniform in [0, 1)
+static double rng_double(uint64_t *seed) {
+  return (rng(seed) >> 11) * (1.0 / (1ull << 53));
+}
+
+static void make_key(char *buf, long i) {
+  sprintf(buf, "user%010ld", i);
+}
+
+static void make_value(char *buf, uint64_t *seed) {
+  for (int i = 0; i < value_length; i++) buf[i] = 'a' + rng(seed) % 26;
+  buf[value_length] = '\0';
+}
+
+// Latencies go to buckets of 1/16 of a power of two of nanoseconds:
+// below 16 ns one per nanosecond, then 16 per power of two.
+#define LAT_SUB_BITS    4
+#define LAT_BUCKETS     (61 << LAT_SUB_BITS)
+
+static int lat_bucket(uint64_t ns) {
+  int exp;
+  if (ns < 1 << LAT_SUB_BITS) return ns;
+  exp = 63 - __builtin_clzll(ns);
+  return (exp - LAT_SUB_BITS + 1) << LAT_SUB_BITS |
+      (ns >> (exp - LAT_SUB_BITS) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+// The middle of a bucket, in nanoseconds.
+static double lat_value(int bucket) {
+  int exp = (bucket >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+  uint64_t low;
+  if (bucket < 1 << LAT_SUB_BITS) return bucket;
+  low = (uint64_t)((bucket & ((1 << LAT_SUB_BITS) - 1)) | 1 << LAT_SUB_BITS)
+      << (exp - LAT_SUB_BITS);
+  return low + (1ull << (exp - LAT_SUB_BITS)) / 2.0;
+}
+
+typedef struct worker {
+  pthread_t tid;
+  int id;
+  uint64_t seed;
+  uint64_t ops;
+  uint64_t put_bytes;     // of keys and values
+  uint64_t latency[LAT_BUCKETS];
+} __attribute__((aligned(64))) worker;
+
+static void record(worker *w, uint64_t start) {
+  w->latency[lat_bucket(now_ns() - start)]++;
+  w->ops++;
+}
+
+static void die(const char *what) {
+  perror(what);
+  exit(EXIT_FAILURE);
+}
+
+static void remove_dir(const char *path) {
+  DIR *dir = opendir(path);
+  struct dirent *de;
+  char name[512];
+  if (dir == NULL) return;
+  while ((de = readdir(dir)) != NULL) {
+    snprintf(name, sizeof name, "%s/%s", path, de->d_name);
+    unlink(name);
+  }
+  closedir(dir);
+  rmdir(path);
+}
+
+static void load() {
+  static char keys[LOAD_BATCH][32];
+  char *values = malloc(LOAD_BATCH * (value_length + 1));
+  struct kvdb_op ops[LOAD_BATCH];
+  uint64_t seed = 1;
+  if (values == NULL) die("malloc");
+  unlink(BENCH_FILE);
+  unlink(BENCH_FILE ".idx");
+  remove_dir(BENCH_DIR);
+  if (use_lsm ? kvdb_open_lsm(&db, BENCH_DIR) : kvdb_open(&db, BENCH_FILE))
+    die("kvdb_open");
+  for (long i = 0; i < num_keys; ) {
+    int n = 0;
+    for (; n < LOAD_BATCH && i < num_keys; n++, i++) {
+      make_key(keys[n], i);
+      make_value(values + n * (value_length + 1), &seed);
+      ops[n].key = keys[n];
+      ops[n].value = values + n * (value_length + 1);
+    }
+    if (kvdb_write_batch(&db, ops, n)) die("kvdb_write_batch");
+  }
+  free(values);
+}
+
+// Bytes written to files, sockets and terminals by the process so far.
+static uint64_t bytes_written() {
+  FILE *fp = fopen("/proc/self/io", "r");
+  unsigned long long n = 0;
+  char line[128];
+  if (fp == NULL) return 0;
+  while (fgets(line, sizeof line, fp) != NULL)
+    if (sscanf(line, "wchar: %llu", &n) == 1) break;
+  fclose(fp);
+  return n;
+}
+
+static long file_bytes() {
+  struct stat st;
+  long total = 0;
+  if (use_lsm) {
+    DIR *dir = opendir(BENCH_DIR);
+    struct dirent *de;
+    char name[512];
+    if (dir == NULL) return 0;
+    while ((de = readdir(dir)) != NULL) {
+      snprintf(name, sizeof name, "%s/%s", BENCH_DIR, de->d_name);
+      if (stat(name, &st) == 0 && S_ISREG(st.st_mode)) total += st.st_size;
+    }
+    closedir(dir);
+    return total;
+  }
+  if (stat(BENCH_FILE, &st) == 0) total += st.st_size;
+  if (stat(BENCH_FILE ".idx", &st) == 0) total += st.st_size;
+  return total;
+}
+
+static void *get_thread(void *arg) {
+  worker *w = arg;
+  char key[32];
+  while (!is_done()) {
+    uint64_t start = now_ns();
+    make_key(key, rng(&w->seed) % num_keys);
+    char *value = kvdb_get(&db, key);
+    if (value == NULL) die("kvdb_get");
+    free(value);
+    record(w, start);
+  }
+  return NULL;
+}
+
+static void *view_thread(void *arg) {
+  worker *w = arg;
+  char key[32];
+  size_t length;
+  while (!is_done()) {
+    uint64_t start = now_ns();
+    make_key(key, rng(&w->seed) % num_keys);
+    if (kvdb_get_view(&db, key, &length) == NULL) die("kvdb_get_view");
+    record(w, start);
+  }
+  return NULL;
+}
+
+static void *put_thread(void *arg) {
+  worker *w = arg;
+  char key[32], *value = malloc(value_length + 1);
+  if (value == NULL) die("malloc");
+  while (!is_done()) {
+    make_key(key, rng(&w->seed) % num_keys);
+    make_value(value, &w->seed);
+    if (kvdb_put(&db, key, value)) die("kvdb_put");
+    w->put_bytes += strlen(key) + value_length;
+  }
+  free(value);
+  return NULL;
+}
+
+// The zipfian generator of YCSB (Gray et al., "Quickly generating
+// billion-record synthetic databases"): item i of n comes up with a
+// probability proportional to 1 / (i + 1)^theta.
+static struct zipf {
+  long n;
+  double alpha, zetan, eta, half_pow;
+} zipf;
+
+static void zipf_init(long n) {
+  double zeta2 = 1 + pow(0.5, ZIPF_THETA);
+  zipf.n = n;
+  zipf.zetan = 0;
+  for (long i = 1; i <= n; i++) zipf.zetan += 1 / pow(i, ZIPF_THETA);
+  zipf.alpha = 1 / (1 - ZIPF_THETA);
+  zipf.eta = (1 - pow(2.0 / n, 1 - ZIPF_THETA)) / (1 - zeta2 / zipf.zetan);
+  zipf.half_pow = 1 + pow(0.5, ZIPF_THETA);
+}
+
+static long zipf_next(uint64_t *seed) {
+  double u = rng_double(seed), uz = u * zipf.zetan;
+  long i;
+  if (uz < 1) return 0;
+  if (uz < zipf.half_pow) return 1;
+  i = zipf.n * pow(zipf.eta * u - zipf.eta + 1, zipf.alpha);
+  return i < zipf.n ? i : zipf.n - 1;
+}
+
+// YCSB workloads.  Inserted keys follow the loaded ones; latest is the
+// number of keys that are in for sure.
+static const struct ycsb {
+  const char *name;
+  int read, update, insert, scan, rmw;    // percentages
+  int latest;             // keys near the latest insert come up most
+} ycsb_workloads[] = {
+  { "a", 50, 50, 0, 0, 0, 0 },
+  { "b", 95, 5, 0, 0, 0, 0 },
+  { "c", 100, 0, 0, 0, 0, 0 },
+  { "d", 95, 0, 5, 0, 0, 1 },
+  { "e", 0, 0, 5, 95, 0, 0 },
+  { "f", 50, 0, 0, 0, 50, 0 },
+};
+static const struct ycsb *ycsb;
+static long next_insert, latest;
+
+// Scatters the popular keys over the key space, as YCSB does.
+static long scramble(long i, long n) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (int b = 0; b < 8; b++, i >>= 8) {
+    h ^= i & 0xff;
+    h *= 0x100000001b3ull;
+  }
+  return h % n;
+}
+
+static long ycsb_key(uint64_t *seed) {
+  long n = __atomic_load_n(&latest, __ATOMIC_ACQUIRE);
+  if (ycsb->latest) return n - 1 - zipf_next(seed) % n;
+  return scramble(zipf_next(seed), n);
+}
+
+static void ycsb_put(worker *w, long i, char *value) {
+  char key[32];
+  make_key(key, i);
+  make_value(value, &w->seed);
+  if (kvdb_put(&db, key, value)) die("kvdb_put");
+  w->put_bytes += strlen(key) + value_length;
+}
+
+static void ycsb_read(long i) {
+  char key[32];
+  make_key(key, i);
+  // may be an insert of another thread not yet in
+  free(kvdb_get(&db, key));
+}
+
+static void ycsb_scan(long i, long length) {
+  char key[32];
+  kvdb_iter_t *it = kvdb_iter_new(&db, NULL);
+  make_key(key, i);
+  if (it == NULL || kvdb_iter_seek(it, key)) die("kvdb_iter");
+  for (long n = 1; n < length && kvdb_iter_key(it, NULL) != NULL; n++)
+    if (kvdb_iter_next(it)) die("kvdb_iter_next");
+  kvdb_iter_free(it);
+}
+
+static void *ycsb_thread(void *arg) {
+  worker *w = arg;
+  char *value = malloc(value_length + 1);
+  if (value == NULL) die("malloc");
+  while (!is_done()) {
+    uint64_t start = now_ns();
+    int op = rng(&w->seed) % 100;
+    if ((op -= ycsb->read) < 0) {
+      ycsb_read(ycsb_key(&w->seed));
+    } else if ((op -= ycsb->update) < 0) {
+      ycsb_put(w, ycsb_key(&w->seed), value);
+    } else if ((op -= ycsb->insert) < 0) {
+      long i = __atomic_fetch_add(&next_insert, 1, __ATOMIC_RELAXED), n;
+      ycsb_put(w, i, value);
+      // latest follows the inserts that are all in
+      n = __atomic_load_n(&latest, __ATOMIC_RELAXED);
+      while (n == i && !__atomic_compare_exchange_n(&latest, &n, i + 1, 0,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    } else if ((op -= ycsb->scan) < 0) {
+      ycsb_scan(ycsb_key(&w->seed), 1 + rng(&w->seed) % MAX_SCAN);
+    } else {
+      long i = ycsb_key(&w->seed);
+      ycsb_read(i);
+      ycsb_put(w, i, value);
+    }
+    record(w, start);
+  }
+  free(value);
+  return NULL;
+}
+
+static worker *run_workers(void *(*fn)(void *), int writer) {
+  worker *workers = calloc(num_threads + 1, sizeof(worker));
+  if (workers == NULL) die("calloc");
+  for (int i = 0; i < num_threads + writer; i++) {
+    workers[i].id = i;
+    workers[i].seed = i + 1;
+    if (pthread_create(&workers[i].tid, NULL,
+          i < num_threads ? fn : put_thread, &workers[i]))
+      die("pthread_create");
+  }
+  usleep(run_time * 1e6);
+  __atomic_store_n(&done_flag, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < num_threads + writer; i++)
+    pthread_join(workers[i].tid, NULL);
+  return workers;
+}
+
+// The latency at quantile q of the reader threads, in microseconds.
+static double percentile(const uint64_t *latency, uint64_t ops, double q) {
+  uint64_t rank = q * ops, seen = 0;
+  int last = 0;
+  for (int i = 0; i < LAT_BUCKETS; i++) {
+    if (latency[i] == 0) continue;
+    last = i;
+    if ((seen += latency[i]) > rank) break;
+  }
+  return lat_value(last) / 1000;
+}
+
+static void usage(char *prog) {
+  printf("%s -w workload [-t threads] [-d seconds] [-n keys] [-v bytes] "
+      "[-l]\n", prog);
+  printf("\t -w get, view, get-put, or a to f for YCSB\n");
+  printf("\t -t number of reader threads\n");
+  printf("\t -d run time in seconds, default 1.0\n");
+  printf("\t -n number of keys, default 100000\n");
+  printf("\t -v bytes of a value, default 100\n");
+  printf("\t -l use the LSM tree engine\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  const char *workload = NULL;
+  int c, writer = 0;
+  void *(*fn)(void *) = NULL;
+  while ((c = getopt(argc, argv, "w:t:d:n:v:l")) != -1) {
+    switch (c) {
+      case 'w': workload = optarg; break;
+      case 't': num_threads = atoi(optarg); break;
+      case 'd': run_time = atof(optarg); break;
+      case 'n': num_keys = atol(optarg); break;
+      case 'v': value_length = atoi(optarg); break;
+      case 'l': use_lsm = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (workload == NULL || num_threads < 1 || num_keys < 2 ||
+      value_length < 1)
+    usage(argv[0]);
+  if (strcmp(workload, "get") == 0) {
+    fn = get_thread;
+  } else if (strcmp(workload, "view") == 0) {
+    fn = view_thread;
+  } else if (strcmp(workload, "get-put") == 0) {
+    fn = get_thread;
+    writer = 1;
+  } else {
+    for (size_t i = 0; i < sizeof ycsb_workloads / sizeof *ycsb_workloads;
+        i++)
+      if (strcmp(workload, ycsb_workloads[i].name) == 0)
+        ycsb = &ycsb_workloads[i];
+    if (ycsb == NULL) usage(argv[0]);
+    fn = ycsb_thread;
+    zipf_init(num_keys);
+    next_insert = latest = num_keys;
+  }
+
+  load();
+  uint64_t written = bytes_written(), ops = 0, put_bytes = 0;
+  uint64_t latency[LAT_BUCKETS] = { 0 };
+  double start = now();
+  worker *workers = run_workers(fn, writer);
+  double elapsed = now() - start;
+  for (int i = 0; i < num_threads + writer; i++) {
+    put_bytes += workers[i].put_bytes;
+    if (i >= num_threads) continue;
+    ops += workers[i].ops;
+    for (int j = 0; j < LAT_BUCKETS; j++)
+      latency[j] += workers[i].latency[j];
+  }
+  free(workers);
+  kvdb_close(&db);
+  written = bytes_written() - written;
+
+  printf("%s,%d,%ld,%llu,%.3f,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f,%ld,%.2f\n",
+      workload, num_threads, num_keys, (unsigned long long)ops, elapsed,
+      ops / elapsed, percentile(latency, ops, 0.5),
+      percentile(latency, ops, 0.95), percentile(latency, ops, 0.99),
+      percentile(latency, ops, 0.999), percentile(latency, ops, 1),
+      file_bytes(), put_bytes ? (double)written / put_bytes : 0);
+  return 0;
+}
@@ -4,9 +4,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/file.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
 
 #define KVDB_SYN    0x66666666
 
@@ -17,168 +26,4712 @@ typedef struct kvdb_entry {
   uint32_t key_hash;
 } kvdb_entry_t;
 
-static int update_size(kvdb_t *db) {
+// Keys and values are stored with their terminating NUL, so neither
+// length is 0 in a plain entry.  An entry with an empty key is a batch:
+// its value holds the entries of the batch, committed together by the
+// flag of the batch, and their own flags say how their values are stored.
+// An entry with an empty value deletes its key.
+
+// The index maps every key to its latest entry in the log.  Only hashes
+// and lengths are kept in memory; a lookup reads the key along with the
+// value and goes on probing if it turns out to be a hash collision.
+typedef struct kvdb_slot {
+  uint32_t key_hash;      // 0 if the slot is empty
+  uint32_t key_length;
+  uint32_t value_length;
+  uint32_t compressed;    // whether the value is
+  long pos;               // offset of the entry
+} kvdb_slot_t;
+
+// FNV-1a over the key and its terminating NUL.  Entries written before
+// key_hash was filled in have 0 there, which no key hashes to.
+static uint32_t hash_key(const char *key, uint32_t key_length) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < key_length; i++)
+    hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+  return hash ? hash : 1;
+}
+
+// Keys compare as bytes, NUL included, which orders them like strcmp.
+static int compare_keys(const char *a, uint32_t a_length, const char *b,
+    uint32_t b_length) {
+  int c = memcmp(a, b, a_length < b_length ? a_length : b_length);
+  return c ? c : (a_length > b_length) - (a_length < b_length);
+}
+
+// Heights of skiplist nodes.
+static uint64_t next_random(uint64_t *seed) {
+  *seed ^= *seed >> 12;
+  *seed ^= *seed << 25;
+  *seed ^= *seed >> 27;
+  return *seed * 0x2545f4914f6cdd1dull;
+}
+
+static int read_full(int fd, void *buf, size_t len, long pos) {
+  while (len > 0) {
+    ssize_t ret = pread(fd, buf, len, pos);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+    buf = (char *)buf + ret;
+    pos += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+// Appends len bytes to a buffer growing as needed.
+static int buf_append(char **buf, size_t *length, size_t *cap,
+    const void *data, size_t len) {
+  if (*length + len > *cap) {
+    size_t n = *cap ? *cap : 256;
+    char *p;
+    while (n < *length + len) n *= 2;
+    p = realloc(*buf, n);
+    if (p == NULL) return -1;
+    *buf = p;
+    *cap = n;
+  }
+  memcpy(*buf + *length, data, len);
+  *length += len;
+  return 0;
+}
+
+static int read_at(kvdb_t *db, long pos, void *buf, size_t len) {
+  return read_full(db->fd, buf, len, pos);
+}
+
+// CRC-32C (Castagnoli), with the SSE 4.2 instruction where the CPU has
+// it and a byte at a time otherwise.
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c_update)(uint32_t crc, const uint8_t *p, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+  while (len--) crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+  uint64_t word;
+  for (; len > 0 && ((uintptr_t)p & 7); len--)
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  for (; len >= 8; len -= 8, p += 8) {
+    memcpy(&word, p, sizeof word);
+    crc = __builtin_ia32_crc32di(crc, word);
+  }
+  for (; len > 0; len--) crc = __builtin_ia32_crc32qi(crc, *p++);
+  return crc;
+}
+#endif
+
+static void crc32c_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int k = 0; k < 8; k++)
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    crc32c_table[i] = crc;
+  }
+  crc32c_update = crc32c_sw;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) crc32c_update = crc32c_hw;
+#endif
+}
+
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~crc32c_update(~crc, buf, len);
+}
+
+// Logs start with a format marker: an empty batch that carries its
+// checksum.  In such a log the sync flag of every record holds the
+// CRC-32C of the rest of it, so that one fsync commits a record and a
+// torn one fails the check; entries inside batches keep the plain flag.
+// Logs written before checksums go on with the sync flags, set in a
+// second pass, until compaction rewrites them.
+#define KVDB_FORMAT_MAGIC   0x43524332    // "2CRC"
+
+static uint32_t record_crc(const kvdb_entry_t *entry, const char *data) {
+  uint32_t crc = crc32c(0, &entry->key_length,
+      sizeof *entry - sizeof entry->sync_flag);
+  return crc32c(crc, data, (size_t)entry->key_length + entry->value_length);
+}
+
+static kvdb_entry_t format_marker(void) {
+  kvdb_entry_t entry = { 0, 0, 0, KVDB_FORMAT_MAGIC };
+  entry.sync_flag = record_crc(&entry, NULL);
+  return entry;
+}
+
+static int is_format_marker(const kvdb_entry_t *entry) {
+  kvdb_entry_t marker = format_marker();
+  return memcmp(entry, &marker, sizeof marker) == 0;
+}
+
+// Compaction leaves this record after the last one of the log it
+// replaces, for readers looking there to notice.  Its flag never commits
+// it, so recovery drops it like a torn record.
+#define KVDB_MOVED_MAGIC    0x45564f4d    // "MOVE"
+
+static kvdb_entry_t moved_marker(void) {
+  kvdb_entry_t entry = { 0, 0, 0, KVDB_MOVED_MAGIC };
+  entry.sync_flag = ~record_crc(&entry, NULL);
+  return entry;
+}
+
+// Whether the record of entry, followed by data, made it whole to disk.
+static int record_committed(const kvdb_entry_t *entry, const char *data,
+    int checksums) {
+  if (!checksums) return entry->sync_flag == KVDB_SYN;
+  return entry->sync_flag == record_crc(entry, data);
+}
+
+// LZ77 in the block format of LZ4: a sequence is a token with a 4-bit
+// literal length and a 4-bit match length (less LZ_MIN_MATCH), where 15
+// is continued in bytes up to the first one below 255, the literals, and
+// a 2-byte little-endian offset back to the match.  The last sequence
+// has literals only.  Matches may reach back into a dictionary before
+// the data.
+#define LZ_HASH_BITS        12
+#define LZ_MIN_MATCH        4
+#define LZ_MAX_OFFSET       65535
+#define LZ_LAST_LITERALS    5     // LZ4 ends every block with literals
+#define LZ_MATCH_LIMIT      12    // and starts no match this close to it
+
+static uint32_t lz_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static uint32_t lz_hash(const uint8_t *p) {
+  return lz_read32(p) * 2654435761u >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_length(uint8_t *op, size_t n) {
+  for (; n >= 255; n -= 255) *op++ = 255;
+  *op++ = n;
+  return op;
+}
+
+// Compresses the length bytes at buf + start into dst, where table maps
+// hashes of 4 bytes to their last offset in buf, dictionary included.
+// Returns the compressed length, or 0 if it would exceed cap.
+static size_t lz_compress(const uint8_t *buf, size_t start, size_t length,
+    uint32_t *table, uint8_t *dst, size_t cap) {
+  const uint8_t *ip = buf + start, *anchor = ip, *end = ip + length;
+  const uint8_t *limit = length > LZ_MATCH_LIMIT ? end - LZ_MATCH_LIMIT : ip;
+  uint8_t *op = dst, *op_end = dst + cap;
+  size_t lit;
+  while (ip < limit) {
+    uint32_t h = lz_hash(ip);
+    const uint8_t *ref = buf + table[h], *m = ip + LZ_MIN_MATCH;
+    size_t match;
+    table[h] = ip - buf;
+    if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+        lz_read32(ref) != lz_read32(ip)) {
+      ip++;
+      continue;
+    }
+    for (ref += LZ_MIN_MATCH; m < end - LZ_LAST_LITERALS && *m == *ref; )
+      m++, ref++;
+    lit = ip - anchor;
+    match = m - ip - LZ_MIN_MATCH;
+    if ((size_t)(op_end - op) < lit + lit / 255 + match / 255 + 5) return 0;
+    *op++ = (lit < 15 ? lit : 15) << 4 | (match < 15 ? match : 15);
+    if (lit >= 15) op = lz_put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    *op++ = (m - ref) & 0xff;
+    *op++ = (m - ref) >> 8;
+    if (match >= 15) op = lz_put_length(op, match - 15);
+    ip = anchor = m;
+  }
+  lit = end - anchor;
+  if ((size_t)(op_end - op) < lit + lit / 255 + 2) return 0;
+  *op++ = (lit < 15 ? lit : 15) << 4;
+  if (lit >= 15) op = lz_put_length(op, lit - 15);
+  memcpy(op, anchor, lit);
+  return op + lit - dst;
+}
+
+static int lz_get_length(const uint8_t **ip, const uint8_t *ip_end,
+    size_t *n) {
+  uint8_t b;
+  do {
+    if (*ip >= ip_end) return -1;
+    *n += b = *(*ip)++;
+  } while (b == 255);
+  return 0;
+}
+
+// Decompresses src into exactly length bytes at dst.
+static int lz_decompress(const uint8_t *dict, size_t dict_length,
+    const uint8_t *src, size_t src_length, uint8_t *dst, size_t length) {
+  const uint8_t *ip = src, *ip_end = src + src_length;
+  uint8_t *op = dst, *op_end = dst + length;
+  for (;;) {
+    size_t lit, match, offset;
+    uint8_t token;
+    if (ip >= ip_end) return -1;
+    token = *ip++;
+    lit = token >> 4;
+    if (lit == 15 && lz_get_length(&ip, ip_end, &lit)) return -1;
+    if (lit > (size_t)(ip_end - ip) || lit > (size_t)(op_end - op)) return -1;
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip == ip_end) return op == op_end ? 0 : -1;
+    if (ip_end - ip < 2) return -1;
+    offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    match = token & 15;
+    if (match == 15 && lz_get_length(&ip, ip_end, &match)) return -1;
+    match += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - dst) + dict_length ||
+        match > (size_t)(op_end - op))
+      return -1;
+    if (offset > (size_t)(op - dst)) {
+      // the match starts in the dictionary and may go on into dst
+      size_t n = offset - (op - dst);
+      n = n < match ? n : match;
+      memcpy(op, dict + dict_length - (offset - (op - dst)), n);
+      op += n;
+      match -= n;
+    }
+    // byte by byte: the match may overlap what it produces
+    for (const uint8_t *ref = op - offset; match > 0; match--)
+      *op++ = *ref++;
+  }
+}
+
+// Values are compressed with a dictionary shared by the whole log: the
+// first compaction with compression on samples it from the live values
+// and stores it right after the format marker, as a batch with
+// KVDB_DICT_MAGIC for key_hash.  Compactions carry it over unchanged, so
+// a value compressed with it, or without one, always decompresses.
+#define KVDB_DICT_MAGIC     0x54434944    // "DICT"
+#define KVDB_DICT_BYTES     (32 << 10)
+#define KVDB_DICT_SAMPLE    256   // bytes taken from a value at most
+
+struct kvdb_dict {
+  uint32_t table[1 << LZ_HASH_BITS];    // as lz_compress starts with it
+  size_t length;
+  uint8_t data[];
+};
+
+static struct kvdb_dict *dict_new(const void *data, size_t length) {
+  struct kvdb_dict *dict = malloc(sizeof *dict + length);
+  if (dict == NULL) return NULL;
+  memset(dict->table, 0, sizeof dict->table);
+  dict->length = length;
+  memcpy(dict->data, data, length);
+  for (size_t i = 0; i + LZ_MIN_MATCH <= length; i++)
+    dict->table[lz_hash(dict->data + i)] = i;
+  return dict;
+}
+
+// Reads the format of the log from its first entry, and the dictionary
+// from the second one if it has one.
+static int read_format(kvdb_t *db) {
+  kvdb_entry_t entry;
+  struct kvdb_dict *dict;
+  char *data;
+  db->checksums = read_at(db, 0, &entry, sizeof entry) == 0 &&
+      is_format_marker(&entry);
+  if (!db->checksums || db->dict != NULL ||
+      read_at(db, sizeof entry, &entry, sizeof entry) ||
+      entry.key_length != 0 || entry.key_hash != KVDB_DICT_MAGIC)
+    return 0;
+  if ((data = malloc(entry.value_length)) == NULL) return -1;
+  if (read_at(db, 2 * sizeof entry, data, entry.value_length) ||
+      !record_committed(&entry, data, 1) ||
+      (dict = dict_new(data, entry.value_length)) == NULL) {
+    free(data);
+    return -1;
+  }
+  free(data);
+  // writers compress with it without the mutex
+  __atomic_store_n(&db->dict, dict, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Compressed values are stored in entries with KVDB_LZ for their flag,
+// which only entries of batches have: the length of the value, NUL
+// included, in 32 bits, then the LZ4 block, then a NUL like any value.
+#define KVDB_LZ             0x5a5a5a5a
+#define KVDB_COMPRESS_MIN   32    // bytes below which values stay as they are
+
+// Compresses a value and its NUL into malloc'd memory, as it is stored
+// but for the last NUL, which follows.  Returns NULL unless that saves
+// more than overhead bytes.
+static char *compress_value(const struct kvdb_dict *dict, const void *value,
+    size_t value_length, size_t overhead, size_t *length) {
+  size_t start = dict != NULL ? dict->length : 0, cap;
+  uint32_t raw_length = value_length + 1, table[1 << LZ_HASH_BITS];
+  uint8_t *buf;
+  char *out;
+  if (value_length < KVDB_COMPRESS_MIN ||
+      value_length + 1 <= overhead + sizeof raw_length + 1)
+    return NULL;
+  cap = value_length + 1 - overhead - sizeof raw_length - 1;
+  buf = malloc(start + value_length + 1);
+  out = malloc(sizeof raw_length + cap + 1);
+  if (buf == NULL || out == NULL) goto fret;
+  if (dict != NULL) {
+    memcpy(buf, dict->data, start);
+    memcpy(table, dict->table, sizeof table);
+  } else {
+    memset(table, 0, sizeof table);
+  }
+  memcpy(buf + start, value, value_length);
+  buf[start + value_length] = '\0';
+  *length = lz_compress(buf, start, value_length + 1, table,
+      (uint8_t *)out + sizeof raw_length, cap - 1);
+  if (*length == 0) goto fret;
+  memcpy(out, &raw_length, sizeof raw_length);
+  *length += sizeof raw_length;
+  out[*length] = '\0';
+  free(buf);
+  return out;
+fret:
+  free(buf);
+  free(out);
+  return NULL;
+}
+
+// Decompresses a value stored compressed, as it is stored, NUL included,
+// into malloc'd memory.
+static char *inflate_value(kvdb_t *db, const char *value,
+    uint32_t value_length, uint32_t *length) {
+  struct kvdb_dict *dict = __atomic_load_n(&db->dict, __ATOMIC_ACQUIRE);
+  uint32_t raw_length;
+  char *buf;
+  if (value_length < sizeof raw_length + 1) return NULL;
+  memcpy(&raw_length, value, sizeof raw_length);
+  // a sequence of LZ4 grows by 255 bytes a byte at most
+  if (raw_length == 0 || raw_length / 255 > value_length ||
+      (buf = malloc(raw_length)) == NULL)
+    return NULL;
+  if (lz_decompress(dict != NULL ? dict->data : NULL,
+        dict != NULL ? dict->length : 0,
+        (const uint8_t *)value + sizeof raw_length,
+        value_length - sizeof raw_length - 1, (uint8_t *)buf, raw_length) ||
+      buf[raw_length - 1]) {
+    free(buf);
+    return NULL;
+  }
+  *length = raw_length;
+  return buf;
+}
+
+// Decompressed values of the log and blocks of LSM tables, so that hot
+// keys are neither decompressed nor read again on every lookup.  Entries
+// are named by where they are stored: a file, which is a generation of
+// the log or the number of a table, and an offset in it.  What is there
+// never changes, so appends by other processes cannot make an entry
+// stale.  Every shard has its own lock, its share of the byte budget and
+// a CLOCK hand that goes round its entries, evicting those not used since
+// it last passed.
+#define KVDB_CACHE_SHARDS   16
+#define KVDB_CACHE_BYTES    (8L << 20)    // budget by default
+
+typedef struct kvdb_cache_entry {
+  struct kvdb_cache_entry *next;    // in its bucket
+  uint64_t file;
+  long pos;
+  size_t length;
+  int referenced;
+  char data[];
+} kvdb_cache_entry_t;
+
+struct kvdb_cache_shard {
+  pthread_mutex_t mutex;
+  kvdb_cache_entry_t **buckets;
+  size_t nr_buckets;
+  kvdb_cache_entry_t **clock;       // all entries, in no particular order
+  size_t nr_entries, cap, hand;
+  size_t bytes;
+  uint64_t hits, misses;
+} __attribute__((aligned(64)));
+
+struct kvdb_cache {
+  size_t budget;
+  struct kvdb_cache_shard shards[KVDB_CACHE_SHARDS];
+};
+
+static struct kvdb_cache *cache_new(void) {
+  struct kvdb_cache *cache;
+  if (posix_memalign((void **)&cache, 64, sizeof *cache)) return NULL;
+  memset(cache, 0, sizeof *cache);
+  cache->budget = KVDB_CACHE_BYTES;
+  for (int i = 0; i < KVDB_CACHE_SHARDS; i++) {
+    if (pthread_mutex_init(&cache->shards[i].mutex, NULL)) {
+      while (i-- > 0) pthread_mutex_destroy(&cache->shards[i].mutex);
+      free(cache);
+      return NULL;
+    }
+  }
+  return cache;
+}
+
+static void cache_free(struct kvdb_cache *cache) {
+  if (cache == NULL) return;
+  for (int i = 0; i < KVDB_CACHE_SHARDS; i++) {
+    struct kvdb_cache_shard *shard = &cache->shards[i];
+    for (size_t j = 0; j < shard->nr_entries; j++) free(shard->clock[j]);
+    free(shard->clock);
+    free(shard->buckets);
+    pthread_mutex_destroy(&shard->mutex);
+  }
+  free(cache);
+}
+
+static uint64_t cache_hash(uint64_t file, long pos) {
+  uint64_t h = (file * 0x9e3779b97f4a7c15ull) ^ (uint64_t)pos;
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ull;
+  return h ^ h >> 29;
+}
+
+// The link to the entry for file and pos in its bucket, or to the NULL
+// at the end of the bucket.  The caller holds the lock of the shard.
+static kvdb_cache_entry_t **cache_link(struct kvdb_cache_shard *shard,
+    uint64_t hash, uint64_t file, long pos) {
+  kvdb_cache_entry_t **p;
+  if (shard->nr_buckets == 0) return NULL;
+  p = &shard->buckets[(hash >> 4) & (shard->nr_buckets - 1)];
+  while (*p != NULL && ((*p)->file != file || (*p)->pos != pos))
+    p = &(*p)->next;
+  return p;
+}
+
+// Evicts entries until the shard holds at most limit bytes.
+static void cache_evict(struct kvdb_cache_shard *shard, size_t limit) {
+  while (shard->bytes > limit && shard->nr_entries > 0) {
+    kvdb_cache_entry_t *e = shard->clock[shard->hand], **p;
+    if (e->referenced) {
+      e->referenced = 0;
+      shard->hand = (shard->hand + 1) % shard->nr_entries;
+      continue;
+    }
+    p = cache_link(shard, cache_hash(e->file, e->pos), e->file, e->pos);
+    *p = e->next;
+    shard->bytes -= sizeof *e + e->length;
+    shard->clock[shard->hand] = shard->clock[--shard->nr_entries];
+    if (shard->hand >= shard->nr_entries) shard->hand = 0;
+    free(e);
+  }
+}
+
+// Doubles the buckets of a shard, or makes its first ones.
+static int cache_grow(struct kvdb_cache_shard *shard) {
+  size_t n = shard->nr_buckets ? shard->nr_buckets * 2 : 64;
+  kvdb_cache_entry_t **buckets = calloc(n, sizeof *buckets);
+  if (buckets == NULL) return -1;
+  for (size_t i = 0; i < shard->nr_entries; i++) {
+    kvdb_cache_entry_t *e = shard->clock[i];
+    size_t b = (cache_hash(e->file, e->pos) >> 4) & (n - 1);
+    e->next = buckets[b];
+    buckets[b] = e;
+  }
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->nr_buckets = n;
+  return 0;
+}
+
+// Returns a copy from malloc of what the cache has for file and pos,
+// with its length in *length, or NULL.
+static char *cache_get(struct kvdb_cache *cache, uint64_t file, long pos,
+    size_t *length) {
+  uint64_t hash = cache_hash(file, pos);
+  struct kvdb_cache_shard *shard;
+  kvdb_cache_entry_t **p;
+  char *buf = NULL;
+  if (cache == NULL) return NULL;
+  shard = &cache->shards[hash % KVDB_CACHE_SHARDS];
+  pthread_mutex_lock(&shard->mutex);
+  p = cache_link(shard, hash, file, pos);
+  if (p != NULL && *p != NULL) {
+    (*p)->referenced = 1;
+    shard->hits++;
+    if ((buf = malloc((*p)->length)) != NULL) {
+      memcpy(buf, (*p)->data, (*p)->length);
+      *length = (*p)->length;
+    }
+  } else {
+    shard->misses++;
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  return buf;
+}
+
+// Keeps a copy of length bytes for file and pos, unless they would take
+// more than the share of a shard.  Failing to is no error.
+static void cache_put(struct kvdb_cache *cache, uint64_t file, long pos,
+    const void *data, size_t length) {
+  uint64_t hash = cache_hash(file, pos);
+  struct kvdb_cache_shard *shard;
+  kvdb_cache_entry_t *e, **p;
+  size_t share;
+  if (cache == NULL) return;
+  share = __atomic_load_n(&cache->budget, __ATOMIC_RELAXED) /
+      KVDB_CACHE_SHARDS;
+  if (sizeof *e + length > share || (e = malloc(sizeof *e + length)) == NULL)
+    return;
+  e->file = file;
+  e->pos = pos;
+  e->length = length;
+  e->referenced = 0;
+  memcpy(e->data, data, length);
+  shard = &cache->shards[hash % KVDB_CACHE_SHARDS];
+  pthread_mutex_lock(&shard->mutex);
+  cache_evict(shard, share - sizeof *e - length);
+  if (shard->nr_entries == shard->cap) {
+    size_t cap = shard->cap ? shard->cap * 2 : 64;
+    kvdb_cache_entry_t **clock = realloc(shard->clock, cap * sizeof *clock);
+    if (clock == NULL) goto fret;
+    shard->clock = clock;
+    shard->cap = cap;
+  }
+  if (shard->nr_entries >= shard->nr_buckets && cache_grow(shard)) goto fret;
+  p = cache_link(shard, hash, file, pos);
+  // another reader may have been quicker
+  if (*p != NULL) goto fret;
+  *p = e;
+  e->next = NULL;
+  shard->clock[shard->nr_entries++] = e;
+  shard->bytes += sizeof *e + length;
+  pthread_mutex_unlock(&shard->mutex);
+  return;
+fret:
+  pthread_mutex_unlock(&shard->mutex);
+  free(e);
+}
+
+// Bytes of the log held by the entry of a slot, unless it is a deletion.
+static long live_length(const kvdb_slot_t *slot) {
+  if (slot->value_length == 0) return 0;
+  return sizeof(kvdb_entry_t) + slot->key_length + slot->value_length;
+}
+
+// Readers take no lock.  A reader enters a read-side critical section
+// in one of the two phases, then checks db->seq before and after its
+// lookup and starts over if a writer changed the index in between.
+// Writers change the index in place between write_begin and write_end,
+// and retire what they replace rather than freeing it: once every reader
+// of the current phase is gone, no reader can still be using it.
+#define KVDB_READER_SHARDS  16
+
+struct kvdb_readers {
+  long count[2];          // readers in each phase
+} __attribute__((aligned(64)));
+
+static int next_reader_shard;
+static __thread int reader_shard = -1;
+
+static int read_lock(kvdb_t *db) {
+  struct kvdb_readers *r;
+  if (reader_shard < 0)
+    reader_shard = __atomic_fetch_add(&next_reader_shard, 1,
+        __ATOMIC_RELAXED) % KVDB_READER_SHARDS;
+  r = &db->readers[reader_shard];
+  for (;;) {
+    int phase = __atomic_load_n(&db->reader_phase, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&r->count[phase], 1, __ATOMIC_SEQ_CST);
+    // a writer waiting for this phase may have missed us
+    if (__atomic_load_n(&db->reader_phase, __ATOMIC_SEQ_CST) == phase)
+      return phase;
+    __atomic_fetch_sub(&r->count[phase], 1, __ATOMIC_RELEASE);
+  }
+}
+
+static void read_unlock(kvdb_t *db, int phase) {
+  __atomic_fetch_sub(&db->readers[reader_shard].count[phase], 1,
+      __ATOMIC_RELEASE);
+}
+
+// Waits for the readers that started before the call.  Called by
+// writers, with the mutex held.
+static void synchronize(kvdb_t *db) {
+  int phase = db->reader_phase;
+  __atomic_store_n(&db->reader_phase, !phase, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < KVDB_READER_SHARDS; i++)
+    while (__atomic_load_n(&db->readers[i].count[phase], __ATOMIC_ACQUIRE))
+      sched_yield();
+}
+
+static void write_begin(kvdb_t *db) {
+  __atomic_fetch_add(&db->seq, 1, __ATOMIC_SEQ_CST);
+}
+
+static void write_end(kvdb_t *db) {
+  __atomic_fetch_add(&db->seq, 1, __ATOMIC_RELEASE);
+}
+
+typedef struct kvdb_map {
+  struct kvdb_map *next;
+  void *addr;
+  size_t length;          // 0 for memory from malloc
+  int log;                // a mapping of the log, which views point into
+} kvdb_map_t;
+
+static void release(void *addr, size_t length) {
+  if (length) munmap(addr, length);
+  else free(addr);
+}
+
+// Returns -1 if it had to free addr right away.
+static int retire(kvdb_t *db, void *addr, size_t length, int log) {
+  kvdb_map_t *m;
+  if (addr == NULL) return 0;
+  m = malloc(sizeof *m);
+  if (m == NULL) {
+    synchronize(db);
+    release(addr, length);
+    return -1;
+  }
+  m->addr = addr;
+  m->length = length;
+  m->log = log;
+  m->next = db->retired;
+  db->retired = m;
+  return 0;
+}
+
+// Views into mappings of the log end with the next mutation.  A process
+// that only reads keeps the newest KVDB_RETIRED_LOGS of them instead,
+// which other processes replace by compacting or growing the log.
+#define KVDB_RETIRED_LOGS   4
+
+// Frees what has been retired, but the newest keep mappings of the log.
+static void free_retired(kvdb_t *db, int keep) {
+  kvdb_map_t **p = &db->retired, *m;
+  int logs = 0;
+  if (*p == NULL) return;
+  synchronize(db);
+  while ((m = *p) != NULL) {
+    // the list is newest first
+    if (m->log && ++logs <= keep) {
+      p = &m->next;
+      continue;
+    }
+    *p = m->next;
+    release(m->addr, m->length);
+    free(m);
+  }
+}
+
+static void index_release(kvdb_t *db) {
+  if (db->index_map != NULL)
+    retire(db, db->index_map, db->index_map_length, 0);
+  else
+    retire(db, db->slots, 0, 0);
+  db->index_map = NULL;
+  db->slots = NULL;
+}
+
+static int index_grow(kvdb_t *db) {
+  size_t nr_slots = db->nr_slots ? db->nr_slots * 2 : 1024;
+  kvdb_slot_t *slots = calloc(nr_slots, sizeof *slots);
+  if (slots == NULL) return -1;
+  for (size_t i = 0; i < db->nr_slots; i++) {
+    if (db->slots[i].key_hash == 0) continue;
+    size_t j = db->slots[i].key_hash & (nr_slots - 1);
+    while (slots[j].key_hash) j = (j + 1) & (nr_slots - 1);
+    slots[j] = db->slots[i];
+  }
+  index_release(db);
+  db->slots = slots;
+  db->nr_slots = nr_slots;
+  return 0;
+}
+
+// Points to the length bytes of the log at pos inside the mapping, or
+// is NULL if the mapping does not cover them.
+static const char *map_at(const kvdb_t *db, long pos, size_t length) {
+  if (pos < 0 || (size_t)pos > db->map_length ||
+      db->map_length - pos < length)
+    return NULL;
+  return db->map + pos;
+}
+
+// Returns 1 if the entries at pos1 and pos2, both with keys of
+// key_length bytes, have the same key, 0 if not and -1 on error.  Keys
+// are compared in the mapping; only an entry just appended past it is
+// read from the file.
+static int same_key(kvdb_t *db, long pos1, long pos2, uint32_t key_length) {
+  const char *key1 = map_at(db, pos1 + sizeof(kvdb_entry_t), key_length);
+  const char *key2 = map_at(db, pos2 + sizeof(kvdb_entry_t), key_length);
+  int ret = -1;
+  char *buf;
+  if (key1 != NULL && key2 != NULL) return memcmp(key1, key2, key_length) == 0;
+  if ((buf = malloc(2 * (size_t)key_length)) == NULL) return -1;
+  if (read_at(db, pos1 + sizeof(kvdb_entry_t), buf, key_length) == 0 &&
+      read_at(db, pos2 + sizeof(kvdb_entry_t), buf + key_length,
+        key_length) == 0)
+    ret = memcmp(buf, buf + key_length, key_length) == 0;
+  free(buf);
+  return ret;
+}
+
+// The ordered index, a skiplist of the live keys, is built for the
+// first iterator and kept up to date by index_insert from then on.
+// Nodes hold the offsets of the entries, whose keys are read through
+// the mapping of the log.  Only code holding db->mutex touches it;
+// compaction and switching to another file drop it.
+#define KVDB_ORDER_HEIGHT   16
+
+typedef struct kvdb_order_node {
+  long pos;
+  uint32_t key_length;
+  int height;
+  int compressed;
+  struct kvdb_order_node *next[];
+} kvdb_order_node_t;
+
+struct kvdb_order {
+  int height;
+  uint64_t seed;
+  kvdb_order_node_t head;     // followed by KVDB_ORDER_HEIGHT pointers
+};
+
+#define order_key(db, node)   ((db)->map + (node)->pos + sizeof(kvdb_entry_t))
+
+static void order_free(kvdb_t *db) {
+  if (db->order == NULL) return;
+  for (kvdb_order_node_t *node = db->order->head.next[0], *next;
+      node != NULL; node = next) {
+    next = node->next[0];
+    free(node);
+  }
+  free(db->order);
+  db->order = NULL;
+}
+
+// Returns the first node with a key not less than key, and puts its
+// predecessors into prev unless it is NULL.
+static kvdb_order_node_t *order_seek(kvdb_t *db, const char *key,
+    uint32_t key_length, kvdb_order_node_t **prev) {
+  kvdb_order_node_t *node = &db->order->head, *next;
+  for (int level = db->order->height - 1; level >= 0; level--) {
+    while ((next = node->next[level]) != NULL && compare_keys(
+          order_key(db, next), next->key_length, key, key_length) < 0)
+      node = next;
+    if (prev != NULL) prev[level] = node;
+  }
+  return node->next[0];
+}
+
+// Points the key of the committed entry at pos to it, or takes the key
+// out for a deletion.  The entry has to be in the mapping.
+static int order_update(kvdb_t *db, const kvdb_entry_t *entry, long pos) {
+  struct kvdb_order *order = db->order;
+  kvdb_order_node_t *prev[KVDB_ORDER_HEIGHT], *node;
+  const char *key = db->map + pos + sizeof *entry;
+  int height = 1;
+  if ((size_t)pos + sizeof *entry + entry->key_length > db->map_length)
+    return -1;
+  node = order_seek(db, key, entry->key_length, prev);
+  if (node != NULL && compare_keys(order_key(db, node), node->key_length,
+        key, entry->key_length) == 0) {
+    if (entry->value_length) {
+      node->pos = pos;
+      node->compressed = entry->sync_flag == KVDB_LZ;
+      return 0;
+    }
+    for (int level = 0; level < node->height; level++)
+      prev[level]->next[level] = node->next[level];
+    free(node);
+    return 0;
+  }
+  if (entry->value_length == 0) return 0;
+  while (height < KVDB_ORDER_HEIGHT && (next_random(&order->seed) & 3) == 0)
+    height++;
+  node = malloc(sizeof *node + height * sizeof node->next[0]);
+  if (node == NULL) return -1;
+  node->pos = pos;
+  node->key_length = entry->key_length;
+  node->height = height;
+  node->compressed = entry->sync_flag == KVDB_LZ;
+  for (int level = order->height; level < height; level++)
+    prev[level] = &order->head;
+  if (height > order->height) order->height = height;
+  for (int level = 0; level < height; level++) {
+    node->next[level] = prev[level]->next[level];
+    prev[level]->next[level] = node;
+  }
+  return 0;
+}
+
+// Builds the ordered index from the index.  Called with db->mutex held,
+// right after update_size, so the whole log is in the mapping.
+static int order_build(kvdb_t *db) {
+  db->order = calloc(1, sizeof *db->order +
+      KVDB_ORDER_HEIGHT * sizeof(kvdb_order_node_t *));
+  if (db->order == NULL) return -1;
+  db->order->height = 1;
+  db->order->seed = 0x9e3779b97f4a7c15ull;
+  for (size_t i = 0; i < db->nr_slots; i++) {
+    const kvdb_slot_t *slot = &db->slots[i];
+    kvdb_entry_t entry;
+    if (slot->key_hash == 0 || slot->value_length == 0) continue;
+    entry.sync_flag = slot->compressed ? KVDB_LZ : KVDB_SYN;
+    entry.key_length = slot->key_length;
+    entry.value_length = slot->value_length;
+    if (order_update(db, &entry, slot->pos)) {
+      order_free(db);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Points the key of the committed entry at pos to that entry, which has
+// the flag it would have in a batch.  A deletion of a key the index has
+// stays in its slot until compaction, so that probing goes on past it;
+// one of a key it lacks needs none.
+static int index_insert(kvdb_t *db, const kvdb_entry_t *entry, long pos) {
+  uint32_t hash = entry->key_hash;
+  kvdb_slot_t *slot;
+  if (hash == 0) {
+    char *key = malloc(entry->key_length);
+    if (key == NULL) return -1;
+    if (read_at(db, pos + sizeof *entry, key, entry->key_length)) {
+      free(key);
+      return -1;
+    }
+    hash = hash_key(key, entry->key_length);
+    free(key);
+  }
+  if ((db->nr_used + 1) * 2 > db->nr_slots && index_grow(db)) return -1;
+  for (size_t i = hash & (db->nr_slots - 1); ;
+      i = (i + 1) & (db->nr_slots - 1)) {
+    slot = &db->slots[i];
+    if (slot->key_hash == 0) {
+      if (entry->value_length == 0) return 0;
+      db->nr_used++;
+      break;
+    }
+    if (slot->key_hash == hash && slot->key_length == entry->key_length) {
+      int same = same_key(db, slot->pos, pos, entry->key_length);
+      if (same < 0) return -1;
+      if (same) {
+        db->live_bytes -= live_length(slot);
+        break;
+      }
+    }
+  }
+  slot->key_hash = hash;
+  slot->key_length = entry->key_length;
+  slot->value_length = entry->value_length;
+  slot->compressed = entry->sync_flag == KVDB_LZ;
+  slot->pos = pos;
+  db->live_bytes += live_length(slot);
+  // the next iterator builds it again
+  if (db->order != NULL && order_update(db, entry, pos)) order_free(db);
+  return 0;
+}
+
+// Indexes a committed entry, or all entries of a committed batch.
+static int index_record(kvdb_t *db, const kvdb_entry_t *entry, long pos) {
+  long end = pos + sizeof *entry + entry->value_length;
+  if (entry->key_length) {
+    kvdb_entry_t plain = *entry;
+    plain.sync_flag = KVDB_SYN;
+    return index_insert(db, &plain, pos);
+  }
+  if (entry->key_hash == KVDB_DICT_MAGIC) return 0;
+  for (pos += sizeof *entry; pos < end; ) {
+    const char *p = map_at(db, pos, sizeof(kvdb_entry_t));
+    kvdb_entry_t inner;
+    if (p != NULL) memcpy(&inner, p, sizeof inner);
+    else if (read_at(db, pos, &inner, sizeof inner)) return -1;
+    if (inner.key_length == 0 ||
+        pos + (long)sizeof inner + inner.key_length + inner.value_length > end)
+      return -1;
+    if (index_insert(db, &inner, pos)) return -1;
+    pos += sizeof inner + inner.key_length + inner.value_length;
+  }
+  return 0;
+}
+
+static void load_index(kvdb_t *db);
+
+// Moves the current mapping to the retired ones.
+static void retire_map(kvdb_t *db) {
+  retire(db, db->map, db->map_length, 1);
+  db->map = NULL;
+  db->map_length = 0;
+}
+
+// Makes the mapping cover the first size bytes of the log.  Pages past
+// the end of the file are never touched.
+static int map_log(kvdb_t *db, long size) {
+  size_t length = 64 << 20;
+  char *map;
+  if ((size_t)size <= db->map_length) return 0;
+  while (length < 2 * (size_t)size) length *= 2;
+  map = mmap(NULL, length, PROT_READ, MAP_SHARED, db->fd, 0);
+  if (map == MAP_FAILED) return -1;
+  retire_map(db);
+  db->map = map;
+  db->map_length = length;
+  return 0;
+}
+
+// Switches to the file now at db->path, which compaction has put there,
+// and takes the same lock on it.  Closing the old file drops its lock.
+static int reopen_log(kvdb_t *db, int lock) {
+  struct stat st;
+  int fd = open(db->path, O_RDWR);
+  if (fd < 0) return -1;
+  FILE *fp = fdopen(fd, "r+");
+  if (fp == NULL) {
+    close(fd);
+    return -1;
+  }
+  if (flock(fd, lock) || fstat(fd, &st)) {
+    fclose(fp);
+    return -1;
+  }
+  retire_map(db);
+  fclose(db->fp);
+  db->fp = fp;
+  db->fd = fd;
+  db->dev = st.st_dev;
+  db->ino = st.st_ino;
+  db->generation++;
+  index_release(db);
+  order_free(db);
+  db->nr_slots = db->nr_used = 0;
+  db->size = db->last_pos = db->index_size = db->live_bytes = 0;
+  if (read_format(db)) return -1;
+  load_index(db);
+  return 0;
+}
+
+// Catches up with the entries committed since the last call.  The
+// caller holds the mutex and the flock given by lock, so compaction
+// cannot replace the file between the stat and the reads.
+static int update_size(kvdb_t *db, int lock) {
+  kvdb_entry_t entry;
+  struct stat st;
+  int ret = -1;
+  // nobody else writes to a log the process owns
+  if (db->exclusive && (size_t)db->size <= db->map_length) return 0;
+  // one stat of the path gives both the file and its size
+  if (stat(db->path, &st)) return -1;
+  if (st.st_dev == db->dev && st.st_ino == db->ino &&
+      st.st_size == db->size && (size_t)db->size <= db->map_length)
+    return 0;
+  write_begin(db);
+  if (st.st_dev != db->dev || st.st_ino != db->ino) {
+    if (reopen_log(db, lock) || fstat(db->fd, &st)) goto fret;
+  }
+  if (map_log(db, st.st_size)) goto fret;
+  while (db->size + (long)sizeof entry <= st.st_size) {
+    memcpy(&entry, db->map + db->size, sizeof entry);
+    long end = db->size + sizeof entry + entry.key_length + entry.value_length;
+    if (end > st.st_size) break;
+    // another process may have started the log since we opened it
+    if (db->size == 0 && read_format(db)) goto fret;
+    if (!record_committed(&entry, db->map + db->size + sizeof entry,
+          db->checksums))
+      break;
+    if (index_record(db, &entry, db->size)) goto fret;
+    db->last_pos = db->size;
+    db->size = end;
+  }
+  ret = 0;
+fret:
+  write_end(db);
+  if (ret == 0 && st.st_size > db->size) return ftruncate(db->fd, db->size);
+  return ret;
+}
+
+// Takes the flock given by lock on the log, as every call that reads or
+// writes it past the snapshot of readers does, unless the process owns it.
+static int log_lock(kvdb_t *db, int lock) {
+  return db->exclusive ? 0 : flock(db->fd, lock);
+}
+
+static void log_unlock(kvdb_t *db) {
+  if (!db->exclusive) flock(db->fd, LOCK_UN);
+}
+
+// The index is checkpointed to <filename>.idx: this header, then the
+// slots as they are in memory.  kvdb_open maps the file and only replays
+// the entries committed after size.
+#define KVDB_INDEX_MAGIC    0x32584449    // "IDX2"
+
+// open and close checkpoint the index once this much of the log is not
+// covered by the last checkpoint
+#define KVDB_CHECKPOINT_BYTES   (1L << 20)
+
+typedef struct kvdb_index_header {
+  uint32_t magic;
+  uint32_t slot_size;     // sizeof(kvdb_slot_t) of the writer
+  uint32_t checksum;      // CRC-32C of the header and the slots
+  uint32_t last_flag;     // first word of the record at last_pos
+  uint64_t dev, ino;      // the log file the index belongs to
+  int64_t size;           // the index covers the log up to here
+  int64_t last_pos;       // offset of the last record before size
+  uint64_t nr_slots, nr_used;
+} kvdb_index_header_t;
+
+static int write_all(int fd, const void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write(fd, buf, len);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+    buf = (const char *)buf + ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+static uint32_t index_checksum(kvdb_index_header_t hdr, const void *slots) {
+  hdr.checksum = 0;
+  return crc32c(crc32c(0, &hdr, sizeof hdr), slots,
+      hdr.nr_slots * sizeof(kvdb_slot_t));
+}
+
+// Checks that a checkpoint is intact and describes a prefix of this log.
+static int index_valid(kvdb_t *db, kvdb_index_header_t *hdr, size_t length) {
+  struct stat st;
+  kvdb_entry_t entry;
+  if (hdr->magic != KVDB_INDEX_MAGIC ||
+      hdr->slot_size != sizeof(kvdb_slot_t) ||
+      hdr->nr_slots & (hdr->nr_slots - 1) ||
+      hdr->nr_used * 2 > hdr->nr_slots ||
+      length != sizeof *hdr + hdr->nr_slots * sizeof(kvdb_slot_t))
+    return 0;
+  if (fstat(db->fd, &st) || st.st_dev != hdr->dev || st.st_ino != hdr->ino ||
+      st.st_size < hdr->size)
+    return 0;
+  // the log may have been replaced by a file with the same inode number
+  if (hdr->size > 0 && (read_at(db, hdr->last_pos, &entry, sizeof entry) ||
+        entry.sync_flag != (db->checksums ? hdr->last_flag : KVDB_SYN) ||
+        hdr->last_pos + (long)sizeof entry + entry.key_length +
+        entry.value_length != hdr->size))
+    return 0;
+  return index_checksum(*hdr, hdr + 1) == hdr->checksum;
+}
+
+// Any problem with the checkpoint just leaves the index empty.
+static void load_index(kvdb_t *db) {
+  struct stat st;
+  int fd = open(db->index_path, O_RDONLY);
+  if (fd < 0) return;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(kvdb_index_header_t)) {
+    // private and writable: the slots are updated in place
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+        fd, 0);
+    if (map != MAP_FAILED) {
+      kvdb_index_header_t *hdr = map;
+      if (index_valid(db, hdr, st.st_size)) {
+        db->index_map = map;
+        db->index_map_length = st.st_size;
+        db->slots = (kvdb_slot_t *)(hdr + 1);
+        db->nr_slots = hdr->nr_slots;
+        db->nr_used = hdr->nr_used;
+        db->size = db->index_size = hdr->size;
+        db->last_pos = hdr->last_pos;
+        for (size_t i = 0; i < db->nr_slots; i++)
+          if (db->slots[i].key_hash)
+            db->live_bytes += live_length(&db->slots[i]);
+      } else {
+        munmap(map, st.st_size);
+      }
+    }
+  }
+  close(fd);
+}
+
+// Writes the checkpoint to a temporary file and renames it over the old
+// one, so that readers never see a partial checkpoint.
+static int write_index(kvdb_t *db) {
+  struct stat st;
+  kvdb_index_header_t hdr;
+  char *tmp;
+  int fd;
+  if (fstat(db->fd, &st)) return -1;
+  memset(&hdr, 0, sizeof hdr);
+  hdr.magic = KVDB_INDEX_MAGIC;
+  hdr.slot_size = sizeof(kvdb_slot_t);
+  hdr.dev = st.st_dev;
+  hdr.ino = st.st_ino;
+  hdr.size = db->size;
+  hdr.nr_slots = db->nr_slots;
+  hdr.nr_used = db->nr_used;
+  hdr.last_pos = db->last_pos;
+  if (hdr.size > 0 &&
+      read_at(db, hdr.last_pos, &hdr.last_flag, sizeof hdr.last_flag))
+    return -1;
+  hdr.checksum = index_checksum(hdr, db->slots);
+  tmp = malloc(strlen(db->index_path) + 16);
+  if (tmp == NULL) return -1;
+  sprintf(tmp, "%s.%d", db->index_path, (int)getpid());
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) goto fret1;
+  if (write_all(fd, &hdr, sizeof hdr) ||
+      write_all(fd, db->slots, db->nr_slots * sizeof(kvdb_slot_t)) ||
+      fsync(fd)) {
+    close(fd);
+    goto fret2;
+  }
+  if (close(fd) || rename(tmp, db->index_path)) goto fret2;
+  db->index_size = db->size;
+  free(tmp);
+  return 0;
+fret2:
+  unlink(tmp);
+fret1:
+  free(tmp);
+  return -1;
+}
+
+// Compaction copies the entries the index points to, deletions aside,
+// to <filename>.compact and renames that over the log, all under the
+// exclusive flock.  Processes that still have the old log open notice
+// the rename in update_size.  Writers start it once the log has grown to
+// KVDB_COMPACT_BYTES and no more than half of it is live.
+#define KVDB_COMPACT_BYTES  (4L << 20)
+
+static int compare_pos(const void *a, const void *b) {
+  long x = (*(kvdb_slot_t *const *)a)->pos;
+  long y = (*(kvdb_slot_t *const *)b)->pos;
+  return (x > y) - (x < y);
+}
+
+static int fsync_dir(const char *path) {
+  int fd, ret = -1;
+  char *dir = strdup(path), *slash;
+  if (dir == NULL) return -1;
+  slash = strrchr(dir, '/');
+  if (slash == NULL) strcpy(dir, ".");
+  else slash[slash == dir] = '\0';
+  fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    ret = fsync(fd);
+    close(fd);
+  }
+  free(dir);
+  return ret;
+}
+
+// With compression on, compaction writes the entries in batches of about
+// KVDB_BLOCK_BYTES, which share the checksummed header of the batch, with
+// every value compressed that gets smaller.
+#define KVDB_BLOCK_BYTES    4096
+
+// The new log of a compaction.  A record is built in buf and written
+// out whole: one plain entry, or a batch of them with blocks set.
+typedef struct compact_out {
+  FILE *fp;
+  int blocks;
+  long pos;               // of the record in buf
+  long last;              // of the last record written
+  char *buf;
+  size_t length, cap;
+} compact_out_t;
+
+static int out_flush(compact_out_t *out) {
+  uint32_t crc;
+  if (out->length == 0) return 0;
+  if (out->blocks) {
+    kvdb_entry_t batch = { 0, 0, out->length - sizeof batch, 0 };
+    memcpy(out->buf, &batch, sizeof batch);
+  }
+  crc = crc32c(0, out->buf + sizeof crc, out->length - sizeof crc);
+  memcpy(out->buf, &crc, sizeof crc);
+  if (fwrite(out->buf, 1, out->length, out->fp) < out->length) return -1;
+  out->last = out->pos;
+  out->pos += out->length;
+  out->length = 0;
+  return 0;
+}
+
+// Adds an entry to the new log, and returns its offset there or -1.
+static long out_add(compact_out_t *out, const kvdb_entry_t *entry,
+    const char *key, const char *value) {
+  kvdb_entry_t batch = { 0, 0, 0, 0 };   // out_flush fills it in
+  long pos;
+  if (out->blocks && out->length == 0 &&
+      buf_append(&out->buf, &out->length, &out->cap, &batch, sizeof batch))
+    return -1;
+  pos = out->pos + out->length;
+  if (buf_append(&out->buf, &out->length, &out->cap, entry, sizeof *entry) ||
+      buf_append(&out->buf, &out->length, &out->cap, key,
+        entry->key_length) ||
+      buf_append(&out->buf, &out->length, &out->cap, value,
+        entry->value_length))
+    return -1;
+  if ((!out->blocks || out->length >= KVDB_BLOCK_BYTES) && out_flush(out))
+    return -1;
+  return pos;
+}
+
+// Reads the value of a live slot, decompressed.
+static char *read_value(kvdb_t *db, const kvdb_slot_t *slot,
+    uint32_t *length) {
+  char *buf = malloc(slot->value_length), *raw;
+  if (buf == NULL || read_at(db, slot->pos + sizeof(kvdb_entry_t) +
+        slot->key_length, buf, slot->value_length)) {
+    free(buf);
+    return NULL;
+  }
+  if (!slot->compressed) {
+    *length = slot->value_length;
+    return buf;
+  }
+  raw = inflate_value(db, buf, slot->value_length, length);
+  free(buf);
+  return raw;
+}
+
+// Samples the dictionary out of the live values, evenly over the log and
+// up to KVDB_DICT_SAMPLE bytes of each.  Returns NULL if there is too
+// little to go on, or on failure.
+static struct kvdb_dict *train_dict(kvdb_t *db, kvdb_slot_t **live,
+    size_t nr_live) {
+  struct kvdb_dict *dict = NULL;
+  size_t total = 0, length = 0, step;
+  char *data;
+  for (size_t i = 0; i < nr_live; i++)
+    total += live[i]->value_length - 1 < KVDB_DICT_SAMPLE ?
+        live[i]->value_length - 1 : KVDB_DICT_SAMPLE;
+  if (total < 2 * KVDB_DICT_BYTES) return NULL;
+  if ((data = malloc(KVDB_DICT_BYTES)) == NULL) return NULL;
+  step = total / KVDB_DICT_BYTES;
+  for (size_t i = 0; i < nr_live && length < KVDB_DICT_BYTES; i += step) {
+    uint32_t n;
+    char *value = read_value(db, live[i], &n);
+    if (value == NULL) goto fret;
+    n = n - 1 < KVDB_DICT_SAMPLE ? n - 1 : KVDB_DICT_SAMPLE;
+    if (n > KVDB_DICT_BYTES - length) n = KVDB_DICT_BYTES - length;
+    memcpy(data + length, value, n);
+    length += n;
+    free(value);
+  }
+  dict = dict_new(data, length);
+fret:
+  free(data);
+  return dict;
+}
+
+// Called with the mutex and the exclusive flock held, right after
+// update_size.  On success the database uses the new log, locked.
+static int compact(kvdb_t *db) {
+  kvdb_slot_t **live, *slots = NULL;
+  kvdb_entry_t marker = format_marker(), moved;
+  struct kvdb_dict *dict = db->dict;
+  compact_out_t out = { NULL };
+  size_t nr_live = 0, nr_slots = 1024;
+  char *tmp = NULL, *key = NULL;
+  struct stat st;
+  long live_bytes = 0;
+  int fd = -1;
+  live = malloc(db->nr_used * sizeof *live + 1);
+  if (live == NULL) return -1;
+  for (size_t i = 0; i < db->nr_slots; i++)
+    if (db->slots[i].key_hash && db->slots[i].value_length)
+      live[nr_live++] = &db->slots[i];
+  // keep the entries in log order
+  qsort(live, nr_live, sizeof *live, compare_pos);
+  while ((nr_live + 1) * 2 > nr_slots) nr_slots *= 2;
+  slots = calloc(nr_slots, sizeof *slots);
+  tmp = malloc(strlen(db->path) + 9);
+  if (slots == NULL || tmp == NULL) goto fret1;
+  // the dictionary, once there is one, never changes
+  out.blocks = __atomic_load_n(&db->compression, __ATOMIC_RELAXED);
+  if (out.blocks && dict == NULL) dict = train_dict(db, live, nr_live);
+  sprintf(tmp, "%s.compact", db->path);
+  fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) goto fret1;
+  out.fp = fdopen(fd, "r+");
+  if (out.fp == NULL) {
+    close(fd);
+    goto fret2;
+  }
+  // nobody can lock it before the rename, so this does not block
+  if (flock(fd, LOCK_EX)) goto fret3;
+  // the new log has checksums whatever the old one had
+  if (fwrite(&marker, sizeof marker, 1, out.fp) < 1) goto fret3;
+  out.pos = sizeof marker;
+  if (dict != NULL) {
+    kvdb_entry_t entry = { 0, 0, dict->length, KVDB_DICT_MAGIC };
+    int blocks = out.blocks;
+    out.blocks = 0;
+    if (out_add(&out, &entry, "", (char *)dict->data) < 0) goto fret3;
+    out.blocks = blocks;
+  }
+  for (size_t i = 0; i < nr_live; i++) {
+    kvdb_slot_t *slot = live[i];
+    // entries of batches and entries written before key_hash was filled
+    // in become plain entries, but for compression
+    kvdb_entry_t entry = { KVDB_SYN, slot->key_length, 0, slot->key_hash };
+    char *value, *packed = NULL, *p;
+    uint32_t n;
+    size_t j, packed_length;
+    long pos;
+    if ((p = realloc(key, slot->key_length)) == NULL) goto fret3;
+    key = p;
+    if (read_at(db, slot->pos + sizeof entry, key, slot->key_length) ||
+        (value = read_value(db, slot, &n)) == NULL)
+      goto fret3;
+    if (out.blocks)
+      packed = compress_value(dict, value, n - 1, 0, &packed_length);
+    entry.sync_flag = packed != NULL ? KVDB_LZ : KVDB_SYN;
+    entry.value_length = packed != NULL ? packed_length + 1 : n;
+    pos = out_add(&out, &entry, key, packed != NULL ? packed : value);
+    free(packed);
+    free(value);
+    if (pos < 0) goto fret3;
+    for (j = slot->key_hash & (nr_slots - 1); slots[j].key_hash;
+        j = (j + 1) & (nr_slots - 1));
+    slots[j] = *slot;
+    slots[j].value_length = entry.value_length;
+    slots[j].compressed = entry.sync_flag == KVDB_LZ;
+    slots[j].pos = pos;
+    live_bytes += live_length(&slots[j]);
+  }
+  if (out_flush(&out) || fflush(out.fp) || fsync(fd) || fstat(fd, &st))
+    goto fret3;
+  // readers of the old log look for new records after its last one
+  moved = moved_marker();
+  if (pwrite(db->fd, &moved, sizeof moved, db->size) != sizeof moved)
+    goto fret3;
+  if (rename(tmp, db->path)) {
+    // the old log goes on, without the marker
+    while (ftruncate(db->fd, db->size) && errno == EINTR);
+    goto fret3;
+  }
+  // the new log is in place; a lost rename would only undo the compaction
+  fsync_dir(db->path);
+  write_begin(db);
+  retire_map(db);
+  fclose(db->fp);
+  db->fp = out.fp;
+  db->fd = fd;
+  db->dev = st.st_dev;
+  db->ino = st.st_ino;
+  db->generation++;
+  index_release(db);
+  order_free(db);
+  db->slots = slots;
+  db->nr_slots = nr_slots;
+  db->nr_used = nr_live;
+  db->size = out.pos;
+  db->last_pos = out.last;
+  db->checksums = 1;
+  db->live_bytes = live_bytes;
+  db->index_size = 0;
+  if (dict != db->dict) __atomic_store_n(&db->dict, dict, __ATOMIC_RELEASE);
+  // readers catch up through update_size should this fail
+  map_log(db, out.pos);
+  write_end(db);
+  write_index(db);
+  free(out.buf);
+  free(key);
+  free(tmp);
+  free(live);
+  return 0;
+fret3:
+  fclose(out.fp);
+fret2:
+  unlink(tmp);
+fret1:
+  if (dict != db->dict) free(dict);
+  free(out.buf);
+  free(key);
+  free(tmp);
+  free(slots);
+  free(live);
+  return -1;
+}
+
+static char *lsm_get(kvdb_t *db, const char *key, uint32_t key_length,
+    uint32_t *length);
+static const char *lsm_get_view(kvdb_t *db, const char *key,
+    size_t *length);
+static int lsm_traverse(kvdb_t *db, void (*callback)(char*, char*));
+static int lsm_checkpoint(kvdb_t *db);
+static int lsm_compact(kvdb_t *db);
+static int lsm_close(kvdb_t *db);
+static void async_free(kvdb_t *db);
+
+// Note: this function does not guarantee thread-safety!
+int kvdb_open(kvdb_t *db, const char *filename) {
+  //  // BUG: no error checking
+  struct stat st;
+  if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode))
+    return kvdb_open_lsm(db, filename);
+  db->lsm = NULL;
+  db->order = NULL;
+  db->async = NULL;
+  db->fd = open(filename, O_RDWR | O_CREAT, 0666);
+  if (db->fd < 0) {
+    db->fd = 0;
+    return -1;
+  }
+  db->fp = fdopen(db->fd, "r+");
+  if (db->fp == NULL) {
+    db->fd = 0;
+    return -1;
+  }
+  db->size = db->last_pos = 0;
+  db->checksums = 0;
+  db->compression = 0;
+  db->exclusive = 0;
+  db->dict = NULL;
+  db->map = NULL;
+  db->map_length = 0;
+  db->retired = NULL;
+  db->readers = NULL;
+  db->seq = 0;
+  db->reader_phase = 0;
+  db->slots = NULL;
+  db->nr_slots = db->nr_used = 0;
+  db->live_bytes = 0;
+  db->index_map = NULL;
+  db->index_size = 0;
+  db->generation = 0;
+  db->cache = cache_new();
+  db->path = strdup(filename);
+  db->index_path = malloc(strlen(filename) + 5);
+  if (db->cache == NULL || db->path == NULL || db->index_path == NULL)
+    goto fret1;
+  if (posix_memalign((void **)&db->readers, 64,
+        KVDB_READER_SHARDS * sizeof *db->readers)) {
+    db->readers = NULL;
+    goto fret1;
+  }
+  memset(db->readers, 0, KVDB_READER_SHARDS * sizeof *db->readers);
+  sprintf(db->index_path, "%s.idx", filename);
+  if (fstat(db->fd, &st)) goto fret1;
+  db->dev = st.st_dev;
+  db->ino = st.st_ino;
+  db->commit_head = NULL;
+  db->commit_tail = &db->commit_head;
+  db->committing = 0;
+  db->commit_delay = 0;
+  db->commit_pos = -1;
+  if (pthread_mutex_init(&db->mutex, NULL)) goto fret1;
+  if (pthread_mutex_init(&db->commit_mutex, NULL)) goto fret1;
+  if (pthread_cond_init(&db->commit_cond, NULL)) goto fret1;
+  if (read_format(db)) goto fret1;
+  load_index(db);
+  if (flock(fileno(db->fp), LOCK_SH)) goto fret1;  
+  if (update_size(db, LOCK_SH)) goto fret2;
+  flock(fileno(db->fp), LOCK_UN);
+  // a failed checkpoint only costs time on the next open
+  if (db->size - db->index_size >= KVDB_CHECKPOINT_BYTES) write_index(db);
+  return 0;
+fret2:
+  flock(fileno(db->fp), LOCK_UN);
+fret1:
+  retire_map(db);
+  index_release(db);
+  order_free(db);
+  free_retired(db, 0);
+  free(db->readers);
+  free(db->path);
+  free(db->index_path);
+  free(db->dict);
+  cache_free(db->cache);
+  db->path = db->index_path = NULL;
+  db->dict = NULL;
+  db->cache = NULL;
+  fclose(db->fp);
+  return -1;
+}
+
+// Note: this function does not guarantee thread-safety!
+int kvdb_close(kvdb_t *db) {
+  //  // BUG: no error checking
+  int ret = 0;
+  async_free(db);
+  if (db->lsm != NULL) return lsm_close(db);
+  if (db->size - db->index_size >= KVDB_CHECKPOINT_BYTES)
+    ret = write_index(db);
+  fclose(db->fp);
+  db->fp = NULL;
+  retire_map(db);
+  index_release(db);
+  order_free(db);
+  free_retired(db, 0);
+  free(db->readers);
+  free(db->path);
+  free(db->index_path);
+  free(db->dict);
+  cache_free(db->cache);
+  db->path = db->index_path = NULL;
+  db->dict = NULL;
+  db->cache = NULL;
+  pthread_mutex_destroy(&db->mutex);
+  pthread_mutex_destroy(&db->commit_mutex);
+  pthread_cond_destroy(&db->commit_cond);
+  return ret;
+}
+
+int kvdb_checkpoint(kvdb_t *db) {
+  int ret = -1;
+  if (db->lsm != NULL) return lsm_checkpoint(db);
+  if (pthread_mutex_lock(&db->mutex)) return -1;
+  if (log_lock(db, LOCK_SH)) goto fret1;
+  if (update_size(db, LOCK_SH) == 0) ret = write_index(db);
+  log_unlock(db);
+fret1:
+  pthread_mutex_unlock(&db->mutex);
+  return ret;
+}
+
+int kvdb_compact(kvdb_t *db) {
+  int ret = -1;
+  if (db->lsm != NULL) return lsm_compact(db);
+  if (pthread_mutex_lock(&db->mutex)) return -1;
+  free_retired(db, 0);
+  if (log_lock(db, LOCK_EX)) goto fret1;
+  if (update_size(db, LOCK_EX) == 0) ret = compact(db);
+  log_unlock(db);
+fret1:
+  pthread_mutex_unlock(&db->mutex);
+  return ret;
+}
+
+// Keeps the exclusive flock on the log, and on the logs compaction
+// replaces it with, until kvdb_close.  Other processes wait for it in
+// their calls, so this one can stop taking the flock and looking for
+// their commits.  An LSM tree has a single process all along.
+int kvdb_lock_exclusive(kvdb_t *db) {
+  int ret = -1;
+  if (db->lsm != NULL) return 0;
+  if (pthread_mutex_lock(&db->mutex)) return -1;
+  if (flock(db->fd, LOCK_EX) == 0) {
+    if (update_size(db, LOCK_EX) == 0) {
+      __atomic_store_n(&db->exclusive, 1, __ATOMIC_RELAXED);
+      ret = 0;
+    } else {
+      flock(db->fd, LOCK_UN);
+    }
+  }
+  pthread_mutex_unlock(&db->mutex);
+  return ret;
+}
+
+// Group commit: a writer queues its entries and waits.  The first one
+// to find no commit in progress becomes the leader, optionally waits
+// commit_delay microseconds for more writers, and commits everything
+// queued so far with one fsync, or two in a log without checksums: one
+// for the entries and one for their flags.
+typedef struct kvdb_write {
+  struct kvdb_write *next;
+  char *record;           // entries, ready to be appended
+  size_t length;
+  // a streamed value: the record is one entry up to its key, and the
+  // value follows from tail_fd
+  int tail_fd;
+  size_t tail_length;
+  int done, status;
+} kvdb_write_t;
+
+static int write_at(kvdb_t *db, long pos, const void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t ret = pwrite(db->fd, buf, len, pos);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+    buf = (const char *)buf + ret;
+    pos += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+// Calls fn on every entry of the batch, at its offset in the log.
+static int for_each_entry(kvdb_t *db, kvdb_write_t *batch, long pos,
+    int (*fn)(kvdb_t *, const kvdb_entry_t *, long)) {
+  for (kvdb_write_t *w = batch; w != NULL; w = w->next) {
+    for (size_t off = 0; off < w->length; ) {
+      kvdb_entry_t entry;
+      memcpy(&entry, w->record + off, sizeof entry);
+      if (fn(db, &entry, pos + off)) return -1;
+      off += sizeof entry + entry.key_length + entry.value_length;
+    }
+    pos += w->length + w->tail_length;
+  }
+  return 0;
+}
+
+// Appends the record of a write, and its streamed value if it has one,
+// at pos.  In a log with checksums the sync flag of a streamed value
+// goes last, once the checksum has seen all of it.
+static int write_record(kvdb_t *db, long pos, kvdb_write_t *w) {
+  char buf[1 << 16];
+  uint32_t crc = 0;
+  if (db->checksums) {
+    crc = crc32c(0, w->record + sizeof crc, w->length - sizeof crc);
+    if (w->tail_length == 0) memcpy(w->record, &crc, sizeof crc);
+  }
+  if (write_at(db, pos, w->record, w->length)) return -1;
+  for (size_t off = 0, n; off < w->tail_length; off += n) {
+    n = w->tail_length - off < sizeof buf ? w->tail_length - off : sizeof buf;
+    if (read_full(w->tail_fd, buf, n, off) ||
+        write_at(db, pos + w->length + off, buf, n))
+      return -1;
+    if (db->checksums) crc = crc32c(crc, buf, n);
+  }
+  if (db->checksums && w->tail_length)
+    return write_at(db, pos, &crc, sizeof crc);
+  return 0;
+}
+
+// Marks every entry of the batch, at its offset in the log, complete.
+static int set_sync_flags(kvdb_t *db, kvdb_write_t *batch, long pos) {
+  const uint32_t sync_flag = KVDB_SYN;
+  for (kvdb_write_t *w = batch; w != NULL; w = w->next) {
+    for (size_t off = 0; off < w->length; ) {
+      kvdb_entry_t entry;
+      memcpy(&entry, w->record + off, sizeof entry);
+      if (write_at(db, pos + off, &sync_flag, sizeof sync_flag)) return -1;
+      off += sizeof entry + entry.key_length + entry.value_length;
+    }
+    pos += w->length + w->tail_length;
+  }
+  return 0;
+}
+
+// Appends the records of the batch at db->size and makes them durable,
+// starting the log with the format marker if it is empty.  Returns the
+// offset of the first record and sets *end past the last one, or returns
+// -1 with the file cut back to db->size.
+static long append_batch(kvdb_t *db, kvdb_write_t *batch, long *end) {
+  long start = db->size;
+  kvdb_write_t *w;
+  if (start == 0) {
+    kvdb_entry_t marker = format_marker();
+    if (write_at(db, 0, &marker, sizeof marker)) goto fret;
+    db->checksums = 1;
+    start = sizeof marker;
+  }
+  for (w = batch, *end = start; w != NULL;
+      *end += w->length + w->tail_length, w = w->next)
+    if (write_record(db, *end, w)) goto fret;
+  if (fsync(db->fd)) goto fret;
+  if (!db->checksums && (set_sync_flags(db, batch, start) ||
+        fsync(db->fd)))
+    goto fret;
+  return start;
+fret:
+  // written but not synced may still read as committed
+  if (ftruncate(db->fd, db->size) == 0 && db->size == 0) db->checksums = 0;
+  return -1;
+}
+
+static int lsm_write_batch(kvdb_t *db, kvdb_write_t *batch);
+
+static int write_batch(kvdb_t *db, kvdb_write_t *batch) {
+  long start, end, last;
+  if (db->lsm != NULL) return lsm_write_batch(db, batch);
+  if (pthread_mutex_lock(&db->mutex)) return -1;
+  free_retired(db, 0);
+  if (log_lock(db, LOCK_EX)) goto fret1;
+  // update_size leaves the file ending at db->size
+  if (update_size(db, LOCK_EX)) goto fret2;
+  // readers finding these entries committed ignore them until they are
+  // indexed: none of their writers has returned yet
+  __atomic_store_n(&db->commit_pos, db->size, __ATOMIC_SEQ_CST);
+  if ((start = append_batch(db, batch, &end)) < 0) goto fret2;
+  // committed; should indexing fail, update_size indexes the entries
+  // again on the next call
+  // the record of the last write
+  last = start;
+  for (kvdb_write_t *w = batch; w->next != NULL; w = w->next)
+    last += w->length + w->tail_length;
+  write_begin(db);
+  if (for_each_entry(db, batch, start, index_record) == 0) {
+    db->size = end;
+    db->last_pos = last;
+  }
+  db->commit_pos = -1;
+  write_end(db);
+  // a failed compaction leaves the log as it was
+  if (db->size >= KVDB_COMPACT_BYTES && db->live_bytes * 2 <= db->size)
+    compact(db);
+  log_unlock(db);
+  pthread_mutex_unlock(&db->mutex);
+  return 0;
+fret2:
+  db->commit_pos = -1;
+  log_unlock(db);
+fret1:
+  pthread_mutex_unlock(&db->mutex);
+  return -1;
+}
+
+static int commit(kvdb_t *db, kvdb_write_t *w) {
+  int ret;
+  w->next = NULL;
+  w->done = 0;
+  if (pthread_mutex_lock(&db->commit_mutex)) return -1;
+  *db->commit_tail = w;
+  db->commit_tail = &w->next;
+  while (!w->done && db->committing)
+    pthread_cond_wait(&db->commit_cond, &db->commit_mutex);
+  if (!w->done) {
+    kvdb_write_t *batch, *next;
+    db->committing = 1;
+    if (db->commit_delay > 0) {
+      struct timespec ts = {
+        db->commit_delay / 1000000, db->commit_delay % 1000000 * 1000
+      };
+      pthread_mutex_unlock(&db->commit_mutex);
+      nanosleep(&ts, NULL);
+      pthread_mutex_lock(&db->commit_mutex);
+    }
+    batch = db->commit_head;
+    db->commit_head = NULL;
+    db->commit_tail = &db->commit_head;
+    pthread_mutex_unlock(&db->commit_mutex);
+    ret = write_batch(db, batch);
+    pthread_mutex_lock(&db->commit_mutex);
+    // a waiter may return as soon as it is done
+    for (; batch != NULL; batch = next) {
+      next = batch->next;
+      batch->status = ret;
+      batch->done = 1;
+    }
+    db->committing = 0;
+    pthread_cond_broadcast(&db->commit_cond);
+  }
+  ret = w->status;
+  pthread_mutex_unlock(&db->commit_mutex);
+  return ret;
+}
+
+void kvdb_set_commit_delay(kvdb_t *db, long usec) {
+  pthread_mutex_lock(&db->commit_mutex);
+  db->commit_delay = usec;
+  pthread_mutex_unlock(&db->commit_mutex);
+}
+
+// Compression applies to what is written from then on, and compaction
+// rewrites the rest.  Compressed values are read either way.
+void kvdb_set_compression(kvdb_t *db, int enable) {
+  __atomic_store_n(&db->compression, enable != 0, __ATOMIC_RELAXED);
+}
+
+// A smaller budget evicts at once; 0 turns the cache off.
+void kvdb_set_cache_size(kvdb_t *db, size_t bytes) {
+  struct kvdb_cache *cache = db->cache;
+  __atomic_store_n(&cache->budget, bytes, __ATOMIC_RELAXED);
+  for (int i = 0; i < KVDB_CACHE_SHARDS; i++) {
+    pthread_mutex_lock(&cache->shards[i].mutex);
+    cache_evict(&cache->shards[i], bytes / KVDB_CACHE_SHARDS);
+    pthread_mutex_unlock(&cache->shards[i].mutex);
+  }
+}
+
+void kvdb_get_stats(kvdb_t *db, struct kvdb_stats *stats) {
+  memset(stats, 0, sizeof *stats);
+  for (int i = 0; i < KVDB_CACHE_SHARDS; i++) {
+    struct kvdb_cache_shard *shard = &db->cache->shards[i];
+    pthread_mutex_lock(&shard->mutex);
+    stats->cache_hits += shard->hits;
+    stats->cache_misses += shard->misses;
+    stats->cache_bytes += shard->bytes;
+    stats->cache_entries += shard->nr_entries;
+    pthread_mutex_unlock(&shard->mutex);
+  }
+}
+
+// Keys and values of any bytes are stored like strings, with a NUL after
+// them, so that the calls taking strings and the ones taking lengths
+// find the same keys.
+static size_t entry_length(size_t key_length, const void *value,
+    size_t value_length) {
+  return sizeof(kvdb_entry_t) + key_length + 1
+      + (value != NULL ? value_length + 1 : 0);
+}
+
+static int lengths_valid(size_t key_length, size_t value_length) {
+  if (key_length < UINT32_MAX && value_length < UINT32_MAX) return 1;
+  errno = EFBIG;
+  return 0;
+}
+
+// Stores an entry at buf, which must have room for entry_length bytes;
+// a NULL value makes it a deletion.
+static size_t encode_entry(char *buf, uint32_t sync_flag, const void *key,
+    size_t key_length, const void *value, size_t value_length) {
+  kvdb_entry_t entry;
+  char *p = buf + sizeof entry;
+  memcpy(p, key, key_length);
+  p[key_length] = '\0';
+  entry.sync_flag = sync_flag;
+  entry.key_length = key_length + 1;
+  entry.value_length = value != NULL ? value_length + 1 : 0;
+  entry.key_hash = hash_key(p, entry.key_length);
+  memcpy(buf, &entry, sizeof entry);
+  if (value != NULL) {
+    memcpy(p + entry.key_length, value, value_length);
+    p[entry.key_length + value_length] = '\0';
+  }
+  return sizeof entry + entry.key_length + entry.value_length;
+}
+
+int kvdb_put(kvdb_t *db, const char *key, const char *value) {
+  return kvdb_put2(db, key, strlen(key), value,
+      value != NULL ? strlen(value) : 0);
+}
+
+// Stores the header of a batch of length bytes of entries at buf.
+static size_t encode_batch(char *buf, size_t length) {
+  kvdb_entry_t batch = { 0, 0, length, 0 };
+  memcpy(buf, &batch, sizeof batch);
+  return sizeof batch;
+}
+
+// Compresses the value if db is set to, and that saves more than the
+// overhead bytes storing it compressed takes.  Logs only.
+static char *maybe_compress(kvdb_t *db, const void *value,
+    size_t value_length, size_t overhead, size_t *length) {
+  if (value == NULL || db->lsm != NULL ||
+      !__atomic_load_n(&db->compression, __ATOMIC_RELAXED))
+    return NULL;
+  return compress_value(__atomic_load_n(&db->dict, __ATOMIC_ACQUIRE), value,
+      value_length, overhead, length);
+}
+
+// A compressed value takes a batch of its own.
+int kvdb_put2(kvdb_t *db, const void *key, size_t key_length,
+    const void *value, size_t value_length) {
+  kvdb_write_t w;
+  size_t packed_length;
+  char *packed;
+  int ret;
+  if (!lengths_valid(key_length, value_length)) return -1;
+  packed = maybe_compress(db, value, value_length, sizeof(kvdb_entry_t),
+      &packed_length);
+  if (packed != NULL) {
+    size_t length = entry_length(key_length, packed, packed_length);
+    w.length = sizeof(kvdb_entry_t) + length;
+  } else {
+    w.length = entry_length(key_length, value, value_length);
+  }
+  w.tail_length = 0;
+  w.record = malloc(w.length);
+  if (w.record == NULL) {
+    free(packed);
+    return -1;
+  }
+  if (packed != NULL) {
+    size_t off = encode_batch(w.record, w.length - sizeof(kvdb_entry_t));
+    encode_entry(w.record + off, KVDB_LZ, key, key_length, packed,
+        packed_length);
+  } else {
+    encode_entry(w.record, 0, key, key_length, value, value_length);
+  }
+  ret = commit(db, &w);
+  free(w.record);
+  free(packed);
+  return ret;
+}
+
+// A deletion is an entry without a value, committed like a put.  The
+// key's entries, this one included, go with the next compaction.
+int kvdb_delete(kvdb_t *db, const char *key) {
+  return kvdb_put(db, key, NULL);
+}
+
+// An operation of a batch on keys and values of any bytes; a NULL value
+// deletes the key.
+typedef struct kvdb_bop {
+  const void *key, *value;
+  size_t key_length, value_length;
+} kvdb_bop_t;
+
+// All operations go into one batch entry, so readers and crash recovery
+// see either all of them or none.  Later operations on a key win.
+static int write_ops(kvdb_t *db, const kvdb_bop_t *ops, size_t n) {
+  kvdb_write_t w;
+  size_t off, *packed_length = NULL;
+  char **packed = NULL;
+  int ret = -1;
+  if (n == 0) return 0;
+  w.length = sizeof(kvdb_entry_t);
+  w.tail_length = 0;
+  w.record = NULL;
+  packed = calloc(n, sizeof *packed);
+  packed_length = malloc(n * sizeof *packed_length);
+  if (packed == NULL || packed_length == NULL) goto fret;
+  for (size_t i = 0; i < n; i++) {
+    if (!lengths_valid(ops[i].key_length, ops[i].value_length)) goto fret;
+    packed[i] = maybe_compress(db, ops[i].value, ops[i].value_length, 0,
+        &packed_length[i]);
+    if (packed[i] != NULL)
+      w.length += entry_length(ops[i].key_length, packed[i],
+          packed_length[i]);
+    else
+      w.length += entry_length(ops[i].key_length, ops[i].value,
+          ops[i].value_length);
+  }
+  if (w.length - sizeof(kvdb_entry_t) > UINT32_MAX) {
+    errno = EFBIG;
+    goto fret;
+  }
+  w.record = malloc(w.length);
+  if (w.record == NULL) goto fret;
+  off = encode_batch(w.record, w.length - sizeof(kvdb_entry_t));
+  for (size_t i = 0; i < n; i++) {
+    if (packed[i] != NULL)
+      off += encode_entry(w.record + off, KVDB_LZ, ops[i].key,
+          ops[i].key_length, packed[i], packed_length[i]);
+    else
+      off += encode_entry(w.record + off, KVDB_SYN, ops[i].key,
+          ops[i].key_length, ops[i].value, ops[i].value_length);
+  }
+  ret = commit(db, &w);
+fret:
+  for (size_t i = 0; packed != NULL && i < n; i++) free(packed[i]);
+  free(packed);
+  free(packed_length);
+  free(w.record);
+  return ret;
+}
+
+int kvdb_write_batch(kvdb_t *db, const struct kvdb_op *ops, size_t n) {
+  kvdb_bop_t *bops;
+  int ret;
+  if (n == 0) return 0;
+  if ((bops = malloc(n * sizeof *bops)) == NULL) return -1;
+  for (size_t i = 0; i < n; i++) {
+    bops[i].key = ops[i].key;
+    bops[i].key_length = strlen(ops[i].key);
+    bops[i].value = ops[i].value;
+    bops[i].value_length = ops[i].value != NULL ? strlen(ops[i].value) : 0;
+  }
+  ret = write_ops(db, bops, n);
+  free(bops);
+  return ret;
+}
+
+// What a reader works with: the log up to size, all of it in map, and
+// the index of it.  Everything is read-only to readers, and nothing is
+// freed before read_end.
+typedef struct kvdb_snapshot {
+  int phase;
+  unsigned seq;
+  int fd;
+  uint64_t dev, ino;
+  unsigned long generation;
+  long size;
+  const char *map;
+  size_t map_length;
+  const kvdb_slot_t *slots;
+  size_t nr_slots;
+} kvdb_snapshot_t;
+
+// Whether the snapshot misses entries another process has committed.
+// Entries of a commit of ours in progress do not count, nor do any
+// entries not committed yet: those writers have not returned.  Telling
+// those apart takes a checksum in a log with the format marker, so any
+// new entry counts there, as does the first entry of an empty log.  No
+// other process commits to a log this one owns.
+//
+// The header after the snapshot is read through the mapping, without a
+// syscall, while it lies in the page of the last byte of the snapshot:
+// the file never shrinks below what has been committed, so that page is
+// backed, and past the end of the file it reads as zeros.  Compaction
+// leaves its moved marker there.  Otherwise, one time in a few hundred,
+// stat and pread tell.
+static int log_changed(kvdb_t *db, const kvdb_snapshot_t *s) {
+  long page = sysconf(_SC_PAGESIZE);
+  kvdb_entry_t entry;
+  struct stat st;
+  if (__atomic_load_n(&db->exclusive, __ATOMIC_RELAXED)) return 0;
+  if (s->size > 0 &&
+      (s->size - 1) / page == (s->size + (long)sizeof entry - 1) / page) {
+    static const kvdb_entry_t none;
+    memcpy(&entry, s->map + s->size, sizeof entry);
+    if (memcmp(&entry, &none, sizeof entry) == 0) return 0;
+    if (entry.key_length == 0 && entry.key_hash == KVDB_MOVED_MAGIC)
+      return 1;
+  } else {
+    if (stat(db->path, &st)) return 1;
+    if (st.st_dev != s->dev || st.st_ino != s->ino) return 1;
+    if (st.st_size < s->size + (long)sizeof entry) return 0;
+    // the file may be truncated under us, so no reading through the map
+    if (pread(s->fd, &entry, sizeof entry, s->size) != sizeof entry)
+      return 0;
+  }
+  if (s->size > 0 && !__atomic_load_n(&db->checksums, __ATOMIC_RELAXED) &&
+      entry.sync_flag != KVDB_SYN)
+    return 0;
+  return __atomic_load_n(&db->commit_pos, __ATOMIC_SEQ_CST) != s->size;
+}
+
+// Indexes what other processes have committed, like writers do.
+static int catch_up(kvdb_t *db) {
+  int ret = -1;
+  if (pthread_mutex_lock(&db->mutex)) return -1;
+  if (log_lock(db, LOCK_SH) == 0) {
+    ret = update_size(db, LOCK_SH);
+    log_unlock(db);
+  }
+  // views may still point into the latest mappings of the log
+  free_retired(db, KVDB_RETIRED_LOGS);
+  pthread_mutex_unlock(&db->mutex);
+  return ret;
+}
+
+// Starts a read with a snapshot of everything committed so far.
+static int read_begin(kvdb_t *db, kvdb_snapshot_t *s) {
+  for (;;) {
+    int changed = 0;
+    s->phase = read_lock(db);
+    s->seq = __atomic_load_n(&db->seq, __ATOMIC_ACQUIRE);
+    if (!(s->seq & 1)) {
+      s->fd = __atomic_load_n(&db->fd, __ATOMIC_RELAXED);
+      s->dev = __atomic_load_n(&db->dev, __ATOMIC_RELAXED);
+      s->ino = __atomic_load_n(&db->ino, __ATOMIC_RELAXED);
+      s->generation = __atomic_load_n(&db->generation, __ATOMIC_RELAXED);
+      s->size = __atomic_load_n(&db->size, __ATOMIC_RELAXED);
+      s->map = __atomic_load_n(&db->map, __ATOMIC_RELAXED);
+      s->map_length = __atomic_load_n(&db->map_length, __ATOMIC_RELAXED);
+      s->slots = __atomic_load_n(&db->slots, __ATOMIC_RELAXED);
+      s->nr_slots = __atomic_load_n(&db->nr_slots, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&db->seq, __ATOMIC_RELAXED) == s->seq) {
+        changed = (size_t)s->size > s->map_length || log_changed(db, s);
+        if (!changed) return 0;
+      }
+    }
+    // a writer may wait for us to go before it finishes
+    read_unlock(db, s->phase);
+    if (!changed) sched_yield();
+    else if (catch_up(db)) return -1;
+  }
+}
+
+// Whether a writer has changed the index since read_begin, which means
+// that the lookup has to start over.
+static int read_stale(kvdb_t *db, const kvdb_snapshot_t *s) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&db->seq, __ATOMIC_RELAXED) != s->seq;
+}
+
+static void read_end(kvdb_t *db, const kvdb_snapshot_t *s) {
+  read_unlock(db, s->phase);
+}
+
+// Copies the slot of the latest entry of key, unless it is missing or
+// deleted.  Writers may change the slots meanwhile, so nothing is read
+// outside of the snapshot; read_stale tells whether the result holds.
+static int find_entry(const kvdb_snapshot_t *s, const char *key,
+    uint32_t key_length, kvdb_slot_t *ret) {
+  uint32_t hash = hash_key(key, key_length);
+  for (size_t i = hash & (s->nr_slots - 1), n = 0; n < s->nr_slots;
+      i = (i + 1) & (s->nr_slots - 1), n++) {
+    const kvdb_slot_t *slot = &s->slots[i];
+    uint32_t value_length;
+    const char *p;
+    long pos;
+    if (__atomic_load_n(&slot->key_hash, __ATOMIC_RELAXED) != hash) {
+      if (__atomic_load_n(&slot->key_hash, __ATOMIC_RELAXED) == 0) break;
+      continue;
+    }
+    if (__atomic_load_n(&slot->key_length, __ATOMIC_RELAXED) != key_length)
+      continue;
+    value_length = __atomic_load_n(&slot->value_length, __ATOMIC_RELAXED);
+    pos = __atomic_load_n(&slot->pos, __ATOMIC_RELAXED);
+    // a slot being written may be torn; stay inside the snapshot
+    if (pos < 0 || pos > s->size || (unsigned long)(s->size - pos) <
+        sizeof(kvdb_entry_t) + (unsigned long)key_length + value_length)
+      continue;
+    p = s->map + pos + sizeof(kvdb_entry_t);
+    if (memcmp(p, key, key_length)) continue;
+    if (value_length == 0 || p[key_length + value_length - 1]) return 0;
+    ret->key_hash = hash;
+    ret->key_length = key_length;
+    ret->value_length = value_length;
+    ret->compressed = __atomic_load_n(&slot->compressed, __ATOMIC_RELAXED);
+    ret->pos = pos;
+    return 1;
+  }
+  return 0;
+}
+
+// Decompresses the value of a slot that find_entry copied, or copies it
+// out of the cache.  *fresh tells that it did not come from there; the
+// caller puts it there once read_stale has shown the slot to be whole.
+static char *read_compressed(kvdb_t *db, const kvdb_snapshot_t *s,
+    const kvdb_slot_t *slot, uint32_t *length, int *fresh) {
+  size_t n;
+  char *buf = cache_get(db->cache, s->generation, slot->pos, &n);
+  *fresh = buf == NULL;
+  if (buf != NULL) {
+    *length = n;
+    return buf;
+  }
+  return inflate_value(db, s->map + slot->pos + sizeof(kvdb_entry_t) +
+      slot->key_length, slot->value_length, length);
+}
+
+// Returns the value of key from malloc and its length, NULs included.
+static char *get_value(kvdb_t *db, const char *key, uint32_t key_length,
+    uint32_t *value_length) {
+  kvdb_snapshot_t s;
+  kvdb_slot_t slot;
+  if (db->lsm != NULL) return lsm_get(db, key, key_length, value_length);
+  for (;;) {
+    char *buf = NULL;
+    int stale, fresh = 0;
+    if (read_begin(db, &s)) return NULL;
+    if (find_entry(&s, key, key_length, &slot)) {
+      const char *value = s.map + slot.pos + sizeof(kvdb_entry_t) +
+          key_length;
+      if (slot.compressed) {
+        buf = read_compressed(db, &s, &slot, value_length, &fresh);
+      } else if ((buf = malloc(slot.value_length)) != NULL) {
+        memcpy(buf, value, slot.value_length);
+        *value_length = slot.value_length;
+      }
+    }
+    stale = read_stale(db, &s);
+    read_end(db, &s);
+    if (!stale) {
+      if (fresh && buf != NULL)
+        cache_put(db->cache, s.generation, slot.pos, buf, *value_length);
+      return buf;
+    }
+    free(buf);
+  }
+}
+
+char *kvdb_get(kvdb_t *db, const char *key) {
+  uint32_t value_length;
+  return get_value(db, key, strlen(key) + 1, &value_length);
+}
+
+// Copies key, to look it up with the NUL it is stored with.
+static char *key_dup(const void *key, size_t key_length) {
+  char *p;
+  if (key_length >= UINT32_MAX) {
+    errno = EFBIG;
+    return NULL;
+  }
+  if ((p = malloc(key_length + 1)) == NULL) return NULL;
+  memcpy(p, key, key_length);
+  p[key_length] = '\0';
+  return p;
+}
+
+// The value has a NUL after it, as with kvdb_get.
+void *kvdb_get2(kvdb_t *db, const void *key, size_t key_length,
+    size_t *value_length) {
+  char *k = key_dup(key, key_length), *value;
+  uint32_t length;
+  if (k == NULL) return NULL;
+  value = get_value(db, k, key_length + 1, &length);
+  if (value != NULL && value_length != NULL) *value_length = length - 1;
+  free(k);
+  return value;
+}
+
+// Values too large to handle in one piece.  One opened for reading
+// keeps its own descriptor of the log, so that compaction cannot take
+// it away, and is read from there; one from an LSM tree, or stored
+// compressed, is in memory all the same.  One being written goes to an
+// unlinked temporary file, from which the commit copies it into the log.
+struct kvdb_value {
+  kvdb_t *db;
+  int fd;                 // of the log, or of the temporary file
+  int writing;
+  long pos;               // of the value in the log
+  size_t length;          // without the NUL
+  char *buf;              // the value, from an LSM tree
+  char *key;              // of a value being written, NUL added
+  size_t key_length;
+};
+
+kvdb_value_t *kvdb_value_open(kvdb_t *db, const void *key,
+    size_t key_length, size_t *length) {
+  kvdb_value_t *v = calloc(1, sizeof *v);
+  char *k = key_dup(key, key_length);
+  kvdb_snapshot_t s;
+  kvdb_slot_t slot;
+  uint32_t n;
+  int found;
+  if (v == NULL || k == NULL) goto fret;
+  v->db = db;
+  v->fd = -1;
+  if (db->lsm != NULL) {
+    if ((v->buf = lsm_get(db, k, key_length + 1, &n)) == NULL) goto fret;
+    v->length = n - 1;
+  } else {
+    for (;;) {
+      int stale, fresh = 0;
+      if (read_begin(db, &s)) goto fret;
+      found = find_entry(&s, k, key_length + 1, &slot);
+      if (found && slot.compressed) {
+        v->buf = read_compressed(db, &s, &slot, &n, &fresh);
+      } else if (found) {
+        v->fd = dup(s.fd);
+      }
+      stale = read_stale(db, &s);
+      read_end(db, &s);
+      if (!stale) {
+        if (fresh && v->buf != NULL)
+          cache_put(db->cache, s.generation, slot.pos, v->buf, n);
+        break;
+      }
+      // the descriptor may be of a file compaction has closed since
+      if (v->fd >= 0) close(v->fd);
+      v->fd = -1;
+      free(v->buf);
+      v->buf = NULL;
+    }
+    if (!found || (v->fd < 0 && v->buf == NULL)) goto fret;
+    v->pos = slot.pos + sizeof(kvdb_entry_t) + slot.key_length;
+    v->length = (v->buf != NULL ? n : slot.value_length) - 1;
+  }
+  if (length != NULL) *length = v->length;
+  free(k);
+  return v;
+fret:
+  free(k);
+  kvdb_value_close(v);
+  return NULL;
+}
+
+ssize_t kvdb_value_read(kvdb_value_t *v, void *buf, size_t length,
+    size_t offset) {
+  if (v->writing) {
+    errno = EBADF;
+    return -1;
+  }
+  if (offset >= v->length) return 0;
+  if (length > v->length - offset) length = v->length - offset;
+  if (v->buf != NULL) memcpy(buf, v->buf + offset, length);
+  else if (read_full(v->fd, buf, length, v->pos + offset)) return -1;
+  return length;
+}
+
+kvdb_value_t *kvdb_value_create(kvdb_t *db, const void *key,
+    size_t key_length) {
+  kvdb_value_t *v = calloc(1, sizeof *v);
+  char *tmp = malloc(strlen(db->path) + 8);
+  if (v == NULL || tmp == NULL) goto fret;
+  v->db = db;
+  v->writing = 1;
+  sprintf(tmp, "%s.XXXXXX", db->path);
+  v->fd = mkstemp(tmp);
+  if (v->fd < 0) goto fret;
+  unlink(tmp);
+  if ((v->key = key_dup(key, key_length)) == NULL) goto fret;
+  v->key_length = key_length;
+  free(tmp);
+  return v;
+fret:
+  free(tmp);
+  kvdb_value_close(v);
+  return NULL;
+}
+
+int kvdb_value_write(kvdb_value_t *v, const void *buf, size_t length) {
+  if (!v->writing) {
+    errno = EBADF;
+    return -1;
+  }
+  if (!lengths_valid(0, v->length + length)) return -1;
+  if (write_all(v->fd, buf, length)) return -1;
+  v->length += length;
+  return 0;
+}
+
+// Closes v also on failure.
+int kvdb_value_commit(kvdb_value_t *v) {
+  kvdb_t *db = v->db;
+  kvdb_entry_t entry;
+  kvdb_write_t w;
+  int ret = -1;
+  if (!v->writing) {
+    errno = EBADF;
+    goto fret;
+  }
+  if (db->lsm != NULL) {
+    // the memtable takes the whole value anyway
+    char *value = malloc(v->length + 1);
+    if (value != NULL && read_full(v->fd, value, v->length, 0) == 0)
+      ret = kvdb_put2(db, v->key, v->key_length, value, v->length);
+    free(value);
+    goto fret;
+  }
+  // the value has its NUL like any other
+  if (write_all(v->fd, "", 1)) goto fret;
+  w.length = entry_length(v->key_length, NULL, 0);
+  if ((w.record = malloc(w.length)) == NULL) goto fret;
+  encode_entry(w.record, 0, v->key, v->key_length, NULL, 0);
+  memcpy(&entry, w.record, sizeof entry);
+  entry.value_length = v->length + 1;
+  memcpy(w.record, &entry, sizeof entry);
+  w.tail_fd = v->fd;
+  w.tail_length = v->length + 1;
+  ret = commit(db, &w);
+  free(w.record);
+fret:
+  kvdb_value_close(v);
+  return ret;
+}
+
+void kvdb_value_close(kvdb_value_t *v) {
+  if (v == NULL) return;
+  if (v->fd >= 0) close(v->fd);
+  free(v->buf);
+  free(v->key);
+  free(v);
+}
+
+// The value stays in place in the mapping of the log; it is readable
+// until the next put, batch, compaction or close of the database.  A
+// compressed value has no such place, and is only for kvdb_get2.
+const char *kvdb_get_view(kvdb_t *db, const char *key, size_t *length) {
+  uint32_t key_length = strlen(key) + 1;
+  kvdb_snapshot_t s;
+  kvdb_slot_t slot;
+  if (db->lsm != NULL) return lsm_get_view(db, key, length);
+  for (;;) {
+    const char *ret = NULL;
+    int stale;
+    if (read_begin(db, &s)) return NULL;
+    if (find_entry(&s, key, key_length, &slot))
+      ret = s.map + slot.pos + sizeof(kvdb_entry_t) + key_length;
+    stale = read_stale(db, &s);
+    read_end(db, &s);
+    if (stale) continue;
+    // nothing in the file to point to; kvdb_get2 decompresses it
+    if (ret != NULL && slot.compressed) {
+      errno = ENOTSUP;
+      return NULL;
+    }
+    if (ret != NULL && length != NULL) *length = slot.value_length - 1;
+    return ret;
+  }
+}
+
+// Calls back for every entry in the log, including the entries of batches
+// but not deletions.  The strings point into the read-only mapping of the
+// log, or into memory freed on return for compressed values, and must not
+// be modified, nor may the callback modify the database.
+int kvdb_traverse(kvdb_t *db, void (*callback)(char*, char*)) {
   kvdb_entry_t entry;
-  if (fseek(db->fp, 0, SEEK_END)) return -1;
-  long filesz = ftell(db->fp);
-  if (filesz < 0) return -1;
-  if (fseek(db->fp, db->size, SEEK_SET)) return -1;
-  while (fread(&entry, 1, sizeof entry, db->fp)) {
-    if (entry.sync_flag != KVDB_SYN) break;
-    if (fseek(db->fp, entry.key_length + entry.value_length, SEEK_CUR))
+  kvdb_snapshot_t s;
+  int ret = -1;
+  if (db->lsm != NULL) return lsm_traverse(db, callback);
+  // the log below the snapshot size never changes
+  if (read_begin(db, &s)) return -1;
+  for (long pos = 0; pos < s.size; ) {
+    char *p = (char *)s.map + pos + sizeof entry;
+    memcpy(&entry, s.map + pos, sizeof entry);
+    pos += sizeof entry + entry.key_length + entry.value_length;
+    if (entry.key_length == 0) {
+      if (entry.key_hash == KVDB_DICT_MAGIC) continue;
+      for (char *end = p + entry.value_length; p < end; ) {
+        kvdb_entry_t inner;
+        memcpy(&inner, p, sizeof inner);
+        p += sizeof inner;
+        if (inner.key_length == 0 ||
+            inner.key_length + inner.value_length > end - p)
+          goto fret;
+        if (inner.sync_flag == KVDB_LZ) {
+          uint32_t n;
+          char *value = inflate_value(db, p + inner.key_length,
+              inner.value_length, &n);
+          if (value == NULL) goto fret;
+          callback(p, value);
+          free(value);
+        } else if (inner.value_length) {
+          callback(p, p + inner.key_length);
+        }
+        p += inner.key_length + inner.value_length;
+      }
+    } else if (entry.value_length) {
+      callback(p, p + entry.key_length);
+    }
+  }
+  ret = 0;
+fret:
+  read_end(db, &s);
+  return ret;
+}
+
+// An LSM tree, for kvdb_open_lsm.  The database is a directory of
+//   NNNNNN.wal  write-ahead log of a memtable, entries as in the log
+//   NNNNNN.sst  sorted table of keys and values
+//   MANIFEST    the tables of every level
+//   LOCK        flocked by the one process that has it open
+// Writes go through the group commit to the write-ahead log and then
+// into the memtable, a skiplist.  A background thread writes full
+// memtables out as tables of level 0 and merges tables down the levels.
+// From level 1 on the tables of a level do not overlap, and each level
+// holds ten times as much as the one above.  Of a table, only its block
+// index and its bloom filter are kept in memory.
+#define LSM_LEVELS          7
+#define LSM_MAX_HEIGHT      12
+#define LSM_MEMTABLE_BYTES  (4L << 20)
+#define LSM_BLOCK_BYTES     4096
+#define LSM_TABLE_BYTES     (2L << 20)
+#define LSM_L0_COMPACT      4     // level 0 tables that start a compaction
+#define LSM_L0_STOP         12    // and that make writers wait for it
+#define LSM_L1_BYTES        (10L << 20)
+#define LSM_BLOOM_BITS      10    // per key
+#define LSM_TABLE_MAGIC     0x4c425453    // "STBL"
+#define LSM_MANIFEST_MAGIC  0x5453464d    // "MFST"
+
+static char *lsm_file(kvdb_t *db, long number, const char *ext) {
+  char *path = malloc(strlen(db->path) + 32);
+  if (path != NULL) sprintf(path, "%s/%06ld.%s", db->path, number, ext);
+  return path;
+}
+
+// The memtable keeps every version of a key, the latest first.  Only the
+// writer holding db->mutex inserts; readers follow the next pointers
+// without a lock.
+typedef struct lsm_node {
+  uint32_t key_length, value_length;    // value_length 0 for deletions
+  int height;
+  struct lsm_node *next[];              // then the key and the value
+} lsm_node_t;
+
+#define node_key(node)    ((char *)((node)->next + (node)->height))
+#define node_value(node)  (node_key(node) + (node)->key_length)
+
+typedef struct lsm_memtable {
+  int refs;
+  long number;            // of its write-ahead log
+  size_t bytes;
+  int height;
+  uint64_t seed;
+  lsm_node_t *head;
+} lsm_memtable_t;
+
+static lsm_memtable_t *mem_new(long number) {
+  lsm_memtable_t *mem = calloc(1, sizeof *mem);
+  if (mem == NULL) return NULL;
+  mem->head = calloc(1, sizeof *mem->head +
+      LSM_MAX_HEIGHT * sizeof(lsm_node_t *));
+  if (mem->head == NULL) {
+    free(mem);
+    return NULL;
+  }
+  mem->head->height = LSM_MAX_HEIGHT;
+  mem->refs = 1;
+  mem->number = number;
+  mem->height = 1;
+  mem->seed = 0x9e3779b97f4a7c15ull;
+  return mem;
+}
+
+static void mem_unref(lsm_memtable_t *mem) {
+  if (mem == NULL || __atomic_sub_fetch(&mem->refs, 1, __ATOMIC_ACQ_REL))
+    return;
+  for (lsm_node_t *node = mem->head, *next; node != NULL; node = next) {
+    next = node->next[0];
+    free(node);
+  }
+  free(mem);
+}
+
+// Returns the first node with a key not less than key, and puts its
+// predecessors at every level into prev unless it is NULL.
+static lsm_node_t *mem_seek(lsm_memtable_t *mem, const char *key,
+    uint32_t key_length, lsm_node_t **prev) {
+  lsm_node_t *node = mem->head, *next;
+  int level = __atomic_load_n(&mem->height, __ATOMIC_ACQUIRE) - 1;
+  for (; level >= 0; level--) {
+    while ((next = __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE))
+        != NULL && compare_keys(node_key(next), next->key_length,
+          key, key_length) < 0)
+      node = next;
+    if (prev != NULL) prev[level] = node;
+  }
+  return __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+}
+
+static lsm_node_t *mem_find(lsm_memtable_t *mem, const char *key,
+    uint32_t key_length) {
+  lsm_node_t *node = mem_seek(mem, key, key_length, NULL);
+  if (node == NULL || compare_keys(node_key(node), node->key_length,
+        key, key_length))
+    return NULL;
+  return node;
+}
+
+static int mem_insert(lsm_memtable_t *mem, const char *key,
+    uint32_t key_length, const char *value, uint32_t value_length) {
+  lsm_node_t *prev[LSM_MAX_HEIGHT], *node;
+  int height = 1;
+  size_t size;
+  while (height < LSM_MAX_HEIGHT && (next_random(&mem->seed) & 3) == 0)
+    height++;
+  size = sizeof *node + height * sizeof(lsm_node_t *) + key_length +
+      value_length;
+  node = malloc(size);
+  if (node == NULL) return -1;
+  node->key_length = key_length;
+  node->value_length = value_length;
+  node->height = height;
+  memcpy(node_key(node), key, key_length);
+  memcpy(node_value(node), value, value_length);
+  // in front of the older versions of the key
+  mem_seek(mem, key, key_length, prev);
+  for (int level = mem->height; level < height; level++)
+    prev[level] = mem->head;
+  // readers see the node only once its own pointers are set
+  for (int level = 0; level < height; level++) {
+    node->next[level] = prev[level]->next[level];
+    __atomic_store_n(&prev[level]->next[level], node, __ATOMIC_RELEASE);
+  }
+  if (height > mem->height)
+    __atomic_store_n(&mem->height, height, __ATOMIC_RELEASE);
+  mem->bytes += size;
+  return 0;
+}
+
+// Inserts the entries of the records in buf, batches unpacked.  With
+// committed set, it stops at the first record not committed or cut
+// short, as in a write-ahead log after a crash.  Returns the length of
+// the records inserted, or -1.
+static long mem_apply(lsm_memtable_t *mem, const char *buf, long length,
+    int committed) {
+  long pos = 0;
+  int checksums = 0;
+  while (pos + (long)sizeof(kvdb_entry_t) <= length) {
+    kvdb_entry_t entry;
+    const char *p = buf + pos + sizeof entry, *end;
+    memcpy(&entry, buf + pos, sizeof entry);
+    if ((uint64_t)entry.key_length + entry.value_length >
+        (uint64_t)(length - pos - sizeof entry))
+      break;
+    if (committed && pos == 0) checksums = is_format_marker(&entry);
+    if (committed && !record_committed(&entry, p, checksums)) break;
+    end = p + entry.key_length + entry.value_length;
+    if (entry.key_length) {
+      if (mem_insert(mem, p, entry.key_length, p + entry.key_length,
+            entry.value_length))
+        return -1;
+    }
+    while (entry.key_length == 0 && p < end) {
+      kvdb_entry_t inner;
+      memcpy(&inner, p, sizeof inner);
+      p += sizeof inner;
+      if (inner.key_length == 0 ||
+          inner.key_length + inner.value_length > end - p)
+        return -1;
+      if (mem_insert(mem, p, inner.key_length, p + inner.key_length,
+            inner.value_length))
+        return -1;
+      p += inner.key_length + inner.value_length;
+    }
+    pos = end - buf;
+  }
+  return pos;
+}
+
+// Iterators over the memtables, tables and levels, and merged ones over
+// several of these, the first one winning among equal keys.
+typedef struct lsm_iter {
+  const char *key, *value;        // key is NULL past the end
+  uint32_t key_length, value_length;
+  int (*seek)(struct lsm_iter *it, const char *key, uint32_t key_length);
+  int (*next)(struct lsm_iter *it);
+  void (*free)(struct lsm_iter *it);
+} lsm_iter_t;
+
+typedef struct mem_iter {
+  lsm_iter_t it;
+  lsm_memtable_t *mem;
+  lsm_node_t *node;
+} mem_iter_t;
+
+static void mem_iter_set(mem_iter_t *m, lsm_node_t *node) {
+  m->node = node;
+  m->it.key = node != NULL ? node_key(node) : NULL;
+  if (node != NULL) {
+    m->it.key_length = node->key_length;
+    m->it.value = node_value(node);
+    m->it.value_length = node->value_length;
+  }
+}
+
+// A NULL key seeks to the first entry.
+static int mem_iter_seek(lsm_iter_t *it, const char *key,
+    uint32_t key_length) {
+  mem_iter_t *m = (mem_iter_t *)it;
+  if (key == NULL)
+    mem_iter_set(m, __atomic_load_n(&m->mem->head->next[0],
+          __ATOMIC_ACQUIRE));
+  else
+    mem_iter_set(m, mem_seek(m->mem, key, key_length, NULL));
+  return 0;
+}
+
+static int mem_iter_next(lsm_iter_t *it) {
+  mem_iter_t *m = (mem_iter_t *)it;
+  lsm_node_t *node = m->node;
+  // skip the older versions
+  do node = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+  while (node != NULL && compare_keys(node_key(node), node->key_length,
+        m->it.key, m->it.key_length) == 0);
+  mem_iter_set(m, node);
+  return 0;
+}
+
+static void iter_free(lsm_iter_t *it) {
+  free(it);
+}
+
+static lsm_iter_t *mem_iter_new(lsm_memtable_t *mem) {
+  mem_iter_t *m = calloc(1, sizeof *m);
+  if (m == NULL) return NULL;
+  m->mem = mem;
+  m->it.seek = mem_iter_seek;
+  m->it.next = mem_iter_next;
+  m->it.free = iter_free;
+  return &m->it;
+}
+
+// A table is data blocks of entries, each entry a key length and a value
+// length of 32 bits followed by the key and the value, and each block
+// followed by the CRC-32C of its entries.  Then comes the index, one
+// lsm_index_entry_t and the last key for every block, the bloom filter
+// and the footer.
+typedef struct lsm_index_entry {
+  uint64_t offset;
+  uint32_t length;        // of the entries of the block
+  uint32_t key_length;    // of its last key
+} lsm_index_entry_t;
+
+typedef struct lsm_footer {
+  uint32_t magic;
+  uint32_t bloom_k;       // probes per key
+  uint64_t index_offset, index_length;
+  uint64_t bloom_length;  // the filter follows the index
+  uint32_t checksum;      // CRC-32C of the index and the filter
+  uint32_t reserved;
+} lsm_footer_t;
+
+typedef struct lsm_block {
+  long offset;
+  uint32_t length;
+  uint32_t key_length;
+  const char *last_key;
+} lsm_block_t;
+
+typedef struct lsm_table {
+  int refs;
+  int obsolete;           // compacted away: remove the file once unused
+  long number, size;
+  char *path;
+  int fd;
+  char *smallest, *largest;
+  uint32_t smallest_length, largest_length;
+  char *meta;             // index and filter
+  lsm_block_t *blocks;
+  size_t nr_blocks;
+  const uint8_t *bloom;
+  uint64_t bloom_bits;
+  uint32_t bloom_k;
+} lsm_table_t;
+
+static void table_unref(lsm_table_t *t) {
+  if (t == NULL || __atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL))
+    return;
+  if (t->fd >= 0) close(t->fd);
+  if (t->obsolete) unlink(t->path);
+  free(t->path);
+  free(t->smallest);
+  free(t->largest);
+  free(t->meta);
+  free(t->blocks);
+  free(t);
+}
+
+// Opens table number, of size bytes, reading its index and filter.
+static lsm_table_t *table_open(kvdb_t *db, long number, long size,
+    const char *smallest, uint32_t smallest_length, const char *largest,
+    uint32_t largest_length) {
+  lsm_table_t *t = calloc(1, sizeof *t);
+  lsm_footer_t footer;
+  size_t pos, cap = 0;
+  if (t == NULL) return NULL;
+  t->refs = 1;
+  t->fd = -1;
+  t->number = number;
+  t->size = size;
+  t->path = lsm_file(db, number, "sst");
+  t->smallest = malloc(smallest_length);
+  t->largest = malloc(largest_length);
+  if (t->path == NULL || t->smallest == NULL || t->largest == NULL)
+    goto fret;
+  memcpy(t->smallest, smallest, smallest_length);
+  memcpy(t->largest, largest, largest_length);
+  t->smallest_length = smallest_length;
+  t->largest_length = largest_length;
+  t->fd = open(t->path, O_RDONLY);
+  if (t->fd < 0 || size < (long)sizeof footer ||
+      read_full(t->fd, &footer, sizeof footer, size - sizeof footer))
+    goto fret;
+  if (footer.magic != LSM_TABLE_MAGIC || footer.index_offset +
+      footer.index_length + footer.bloom_length + sizeof footer !=
+      (unsigned long)size)
+    goto fret;
+  t->meta = malloc(footer.index_length + footer.bloom_length + 1);
+  if (t->meta == NULL || read_full(t->fd, t->meta, footer.index_length +
+        footer.bloom_length, footer.index_offset) ||
+      crc32c(0, t->meta, footer.index_length + footer.bloom_length) !=
+        footer.checksum)
+    goto fret;
+  for (pos = 0; pos < footer.index_length; ) {
+    lsm_index_entry_t entry;
+    if (footer.index_length - pos < sizeof entry) goto fret;
+    memcpy(&entry, t->meta + pos, sizeof entry);
+    pos += sizeof entry;
+    if (entry.key_length > footer.index_length - pos) goto fret;
+    if (t->nr_blocks == cap) {
+      lsm_block_t *p;
+      cap = cap ? cap * 2 : 64;
+      p = realloc(t->blocks, cap * sizeof *p);
+      if (p == NULL) goto fret;
+      t->blocks = p;
+    }
+    t->blocks[t->nr_blocks].offset = entry.offset;
+    t->blocks[t->nr_blocks].length = entry.length;
+    t->blocks[t->nr_blocks].key_length = entry.key_length;
+    t->blocks[t->nr_blocks].last_key = t->meta + pos;
+    t->nr_blocks++;
+    pos += entry.key_length;
+  }
+  t->bloom = (const uint8_t *)t->meta + footer.index_length;
+  t->bloom_bits = footer.bloom_length * 8;
+  t->bloom_k = footer.bloom_k;
+  return t;
+fret:
+  table_unref(t);
+  return NULL;
+}
+
+static int bloom_may_contain(const lsm_table_t *t, uint32_t hash) {
+  uint32_t delta = hash >> 17 | hash << 15;
+  if (t->bloom_bits == 0) return 1;
+  for (uint32_t i = 0; i < t->bloom_k; i++, hash += delta) {
+    uint64_t bit = hash % t->bloom_bits;
+    if (!(t->bloom[bit / 8] & 1 << bit % 8)) return 0;
+  }
+  return 1;
+}
+
+// First block that may hold key, or nr_blocks.
+static size_t table_find_block(const lsm_table_t *t, const char *key,
+    uint32_t key_length) {
+  size_t lo = 0, hi = t->nr_blocks;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (compare_keys(t->blocks[mid].last_key, t->blocks[mid].key_length,
+          key, key_length) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Reads a block and checks it; the caller frees it.
+static char *table_read_block(const lsm_table_t *t, size_t i) {
+  const lsm_block_t *b = &t->blocks[i];
+  uint32_t crc;
+  char *buf = malloc(b->length + sizeof crc);
+  if (buf == NULL) return NULL;
+  if (read_full(t->fd, buf, b->length + sizeof crc, b->offset))
+    goto fret;
+  memcpy(&crc, buf + b->length, sizeof crc);
+  if (crc32c(0, buf, b->length) != crc) {
+    errno = EIO;
+    goto fret;
+  }
+  return buf;
+fret:
+  free(buf);
+  return NULL;
+}
+
+// Looks key up in the table.  Returns 1 if found, with the value in
+// *value from malloc, or NULL for a deletion; 0 if the table does not
+// have the key and -1 on error.
+static int table_get(struct kvdb_cache *cache, const lsm_table_t *t,
+    const char *key, uint32_t key_length, uint32_t hash, char **value,
+    uint32_t *value_length) {
+  size_t i, n;
+  char *buf;
+  int ret = 0;
+  if (!bloom_may_contain(t, hash)) return 0;
+  i = table_find_block(t, key, key_length);
+  if (i == t->nr_blocks) return 0;
+  // tables never change, and their numbers are never used again
+  buf = cache_get(cache, t->number, t->blocks[i].offset, &n);
+  if (buf == NULL) {
+    if ((buf = table_read_block(t, i)) == NULL) return -1;
+    cache_put(cache, t->number, t->blocks[i].offset, buf,
+        t->blocks[i].length);
+  }
+  for (uint32_t pos = 0; pos + 8 <= t->blocks[i].length; ) {
+    uint32_t lengths[2];
+    int c;
+    memcpy(lengths, buf + pos, sizeof lengths);
+    pos += sizeof lengths;
+    c = compare_keys(buf + pos, lengths[0], key, key_length);
+    if (c > 0) break;
+    if (c == 0) {
+      *value = NULL;
+      *value_length = lengths[1];
+      ret = 1;
+      if (lengths[1] && (*value = malloc(lengths[1])) == NULL) ret = -1;
+      else if (lengths[1]) memcpy(*value, buf + pos + lengths[0], lengths[1]);
+      break;
+    }
+    pos += lengths[0] + lengths[1];
+  }
+  free(buf);
+  return ret;
+}
+
+typedef struct table_iter {
+  lsm_iter_t it;
+  lsm_table_t *table;
+  size_t block;
+  char *buf;
+  uint32_t pos;
+} table_iter_t;
+
+// Points the iterator at the entry at pos of the loaded block, moving
+// on to the next blocks once it is done.
+static int table_iter_set(table_iter_t *ti) {
+  lsm_table_t *t = ti->table;
+  uint32_t lengths[2];
+  while (ti->pos + sizeof lengths > t->blocks[ti->block].length) {
+    free(ti->buf);
+    ti->buf = NULL;
+    ti->pos = 0;
+    ti->it.key = NULL;
+    if (++ti->block >= t->nr_blocks) return 0;
+    ti->buf = table_read_block(t, ti->block);
+    if (ti->buf == NULL) return -1;
+  }
+  memcpy(lengths, ti->buf + ti->pos, sizeof lengths);
+  ti->it.key = ti->buf + ti->pos + sizeof lengths;
+  ti->it.key_length = lengths[0];
+  ti->it.value = ti->it.key + lengths[0];
+  ti->it.value_length = lengths[1];
+  return 0;
+}
+
+static int table_iter_next(lsm_iter_t *it) {
+  table_iter_t *ti = (table_iter_t *)it;
+  ti->pos += 8 + it->key_length + it->value_length;
+  return table_iter_set(ti);
+}
+
+static int table_iter_seek(lsm_iter_t *it, const char *key,
+    uint32_t key_length) {
+  table_iter_t *ti = (table_iter_t *)it;
+  lsm_table_t *t = ti->table;
+  free(ti->buf);
+  ti->buf = NULL;
+  ti->pos = 0;
+  it->key = NULL;
+  ti->block = key != NULL ? table_find_block(t, key, key_length) : 0;
+  if (ti->block >= t->nr_blocks) return 0;
+  ti->buf = table_read_block(t, ti->block);
+  if (ti->buf == NULL || table_iter_set(ti)) return -1;
+  while (key != NULL && it->key != NULL &&
+      compare_keys(it->key, it->key_length, key, key_length) < 0)
+    if (table_iter_next(it)) return -1;
+  return 0;
+}
+
+static void table_iter_free(lsm_iter_t *it) {
+  free(((table_iter_t *)it)->buf);
+  free(it);
+}
+
+static void table_iter_init(table_iter_t *ti, lsm_table_t *t) {
+  memset(ti, 0, sizeof *ti);
+  ti->table = t;
+  ti->it.seek = table_iter_seek;
+  ti->it.next = table_iter_next;
+  ti->it.free = table_iter_free;
+}
+
+static lsm_iter_t *table_iter_new(lsm_table_t *t) {
+  table_iter_t *ti = malloc(sizeof *ti);
+  if (ti == NULL) return NULL;
+  table_iter_init(ti, t);
+  return &ti->it;
+}
+
+// Iterates over the tables of a level from 1 on, sorted by key.
+typedef struct level_iter {
+  lsm_iter_t it;
+  lsm_table_t **tables;
+  size_t nr_tables, i;
+  table_iter_t cur;
+} level_iter_t;
+
+static void level_iter_copy(level_iter_t *li) {
+  li->it.key = li->cur.it.key;
+  li->it.key_length = li->cur.it.key_length;
+  li->it.value = li->cur.it.value;
+  li->it.value_length = li->cur.it.value_length;
+}
+
+// Moves on to the next tables while the current one is done.
+static int level_iter_skip(level_iter_t *li) {
+  while (li->cur.it.key == NULL && li->i + 1 < li->nr_tables) {
+    free(li->cur.buf);
+    table_iter_init(&li->cur, li->tables[++li->i]);
+    if (table_iter_seek(&li->cur.it, NULL, 0)) return -1;
+  }
+  level_iter_copy(li);
+  return 0;
+}
+
+static int level_iter_seek(lsm_iter_t *it, const char *key,
+    uint32_t key_length) {
+  level_iter_t *li = (level_iter_t *)it;
+  size_t lo = 0, hi = li->nr_tables;
+  // the first table whose largest key is not less than key
+  while (key != NULL && lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    lsm_table_t *t = li->tables[mid];
+    if (compare_keys(t->largest, t->largest_length, key, key_length) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  free(li->cur.buf);
+  li->cur.buf = NULL;
+  li->cur.it.key = NULL;
+  li->i = lo;
+  if (lo >= li->nr_tables) {
+    it->key = NULL;
+    return 0;
+  }
+  table_iter_init(&li->cur, li->tables[lo]);
+  if (table_iter_seek(&li->cur.it, key, key_length)) return -1;
+  return level_iter_skip(li);
+}
+
+static int level_iter_next(lsm_iter_t *it) {
+  level_iter_t *li = (level_iter_t *)it;
+  if (table_iter_next(&li->cur.it)) return -1;
+  return level_iter_skip(li);
+}
+
+static void level_iter_free(lsm_iter_t *it) {
+  free(((level_iter_t *)it)->cur.buf);
+  free(it);
+}
+
+static lsm_iter_t *level_iter_new(lsm_table_t **tables, size_t nr_tables) {
+  level_iter_t *li = calloc(1, sizeof *li);
+  if (li == NULL) return NULL;
+  li->tables = tables;
+  li->nr_tables = nr_tables;
+  li->it.seek = level_iter_seek;
+  li->it.next = level_iter_next;
+  li->it.free = level_iter_free;
+  return &li->it;
+}
+
+typedef struct merge_iter {
+  lsm_iter_t it;
+  lsm_iter_t **children;  // newest first
+  size_t nr_children;
+  lsm_iter_t *cur;
+} merge_iter_t;
+
+static void merge_iter_pick(merge_iter_t *mi) {
+  mi->cur = NULL;
+  for (size_t i = 0; i < mi->nr_children; i++) {
+    lsm_iter_t *c = mi->children[i];
+    if (c->key != NULL && (mi->cur == NULL || compare_keys(c->key,
+            c->key_length, mi->cur->key, mi->cur->key_length) < 0))
+      mi->cur = c;
+  }
+  mi->it.key = NULL;
+  if (mi->cur != NULL) {
+    mi->it.key = mi->cur->key;
+    mi->it.key_length = mi->cur->key_length;
+    mi->it.value = mi->cur->value;
+    mi->it.value_length = mi->cur->value_length;
+  }
+}
+
+static int merge_iter_seek(lsm_iter_t *it, const char *key,
+    uint32_t key_length) {
+  merge_iter_t *mi = (merge_iter_t *)it;
+  for (size_t i = 0; i < mi->nr_children; i++)
+    if (mi->children[i]->seek(mi->children[i], key, key_length)) return -1;
+  merge_iter_pick(mi);
+  return 0;
+}
+
+// Older versions of the current key in the other children go too.  The
+// current child goes last, since the key lives in its memory.
+static int merge_iter_next(lsm_iter_t *it) {
+  merge_iter_t *mi = (merge_iter_t *)it;
+  for (size_t i = 0; i < mi->nr_children; i++) {
+    lsm_iter_t *c = mi->children[i];
+    if (c != mi->cur && c->key != NULL && compare_keys(c->key,
+          c->key_length, it->key, it->key_length) == 0 && c->next(c))
+      return -1;
+  }
+  if (mi->cur->next(mi->cur)) return -1;
+  merge_iter_pick(mi);
+  return 0;
+}
+
+static void merge_iter_free(lsm_iter_t *it) {
+  merge_iter_t *mi = (merge_iter_t *)it;
+  for (size_t i = 0; i < mi->nr_children; i++)
+    mi->children[i]->free(mi->children[i]);
+  free(mi->children);
+  free(mi);
+}
+
+// Takes over the children, also on failure.
+static lsm_iter_t *merge_iter_new(lsm_iter_t **children, size_t n) {
+  merge_iter_t *mi = calloc(1, sizeof *mi);
+  if (mi == NULL) {
+    for (size_t i = 0; i < n; i++) children[i]->free(children[i]);
+    free(children);
+    return NULL;
+  }
+  mi->children = children;
+  mi->nr_children = n;
+  mi->it.seek = merge_iter_seek;
+  mi->it.next = merge_iter_next;
+  mi->it.free = merge_iter_free;
+  return &mi->it;
+}
+
+// Writes a table, keys in ascending order.
+typedef struct lsm_builder {
+  long number;
+  char *path;
+  int fd;
+  long offset;
+  char *block, *index, *hashes, *smallest, *last;
+  size_t block_length, block_cap, index_length, index_cap;
+  size_t hashes_length, hashes_cap, last_cap;
+  uint32_t smallest_length, last_length;
+} lsm_builder_t;
+
+static int builder_start(kvdb_t *db, lsm_builder_t *b, long number) {
+  memset(b, 0, sizeof *b);
+  b->number = number;
+  b->path = lsm_file(db, number, "sst");
+  if (b->path == NULL) return -1;
+  b->fd = open(b->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (b->fd < 0) {
+    free(b->path);
+    return -1;
+  }
+  return 0;
+}
+
+static void builder_free(lsm_builder_t *b) {
+  free(b->path);
+  free(b->block);
+  free(b->index);
+  free(b->hashes);
+  free(b->smallest);
+  free(b->last);
+}
+
+static void builder_abort(lsm_builder_t *b) {
+  close(b->fd);
+  unlink(b->path);
+  builder_free(b);
+}
+
+static int builder_flush_block(lsm_builder_t *b) {
+  lsm_index_entry_t entry;
+  uint32_t crc = crc32c(0, b->block, b->block_length);
+  if (b->block_length == 0) return 0;
+  if (write_all(b->fd, b->block, b->block_length) ||
+      write_all(b->fd, &crc, sizeof crc))
+    return -1;
+  entry.offset = b->offset;
+  entry.length = b->block_length;
+  entry.key_length = b->last_length;
+  if (buf_append(&b->index, &b->index_length, &b->index_cap, &entry,
+        sizeof entry) ||
+      buf_append(&b->index, &b->index_length, &b->index_cap, b->last,
+        b->last_length))
+    return -1;
+  b->offset += b->block_length + sizeof crc;
+  b->block_length = 0;
+  return 0;
+}
+
+static int builder_add(lsm_builder_t *b, const char *key,
+    uint32_t key_length, const char *value, uint32_t value_length) {
+  uint32_t lengths[2] = { key_length, value_length };
+  uint32_t hash = hash_key(key, key_length);
+  size_t n = 0;
+  if (b->block_length > 0 && b->block_length + sizeof lengths + key_length +
+      value_length > LSM_BLOCK_BYTES && builder_flush_block(b))
+    return -1;
+  if (b->smallest == NULL) {
+    if ((b->smallest = malloc(key_length)) == NULL) return -1;
+    memcpy(b->smallest, key, key_length);
+    b->smallest_length = key_length;
+  }
+  if (buf_append(&b->block, &b->block_length, &b->block_cap, lengths,
+        sizeof lengths) ||
+      buf_append(&b->block, &b->block_length, &b->block_cap, key,
+        key_length) ||
+      buf_append(&b->block, &b->block_length, &b->block_cap, value,
+        value_length) ||
+      buf_append(&b->hashes, &b->hashes_length, &b->hashes_cap, &hash,
+        sizeof hash) ||
+      buf_append(&b->last, &n, &b->last_cap, key, key_length))
+    return -1;
+  b->last_length = key_length;
+  return 0;
+}
+
+static long builder_size(const lsm_builder_t *b) {
+  return b->offset + b->block_length;
+}
+
+// Finishes the table and opens it; nothing is left of a table without
+// keys.
+static lsm_table_t *builder_finish(kvdb_t *db, lsm_builder_t *b) {
+  size_t nr_keys = b->hashes_length / sizeof(uint32_t);
+  lsm_footer_t footer;
+  lsm_table_t *t;
+  uint8_t *bloom;
+  if (nr_keys == 0) {
+    builder_abort(b);
+    return NULL;
+  }
+  if (builder_flush_block(b)) goto fret1;
+  memset(&footer, 0, sizeof footer);
+  footer.magic = LSM_TABLE_MAGIC;
+  footer.bloom_k = LSM_BLOOM_BITS * 69 / 100;
+  footer.index_offset = b->offset;
+  footer.index_length = b->index_length;
+  footer.bloom_length = (nr_keys * LSM_BLOOM_BITS + 63) / 64 * 8;
+  bloom = calloc(footer.bloom_length, 1);
+  if (bloom == NULL) goto fret1;
+  for (size_t i = 0; i < nr_keys; i++) {
+    uint32_t hash, delta;
+    memcpy(&hash, b->hashes + i * sizeof hash, sizeof hash);
+    delta = hash >> 17 | hash << 15;
+    for (uint32_t k = 0; k < footer.bloom_k; k++, hash += delta) {
+      uint64_t bit = hash % (footer.bloom_length * 8);
+      bloom[bit / 8] |= 1 << bit % 8;
+    }
+  }
+  footer.checksum = crc32c(crc32c(0, b->index, b->index_length), bloom,
+      footer.bloom_length);
+  if (write_all(b->fd, b->index, b->index_length) ||
+      write_all(b->fd, bloom, footer.bloom_length) ||
+      write_all(b->fd, &footer, sizeof footer) || fsync(b->fd)) {
+    free(bloom);
+    goto fret1;
+  }
+  free(bloom);
+  if (close(b->fd)) {
+    b->fd = -1;
+    goto fret2;
+  }
+  t = table_open(db, b->number, b->offset + b->index_length +
+      footer.bloom_length + sizeof footer, b->smallest, b->smallest_length,
+      b->last, b->last_length);
+  if (t == NULL) goto fret2;
+  builder_free(b);
+  return t;
+fret1:
+  close(b->fd);
+fret2:
+  unlink(b->path);
+  builder_free(b);
+  return NULL;
+}
+
+// A version is what readers see: the memtables and the tables of every
+// level, level 0 newest first and the other levels sorted by key.
+// Readers take a reference under lsm->lock.
+typedef struct lsm_version {
+  int refs;
+  lsm_memtable_t *mem, *imm;
+  lsm_table_t **tables[LSM_LEVELS];
+  size_t nr_tables[LSM_LEVELS];
+} lsm_version_t;
+
+// The copy of a value that kvdb_get_view returned to a thread, kept
+// until that thread's next view or the next mutation.
+typedef struct lsm_view {
+  struct lsm_view *next;
+  pthread_t thread;
+  char *value;
+} lsm_view_t;
+
+struct kvdb_lsm {
+  pthread_mutex_t lock;   // current and everything below
+  pthread_cond_t cond;    // signals work for and from the background
+  lsm_version_t *current;
+  long next_number;       // of the next file
+  int lock_fd;
+  pthread_t thread;
+  int stop, manual, manual_status, error;
+  size_t compact_next[LSM_LEVELS];    // round robin over a level
+  lsm_view_t *views;      // of kvdb_get_view, one per thread
+};
+
+static void version_unref(lsm_version_t *v) {
+  if (v == NULL || __atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL))
+    return;
+  mem_unref(v->mem);
+  mem_unref(v->imm);
+  for (int level = 0; level < LSM_LEVELS; level++) {
+    for (size_t i = 0; i < v->nr_tables[level]; i++)
+      table_unref(v->tables[level][i]);
+    free(v->tables[level]);
+  }
+  free(v);
+}
+
+// Takes new references to everything it is given.
+static lsm_version_t *version_new(lsm_memtable_t *mem, lsm_memtable_t *imm,
+    lsm_table_t **tables[], const size_t nr_tables[]) {
+  lsm_version_t *v = calloc(1, sizeof *v);
+  if (v == NULL) return NULL;
+  v->refs = 1;
+  for (int level = 0; level < LSM_LEVELS; level++) {
+    size_t n = nr_tables[level];
+    v->tables[level] = malloc(n * sizeof(lsm_table_t *) + 1);
+    if (v->tables[level] == NULL) {
+      version_unref(v);
+      return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+      v->tables[level][i] = tables[level][i];
+      __atomic_add_fetch(&tables[level][i]->refs, 1, __ATOMIC_RELAXED);
+    }
+    v->nr_tables[level] = n;
+  }
+  if ((v->mem = mem) != NULL) __atomic_add_fetch(&mem->refs, 1,
+      __ATOMIC_RELAXED);
+  if ((v->imm = imm) != NULL) __atomic_add_fetch(&imm->refs, 1,
+      __ATOMIC_RELAXED);
+  return v;
+}
+
+// Makes a new version current; called with lsm->lock held.
+static int version_install(struct kvdb_lsm *lsm, lsm_memtable_t *mem,
+    lsm_memtable_t *imm, lsm_table_t **tables[], const size_t nr_tables[]) {
+  lsm_version_t *v = version_new(mem, imm, tables, nr_tables);
+  if (v == NULL) return -1;
+  version_unref(lsm->current);
+  lsm->current = v;
+  return 0;
+}
+
+static lsm_version_t *version_get(struct kvdb_lsm *lsm) {
+  lsm_version_t *v;
+  pthread_mutex_lock(&lsm->lock);
+  v = lsm->current;
+  __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&lsm->lock);
+  return v;
+}
+
+// An iterator over the whole version, deletions included.
+static lsm_iter_t *version_iter(lsm_version_t *v) {
+  size_t n = 0;
+  lsm_iter_t **children = malloc((LSM_LEVELS + 2 + v->nr_tables[0]) *
+      sizeof *children);
+  if (children == NULL) return NULL;
+  if (v->mem != NULL) children[n++] = mem_iter_new(v->mem);
+  if (v->imm != NULL) children[n++] = mem_iter_new(v->imm);
+  for (size_t i = 0; i < v->nr_tables[0]; i++)
+    children[n++] = table_iter_new(v->tables[0][i]);
+  for (int level = 1; level < LSM_LEVELS; level++)
+    if (v->nr_tables[level])
+      children[n++] = level_iter_new(v->tables[level],
+          v->nr_tables[level]);
+  for (size_t i = 0; i < n; i++) {
+    if (children[i] == NULL) {
+      for (size_t j = 0; j < n; j++)
+        if (children[j] != NULL) children[j]->free(children[j]);
+      free(children);
+      return NULL;
+    }
+  }
+  return merge_iter_new(children, n);
+}
+
+// The manifest: this header, then for every table an lsm_manifest_table_t
+// with its smallest and largest keys, then the CRC-32C of all of it.  It
+// is rewritten as a whole and renamed into place.
+typedef struct lsm_manifest_header {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t next_number;
+  uint64_t wal_number;    // write-ahead logs before this one are flushed
+  uint64_t nr_tables;
+} lsm_manifest_header_t;
+
+typedef struct lsm_manifest_table {
+  uint32_t level;
+  uint32_t smallest_length, largest_length;
+  uint32_t reserved;
+  uint64_t number, size;
+} lsm_manifest_table_t;
+
+static char *manifest_path(kvdb_t *db, const char *suffix) {
+  char *path = malloc(strlen(db->path) + 16);
+  if (path != NULL) sprintf(path, "%s/MANIFEST%s", db->path, suffix);
+  return path;
+}
+
+static char *manifest_encode(struct kvdb_lsm *lsm, lsm_table_t **tables[],
+    const size_t nr_tables[], long wal_number, size_t *length) {
+  lsm_manifest_header_t hdr;
+  char *buf = NULL;
+  size_t cap = 0;
+  uint32_t crc;
+  memset(&hdr, 0, sizeof hdr);
+  hdr.magic = LSM_MANIFEST_MAGIC;
+  hdr.next_number = lsm->next_number;
+  hdr.wal_number = wal_number;
+  for (int level = 0; level < LSM_LEVELS; level++)
+    hdr.nr_tables += nr_tables[level];
+  *length = 0;
+  if (buf_append(&buf, length, &cap, &hdr, sizeof hdr)) goto fret;
+  for (int level = 0; level < LSM_LEVELS; level++) {
+    for (size_t i = 0; i < nr_tables[level]; i++) {
+      lsm_table_t *t = tables[level][i];
+      lsm_manifest_table_t mt;
+      memset(&mt, 0, sizeof mt);
+      mt.level = level;
+      mt.smallest_length = t->smallest_length;
+      mt.largest_length = t->largest_length;
+      mt.number = t->number;
+      mt.size = t->size;
+      if (buf_append(&buf, length, &cap, &mt, sizeof mt) ||
+          buf_append(&buf, length, &cap, t->smallest, t->smallest_length) ||
+          buf_append(&buf, length, &cap, t->largest, t->largest_length))
+        goto fret;
+    }
+  }
+  crc = crc32c(0, buf, *length);
+  if (buf_append(&buf, length, &cap, &crc, sizeof crc)) goto fret;
+  return buf;
+fret:
+  free(buf);
+  return NULL;
+}
+
+static int manifest_write(kvdb_t *db, const char *buf, size_t length) {
+  char *path = manifest_path(db, ""), *tmp = manifest_path(db, ".tmp");
+  int fd, ret = -1;
+  if (path == NULL || tmp == NULL) goto fret;
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) goto fret;
+  if (write_all(fd, buf, length) || fsync(fd)) {
+    close(fd);
+    unlink(tmp);
+    goto fret;
+  }
+  if (close(fd) || rename(tmp, path)) {
+    unlink(tmp);
+    goto fret;
+  }
+  ret = fsync_dir(path);
+fret:
+  free(path);
+  free(tmp);
+  return ret;
+}
+
+// Records new tables for all levels and makes them current, along with
+// the memtables of the moment, less imm if it has just been flushed.
+// Called with lsm->lock held, which is dropped while writing.  Only the
+// background thread changes the tables, so they cannot change meanwhile.
+static int lsm_apply(kvdb_t *db, lsm_table_t **tables[],
+    const size_t nr_tables[], int flushed) {
+  struct kvdb_lsm *lsm = db->lsm;
+  lsm_version_t *v = lsm->current;
+  size_t length;
+  char *buf = manifest_encode(lsm, tables, nr_tables,
+      flushed || v->imm == NULL ? v->mem->number : v->imm->number, &length);
+  int ret;
+  if (buf == NULL) return -1;
+  pthread_mutex_unlock(&lsm->lock);
+  ret = manifest_write(db, buf, length);
+  free(buf);
+  pthread_mutex_lock(&lsm->lock);
+  if (ret) return -1;
+  return version_install(lsm, lsm->current->mem,
+      flushed ? NULL : lsm->current->imm, tables, nr_tables);
+}
+
+static int finish_table(kvdb_t *db, lsm_builder_t *b, lsm_table_t ***out,
+    size_t *nr_out, size_t *cap) {
+  lsm_table_t *t = builder_finish(db, b);
+  if (t == NULL) return -1;
+  if (*nr_out == *cap) {
+    lsm_table_t **p;
+    *cap = *cap ? *cap * 2 : 8;
+    p = realloc(*out, *cap * sizeof *p);
+    if (p == NULL) {
+      t->obsolete = 1;
+      table_unref(t);
       return -1;
-    if (ftell(db->fp) > filesz) break;
-    db->size = ftell(db->fp);
-    if (db->size < 0) return -1;
+    }
+    *out = p;
   }
-  return ftruncate(fileno(db->fp), db->size);
+  (*out)[(*nr_out)++] = t;
+  return 0;
 }
 
-// Note: this function does not guarantee thread-safety!
-int kvdb_open(kvdb_t *db, const char *filename) {
-  //  // BUG: no error checking
-  db->fd = open(filename, O_RDWR | O_CREAT, 0666);
-  if (db->fd < 0) {
-    db->fd = 0;
-    return -1;
+// Writes the entries of it to new tables of about split bytes each,
+// leaving out deletions if drop is set.  Called without lsm->lock.
+static int write_tables(kvdb_t *db, lsm_iter_t *it, int drop, long split,
+    lsm_table_t ***out, size_t *nr_out) {
+  struct kvdb_lsm *lsm = db->lsm;
+  lsm_builder_t b;
+  int building = 0;
+  size_t cap = 0;
+  *out = NULL;
+  *nr_out = 0;
+  if (it->seek(it, NULL, 0)) goto fret;
+  for (; it->key != NULL; ) {
+    if (!drop || it->value_length) {
+      if (!building) {
+        long number;
+        pthread_mutex_lock(&lsm->lock);
+        number = lsm->next_number++;
+        pthread_mutex_unlock(&lsm->lock);
+        if (builder_start(db, &b, number)) goto fret;
+        building = 1;
+      }
+      if (builder_add(&b, it->key, it->key_length, it->value,
+            it->value_length))
+        goto fret;
+      if (builder_size(&b) >= split) {
+        building = 0;
+        if (finish_table(db, &b, out, nr_out, &cap)) goto fret;
+      }
+    }
+    if (it->next(it)) goto fret;
   }
-  db->fp = fdopen(db->fd, "r+");
-  if (db->fp == NULL) {
-    db->fd = 0;
-    return -1;
+  if (building) {
+    building = 0;
+    if (finish_table(db, &b, out, nr_out, &cap)) goto fret;
   }
-  if (pthread_mutex_init(&db->mutex, NULL)) goto fret1;
-  db->size = 0;
-  if (flock(fileno(db->fp), LOCK_SH)) goto fret1;  
-  if (update_size(db)) goto fret2;
-  flock(fileno(db->fp), LOCK_UN);
   return 0;
-fret2:
-  flock(fileno(db->fp), LOCK_UN);
-fret1:
-  fclose(db->fp);
+fret:
+  if (building) builder_abort(&b);
+  for (size_t i = 0; i < *nr_out; i++) {
+    (*out)[i]->obsolete = 1;
+    table_unref((*out)[i]);
+  }
+  free(*out);
+  *out = NULL;
+  *nr_out = 0;
   return -1;
 }
 
-// Note: this function does not guarantee thread-safety!
-int kvdb_close(kvdb_t *db) {
-  //  // BUG: no error checking
+// Removes the write-ahead logs numbered below the given one.
+static void remove_wals(kvdb_t *db, long below) {
+  DIR *dir = opendir(db->path);
+  struct dirent *de;
+  if (dir == NULL) return;
+  while ((de = readdir(dir)) != NULL) {
+    char *end, *path;
+    long number = strtol(de->d_name, &end, 10);
+    if (end == de->d_name || strcmp(end, ".wal") || number >= below)
+      continue;
+    if ((path = lsm_file(db, number, "wal")) != NULL) unlink(path);
+    free(path);
+  }
+  closedir(dir);
+}
+
+static int compare_smallest(const void *a, const void *b) {
+  const lsm_table_t *x = *(lsm_table_t *const *)a;
+  const lsm_table_t *y = *(lsm_table_t *const *)b;
+  return compare_keys(x->smallest, x->smallest_length, y->smallest,
+      y->smallest_length);
+}
+
+// Writes the immutable memtable to a new table of level 0.  Called by
+// the background thread with lsm->lock held.
+static int lsm_flush(kvdb_t *db) {
+  struct kvdb_lsm *lsm = db->lsm;
+  lsm_version_t *v = lsm->current;
+  lsm_table_t **tables[LSM_LEVELS], **out;
+  size_t nr_tables[LSM_LEVELS], nr_out;
+  lsm_iter_t *it;
+  int ret;
+  __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&lsm->lock);
+  // deletions have to stay: older tables may have the keys
+  it = mem_iter_new(v->imm);
+  ret = it != NULL ? write_tables(db, it, 0, LONG_MAX, &out, &nr_out) : -1;
+  if (it != NULL) it->free(it);
+  pthread_mutex_lock(&lsm->lock);
+  if (ret == 0) {
+    memcpy(tables, v->tables, sizeof tables);
+    memcpy(nr_tables, v->nr_tables, sizeof nr_tables);
+    tables[0] = malloc((nr_out + v->nr_tables[0]) * sizeof *tables[0] + 1);
+    if (tables[0] != NULL) {
+      memcpy(tables[0], out, nr_out * sizeof *out);
+      memcpy(tables[0] + nr_out, v->tables[0],
+          v->nr_tables[0] * sizeof *out);
+      nr_tables[0] += nr_out;
+      ret = lsm_apply(db, tables, nr_tables, 1);
+      free(tables[0]);
+    } else {
+      ret = -1;
+    }
+    for (size_t i = 0; i < nr_out; i++) {
+      out[i]->obsolete = ret != 0;
+      table_unref(out[i]);
+    }
+    free(out);
+    if (ret == 0) remove_wals(db, lsm->current->mem->number);
+  }
+  version_unref(v);
+  return ret;
+}
+
+// A compaction merges its inputs, runs of tables in some levels, into
+// new tables of out_level.
+typedef struct lsm_compaction {
+  int level;              // the level it starts from, -1 for all of them
+  int out_level;
+  lsm_table_t **inputs[LSM_LEVELS];
+  size_t nr_inputs[LSM_LEVELS];
+} lsm_compaction_t;
+
+static long level_bytes(const lsm_version_t *v, int level) {
+  long bytes = 0;
+  for (size_t i = 0; i < v->nr_tables[level]; i++)
+    bytes += v->tables[level][i]->size;
+  return bytes;
+}
+
+// The tables of a level from 1 on that overlap [lo, hi].
+static size_t overlapping(const lsm_version_t *v, int level,
+    const lsm_table_t *lo, const lsm_table_t *hi, lsm_table_t ***first) {
+  size_t i = 0, n = 0;
+  while (i < v->nr_tables[level] && compare_keys(v->tables[level][i]->largest,
+        v->tables[level][i]->largest_length, lo->smallest,
+        lo->smallest_length) < 0)
+    i++;
+  while (i + n < v->nr_tables[level] && compare_keys(
+        v->tables[level][i + n]->smallest,
+        v->tables[level][i + n]->smallest_length, hi->largest,
+        hi->largest_length) <= 0)
+    n++;
+  *first = v->tables[level] + i;
+  return n;
+}
+
+// Picks the most urgent compaction, if any; called with lsm->lock held.
+static int pick_compaction(struct kvdb_lsm *lsm, lsm_compaction_t *c) {
+  lsm_version_t *v = lsm->current;
+  const lsm_table_t *lo, *hi;
+  long max_bytes = LSM_L1_BYTES;
+  memset(c, 0, sizeof *c);
+  c->level = -1;
+  if (v->nr_tables[0] >= LSM_L0_COMPACT) {
+    c->level = 0;
+    c->inputs[0] = v->tables[0];
+    c->nr_inputs[0] = v->nr_tables[0];
+  }
+  for (int level = 1; c->level < 0 && level < LSM_LEVELS - 1; level++) {
+    if (level_bytes(v, level) > max_bytes) {
+      size_t i = lsm->compact_next[level]++ % v->nr_tables[level];
+      c->level = level;
+      c->inputs[level] = v->tables[level] + i;
+      c->nr_inputs[level] = 1;
+    }
+    max_bytes *= 10;
+  }
+  if (c->level < 0) return 0;
+  lo = hi = c->inputs[c->level][0];
+  for (size_t i = 1; i < c->nr_inputs[c->level]; i++) {
+    const lsm_table_t *t = c->inputs[c->level][i];
+    if (compare_smallest(&t, &lo) < 0) lo = t;
+    if (compare_keys(t->largest, t->largest_length, hi->largest,
+          hi->largest_length) > 0)
+      hi = t;
+  }
+  c->out_level = c->level + 1;
+  c->nr_inputs[c->out_level] = overlapping(v, c->out_level, lo, hi,
+      &c->inputs[c->out_level]);
+  return 1;
+}
+
+// Whether no level below out_level may hold the keys of the inputs, so
+// that deletions are of no use any more.
+static int is_bottom(const lsm_version_t *v, const lsm_compaction_t *c) {
+  for (int level = 0; level < LSM_LEVELS; level++) {
+    for (size_t i = 0; i < c->nr_inputs[level]; i++) {
+      lsm_table_t **first, *t = c->inputs[level][i];
+      for (int deeper = c->out_level + 1; deeper < LSM_LEVELS; deeper++)
+        if (overlapping(v, deeper, t, t, &first)) return 0;
+    }
+  }
+  return 1;
+}
+
+static int is_input(const lsm_compaction_t *c, int level,
+    const lsm_table_t *t) {
+  for (size_t i = 0; i < c->nr_inputs[level]; i++)
+    if (c->inputs[level][i] == t) return 1;
+  return 0;
+}
+
+// Runs a compaction of the current version; called by the background
+// thread with lsm->lock held.
+static int lsm_run_compaction(kvdb_t *db, lsm_compaction_t *c) {
+  struct kvdb_lsm *lsm = db->lsm;
+  lsm_version_t *v = lsm->current;
+  lsm_table_t **tables[LSM_LEVELS] = { NULL }, **out = NULL;
+  size_t nr_tables[LSM_LEVELS], nr_out = 0, n = 0;
+  lsm_iter_t **children, *it;
+  int ret = -1, drop = is_bottom(v, c), moved = 0;
+  __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+  if (c->level > 0 && c->nr_inputs[c->level] == 1 &&
+      c->nr_inputs[c->out_level] == 0) {
+    // nothing to merge with: the table just moves down
+    moved = 1;
+    out = malloc(sizeof *out);
+    if (out == NULL) goto fret;
+    out[nr_out++] = c->inputs[c->level][0];
+    __atomic_add_fetch(&out[0]->refs, 1, __ATOMIC_RELAXED);
+  } else {
+    children = malloc((LSM_LEVELS + c->nr_inputs[0]) * sizeof *children);
+    if (children == NULL) goto fret;
+    for (size_t i = 0; i < c->nr_inputs[0]; i++)
+      children[n++] = table_iter_new(c->inputs[0][i]);
+    for (int level = 1; level < LSM_LEVELS; level++)
+      if (c->nr_inputs[level])
+        children[n++] = level_iter_new(c->inputs[level],
+            c->nr_inputs[level]);
+    for (size_t i = 0; i < n; i++) {
+      if (children[i] == NULL) {
+        for (size_t j = 0; j < n; j++)
+          if (children[j] != NULL) children[j]->free(children[j]);
+        free(children);
+        goto fret;
+      }
+    }
+    if ((it = merge_iter_new(children, n)) == NULL) goto fret;
+    pthread_mutex_unlock(&lsm->lock);
+    ret = write_tables(db, it, drop, LSM_TABLE_BYTES, &out, &nr_out);
+    it->free(it);
+    pthread_mutex_lock(&lsm->lock);
+    if (ret) goto fret;
+    ret = -1;
+  }
+  for (int level = 0; level < LSM_LEVELS; level++) {
+    size_t extra = level == c->out_level ? nr_out : 0;
+    tables[level] = malloc((v->nr_tables[level] + extra) *
+        sizeof *tables[level] + 1);
+    if (tables[level] == NULL) goto fret;
+    nr_tables[level] = 0;
+    for (size_t i = 0; i < v->nr_tables[level]; i++)
+      if (!is_input(c, level, v->tables[level][i]))
+        tables[level][nr_tables[level]++] = v->tables[level][i];
+    if (extra) {
+      memcpy(tables[level] + nr_tables[level], out, nr_out * sizeof *out);
+      nr_tables[level] += nr_out;
+      qsort(tables[level], nr_tables[level], sizeof *tables[level],
+          compare_smallest);
+    }
+  }
+  ret = lsm_apply(db, tables, nr_tables, 0);
+fret:
+  // the files of the old tables go once no version has them
+  for (int level = 0; level < LSM_LEVELS; level++) {
+    for (size_t i = 0; ret == 0 && !moved && i < c->nr_inputs[level]; i++)
+      c->inputs[level][i]->obsolete = 1;
+    free(tables[level]);
+  }
+  for (size_t i = 0; i < nr_out; i++) {
+    if (ret && !moved) out[i]->obsolete = 1;
+    table_unref(out[i]);
+  }
+  free(out);
+  version_unref(v);
+  return ret;
+}
+
+// Merges all tables into the deepest level in use.
+static int lsm_compact_all(kvdb_t *db) {
+  lsm_version_t *v = db->lsm->current;
+  lsm_compaction_t c;
+  memset(&c, 0, sizeof c);
+  c.level = -1;
+  c.out_level = 1;
+  for (int level = 0; level < LSM_LEVELS; level++) {
+    c.inputs[level] = v->tables[level];
+    c.nr_inputs[level] = v->nr_tables[level];
+    if (level > 0 && v->nr_tables[level]) c.out_level = level;
+  }
+  for (int level = 0; level < LSM_LEVELS; level++)
+    if (c.nr_inputs[level]) return lsm_run_compaction(db, &c);
+  return 0;
+}
+
+static void *lsm_background(void *arg) {
+  kvdb_t *db = arg;
+  struct kvdb_lsm *lsm = db->lsm;
+  lsm_compaction_t c;
+  pthread_mutex_lock(&lsm->lock);
+  for (;;) {
+    int ret;
+    if (lsm->current->imm != NULL && !lsm->error) {
+      ret = lsm_flush(db);
+    } else if (lsm->stop) {
+      break;
+    } else if (lsm->manual) {
+      ret = lsm->error ? -1 : lsm_compact_all(db);
+      lsm->manual_status = ret;
+      lsm->manual = 0;
+    } else if (!lsm->error && pick_compaction(lsm, &c)) {
+      ret = lsm_run_compaction(db, &c);
+    } else {
+      pthread_cond_wait(&lsm->cond, &lsm->lock);
+      continue;
+    }
+    // writers waiting for room fail from now on
+    if (ret) lsm->error = 1;
+    pthread_cond_broadcast(&lsm->cond);
+  }
+  pthread_mutex_unlock(&lsm->lock);
+  return NULL;
+}
+
+// Creates the write-ahead log of a new memtable.
+static FILE *create_wal(kvdb_t *db, long number) {
+  char *path = lsm_file(db, number, "wal");
+  FILE *fp = NULL;
+  int fd;
+  if (path == NULL) return NULL;
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd >= 0 && (fsync_dir(path) || (fp = fdopen(fd, "r+")) == NULL)) {
+    close(fd);
+    unlink(path);
+  }
+  free(path);
+  return fp;
+}
+
+// Makes the memtable immutable for the background thread to flush and
+// starts a new one.  Called with db->mutex and lsm->lock held.
+static int lsm_switch(kvdb_t *db) {
+  struct kvdb_lsm *lsm = db->lsm;
+  lsm_version_t *v = lsm->current;
+  long number = lsm->next_number;
+  lsm_memtable_t *mem;
+  FILE *fp = create_wal(db, number);
+  if (fp == NULL) return -1;
+  mem = mem_new(number);
+  if (mem == NULL || version_install(lsm, mem, v->mem, v->tables,
+        v->nr_tables)) {
+    mem_unref(mem);
+    fclose(fp);
+    return -1;
+  }
+  mem_unref(mem);
+  lsm->next_number++;
   fclose(db->fp);
-  db->fp = NULL;
-  pthread_mutex_destroy(&db->mutex);
+  db->fp = fp;
+  db->fd = fileno(fp);
+  db->size = 0;
+  db->checksums = 0;
+  pthread_cond_broadcast(&lsm->cond);
   return 0;
 }
 
-int kvdb_put(kvdb_t *db, const char *key, const char *value) {
-  // BUG: no error checking
-  long pos;
-  kvdb_entry_t entry;
+// Returns the memtable to insert into once there is room in it, or
+// NULL if the background thread has failed.  Called with db->mutex held.
+static lsm_memtable_t *lsm_make_room(kvdb_t *db) {
+  struct kvdb_lsm *lsm = db->lsm;
+  lsm_memtable_t *mem = NULL;
+  pthread_mutex_lock(&lsm->lock);
+  while (!lsm->error) {
+    lsm_version_t *v = lsm->current;
+    if (v->nr_tables[0] >= LSM_L0_STOP ||
+        (v->mem->bytes >= LSM_MEMTABLE_BYTES && v->imm != NULL)) {
+      pthread_cond_wait(&lsm->cond, &lsm->lock);
+    } else if (v->mem->bytes < LSM_MEMTABLE_BYTES) {
+      mem = v->mem;
+      break;
+    } else if (lsm_switch(db)) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lsm->lock);
+  return mem;
+}
+
+static void lsm_free_views(struct kvdb_lsm *lsm) {
+  pthread_mutex_lock(&lsm->lock);
+  while (lsm->views != NULL) {
+    lsm_view_t *view = lsm->views;
+    lsm->views = view->next;
+    free(view->value);
+    free(view);
+  }
+  pthread_mutex_unlock(&lsm->lock);
+}
+
+// The write-ahead log is committed like the log, then the entries go
+// into the memtable.
+static int lsm_write_batch(kvdb_t *db, kvdb_write_t *batch) {
+  lsm_memtable_t *mem;
+  kvdb_write_t *w;
+  long end;
   if (pthread_mutex_lock(&db->mutex)) return -1;
-  if (flock(fileno(db->fp), LOCK_EX)) goto fret1;
-  if (update_size(db)) goto fret2;
-  if (fseek(db->fp, 0, SEEK_END)) goto fret2;
-  pos = ftell(db->fp);
-  if (pos < 0) goto fret2;
-  entry.sync_flag = 0;
-  entry.key_length = strlen(key) + 1;
-  entry.value_length = strlen(value) + 1;
-  entry.key_hash = 0;
-  if (fwrite(&entry, 1, sizeof entry, db->fp) < 1       ||
-      fwrite(key, 1, entry.key_length, db->fp) < 1      ||
-      fwrite(value, 1, entry.value_length, db->fp) < 1) 
-    goto fret2;
-  if (fflush(db->fp) || fsync(fileno(db->fp))) goto fret2;
-  if (fseek(db->fp, pos, SEEK_SET)) goto fret2;
-  entry.sync_flag = KVDB_SYN;
-  if (fwrite(&entry.sync_flag, 1, sizeof(uint32_t), db->fp) < 1) goto fret2;
-  if (fflush(db->fp) || fsync(fileno(db->fp))) goto fret2;
-  flock(fileno(db->fp), LOCK_UN);
+  lsm_free_views(db->lsm);
+  if ((mem = lsm_make_room(db)) == NULL) goto fret;
+  if (append_batch(db, batch, &end) < 0) goto fret;
+  db->size = end;
+  for (w = batch; w != NULL; w = w->next)
+    if (mem_apply(mem, w->record, w->length, 0) < 0) goto fret;
   pthread_mutex_unlock(&db->mutex);
   return 0;
-fret2:
-  flock(fileno(db->fp), LOCK_UN);
-fret1:
+fret:
   pthread_mutex_unlock(&db->mutex);
   return -1;
 }
 
-char *kvdb_get(kvdb_t *db, const char *key) {
-  // BUG: no error checking
-  long pos, ret_pos = 0;
-  uint32_t value_length, key_length = strlen(key) + 1;
-  kvdb_entry_t entry;
-  char *ret = NULL, *tmp = NULL;
-  if (pthread_mutex_lock(&db->mutex)) return NULL;
-  if (flock(fileno(db->fp), LOCK_SH)) goto fret1;
-  tmp = malloc(key_length);
-  if (tmp == NULL) goto fret2;
-  if (update_size(db)) goto fret3;
-  if (fseek(db->fp, 0, SEEK_SET)) goto fret3;
-  while ((pos = ftell(db->fp)) < db->size) {
-    if (pos < 0) goto fret3;
-    if (fread(&entry, 1, sizeof entry, db->fp) < 1) goto fret3;
-    if (entry.key_length == key_length) {
-      if (fread(tmp, 1, key_length, db->fp) < 1) goto fret3;
-      if (tmp[key_length - 1]) goto fret3;
-      if (strcmp(tmp, key) == 0) {
-        ret_pos = ftell(db->fp);
-        value_length = entry.value_length;
-        if (ret_pos < 0) goto fret3;
-      } 
-      if (fseek(db->fp, entry.value_length, SEEK_CUR)) goto fret3;
-    } else {
-      if (fseek(db->fp, entry.key_length + entry.value_length, SEEK_CUR))
-        goto fret3;
+// Returns the value of key from malloc and its length, NUL included, or
+// NULL if it is missing or deleted.
+static char *lsm_get(kvdb_t *db, const char *key, uint32_t key_length,
+    uint32_t *length) {
+  uint32_t hash = hash_key(key, key_length);
+  lsm_version_t *v = version_get(db->lsm);
+  lsm_memtable_t *mems[2] = { v->mem, v->imm };
+  char *value = NULL;
+  *length = 0;
+  for (int i = 0; i < 2; i++) {
+    lsm_node_t *node;
+    if (mems[i] == NULL || (node = mem_find(mems[i], key, key_length))
+        == NULL)
+      continue;
+    *length = node->value_length;
+    if (*length && (value = malloc(*length)) != NULL)
+      memcpy(value, node_value(node), *length);
+    goto out;
+  }
+  for (size_t i = 0; i < v->nr_tables[0]; i++) {
+    lsm_table_t *t = v->tables[0][i];
+    if (compare_keys(key, key_length, t->smallest, t->smallest_length) >= 0
+        && compare_keys(key, key_length, t->largest, t->largest_length) <= 0
+        && table_get(db->cache, t, key, key_length, hash, &value, length))
+      goto out;
+  }
+  // from level 1 on, the one table whose range may hold the key
+  for (int level = 1; level < LSM_LEVELS; level++) {
+    size_t lo = 0, hi = v->nr_tables[level];
+    lsm_table_t *t;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      t = v->tables[level][mid];
+      if (compare_keys(t->largest, t->largest_length, key, key_length) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
     }
+    if (lo == v->nr_tables[level]) continue;
+    t = v->tables[level][lo];
+    if (compare_keys(key, key_length, t->smallest, t->smallest_length) >= 0
+        && table_get(db->cache, t, key, key_length, hash, &value, length))
+      goto out;
+  }
+out:
+  version_unref(v);
+  return value;
+}
+
+// Values live in blocks that may go at any time, so the view is a copy.
+// It replaces the one this thread got last, so that a process that
+// only reads keeps one copy per thread.
+static const char *lsm_get_view(kvdb_t *db, const char *key,
+    size_t *length) {
+  struct kvdb_lsm *lsm = db->lsm;
+  pthread_t self = pthread_self();
+  uint32_t value_length;
+  char *value = lsm_get(db, key, strlen(key) + 1, &value_length), *old;
+  lsm_view_t **p, *view;
+  pthread_mutex_lock(&lsm->lock);
+  for (p = &lsm->views; *p != NULL; p = &(*p)->next)
+    if (pthread_equal((*p)->thread, self)) break;
+  if ((view = *p) == NULL && value != NULL &&
+      (view = malloc(sizeof *view)) != NULL) {
+    view->next = NULL;
+    view->thread = self;
+    view->value = NULL;
+    *p = view;
   }
-  if (ret_pos) {
-    ret = malloc(value_length);
-    if (ret == NULL) goto fret3;
-    if (fseek(db->fp, ret_pos, SEEK_SET)) goto fret4;
-    if (fread(ret, 1, value_length, db->fp) < 1) goto fret4;
-    if (ret[value_length - 1]) goto fret4;
+  if (view == NULL) {
+    pthread_mutex_unlock(&lsm->lock);
+    free(value);
+    return NULL;
   }
-  flock(fileno(db->fp), LOCK_UN);
+  old = view->value;
+  view->value = value;
+  pthread_mutex_unlock(&lsm->lock);
+  free(old);
+  if (value != NULL && length != NULL) *length = value_length - 1;
+  return value;
+}
+
+// Unlike the log, the keys come in order, each once.
+static int lsm_traverse(kvdb_t *db, void (*callback)(char*, char*)) {
+  lsm_version_t *v = version_get(db->lsm);
+  lsm_iter_t *it = version_iter(v);
+  int ret = it != NULL ? it->seek(it, NULL, 0) : -1;
+  while (ret == 0 && it->key != NULL) {
+    if (it->value_length)
+      callback((char *)it->key, (char *)it->value);
+    ret = it->next(it);
+  }
+  if (it != NULL) it->free(it);
+  version_unref(v);
+  return ret;
+}
+
+// Flushes the memtable and waits for the background thread to finish.
+static int lsm_checkpoint(kvdb_t *db) {
+  struct kvdb_lsm *lsm = db->lsm;
+  int ret = -1;
+  if (pthread_mutex_lock(&db->mutex)) return -1;
+  pthread_mutex_lock(&lsm->lock);
+  while (!lsm->error && lsm->current->imm != NULL)
+    pthread_cond_wait(&lsm->cond, &lsm->lock);
+  if (!lsm->error && (lsm->current->mem->bytes == 0 || lsm_switch(db) == 0))
+    while (!lsm->error && lsm->current->imm != NULL)
+      pthread_cond_wait(&lsm->cond, &lsm->lock);
+  if (!lsm->error) ret = 0;
+  pthread_mutex_unlock(&lsm->lock);
   pthread_mutex_unlock(&db->mutex);
   return ret;
+}
+
+static int lsm_compact(kvdb_t *db) {
+  struct kvdb_lsm *lsm = db->lsm;
+  int ret;
+  lsm_free_views(lsm);
+  if (lsm_checkpoint(db)) return -1;
+  pthread_mutex_lock(&lsm->lock);
+  while (lsm->manual) pthread_cond_wait(&lsm->cond, &lsm->lock);
+  lsm->manual = 1;
+  pthread_cond_broadcast(&lsm->cond);
+  while (lsm->manual) pthread_cond_wait(&lsm->cond, &lsm->lock);
+  ret = lsm->manual_status;
+  pthread_mutex_unlock(&lsm->lock);
+  return ret;
+}
+
+static int add_table(lsm_table_t **tables[], size_t nr_tables[], int level,
+    lsm_table_t *t) {
+  lsm_table_t **p = realloc(tables[level],
+      (nr_tables[level] + 1) * sizeof *p);
+  if (p == NULL) return -1;
+  tables[level] = p;
+  p[nr_tables[level]++] = t;
+  return 0;
+}
+
+// Opens the tables of the manifest, if there is one yet.
+static int manifest_read(kvdb_t *db, lsm_table_t **tables[],
+    size_t nr_tables[], long *next_number, long *wal_number) {
+  char *path = manifest_path(db, ""), *buf = NULL;
+  lsm_manifest_header_t hdr;
+  struct stat st;
+  size_t pos;
+  uint32_t crc;
+  int fd, ret = -1;
+  if (path == NULL) return -1;
+  fd = open(path, O_RDONLY);
+  free(path);
+  if (fd < 0) return errno == ENOENT ? 0 : -1;
+  if (fstat(fd, &st) || st.st_size < (off_t)(sizeof hdr + sizeof crc))
+    goto fret;
+  buf = malloc(st.st_size);
+  if (buf == NULL || read_full(fd, buf, st.st_size, 0)) goto fret;
+  memcpy(&hdr, buf, sizeof hdr);
+  memcpy(&crc, buf + st.st_size - sizeof crc, sizeof crc);
+  if (hdr.magic != LSM_MANIFEST_MAGIC ||
+      crc32c(0, buf, st.st_size - sizeof crc) != crc)
+    goto fret;
+  *next_number = hdr.next_number;
+  *wal_number = hdr.wal_number;
+  pos = sizeof hdr;
+  for (uint64_t i = 0; i < hdr.nr_tables; i++) {
+    lsm_manifest_table_t mt;
+    lsm_table_t *t;
+    if (st.st_size - sizeof crc - pos < sizeof mt) goto fret;
+    memcpy(&mt, buf + pos, sizeof mt);
+    pos += sizeof mt;
+    if (mt.level >= LSM_LEVELS || (uint64_t)mt.smallest_length +
+        mt.largest_length > st.st_size - sizeof crc - pos)
+      goto fret;
+    t = table_open(db, mt.number, mt.size, buf + pos, mt.smallest_length,
+        buf + pos + mt.smallest_length, mt.largest_length);
+    if (t == NULL) goto fret;
+    if (add_table(tables, nr_tables, mt.level, t)) {
+      table_unref(t);
+      goto fret;
+    }
+    pos += mt.smallest_length + mt.largest_length;
+  }
+  ret = 0;
+fret:
+  free(buf);
+  close(fd);
+  return ret;
+}
+
+static int compare_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+// Removes the tables the manifest does not have, left over from a crash
+// or from compactions, and lists the write-ahead logs not flushed yet.
+// Returns the highest file number in use, or -1.
+static long lsm_scan(kvdb_t *db, lsm_table_t **tables[],
+    const size_t nr_tables[], long wal_number, long **wals,
+    size_t *nr_wals) {
+  DIR *dir = opendir(db->path);
+  struct dirent *de;
+  long highest = 0;
+  size_t cap = 0;
+  *wals = NULL;
+  *nr_wals = 0;
+  if (dir == NULL) return -1;
+  while ((de = readdir(dir)) != NULL) {
+    char *end, *path = NULL;
+    long number = strtol(de->d_name, &end, 10);
+    int keep = 0;
+    if (end == de->d_name) continue;
+    if (strcmp(end, ".sst") == 0) {
+      for (int level = 0; level < LSM_LEVELS; level++)
+        for (size_t i = 0; i < nr_tables[level]; i++)
+          keep |= tables[level][i]->number == number;
+      if (!keep) path = lsm_file(db, number, "sst");
+    } else if (strcmp(end, ".wal") == 0) {
+      keep = number >= wal_number;
+      if (!keep) path = lsm_file(db, number, "wal");
+      if (keep && *nr_wals == cap) {
+        long *p = realloc(*wals, (cap = cap ? cap * 2 : 4) * sizeof *p);
+        if (p == NULL) {
+          closedir(dir);
+          return -1;
+        }
+        *wals = p;
+      }
+      if (keep) (*wals)[(*nr_wals)++] = number;
+    } else {
+      continue;
+    }
+    if (path != NULL) unlink(path);
+    free(path);
+    if (number > highest) highest = number;
+  }
+  closedir(dir);
+  if (*nr_wals) qsort(*wals, *nr_wals, sizeof **wals, compare_long);
+  return highest;
+}
+
+// Replays the write-ahead logs into a memtable, which is left for the
+// background thread to flush.  Logs with nothing committed go.
+static int replay_wals(kvdb_t *db, const long *wals, size_t nr_wals,
+    lsm_memtable_t **imm) {
+  *imm = NULL;
+  if (nr_wals == 0) return 0;
+  if ((*imm = mem_new(wals[0])) == NULL) return -1;
+  for (size_t i = 0; i < nr_wals; i++) {
+    char *path = lsm_file(db, wals[i], "wal"), *buf = NULL;
+    struct stat st;
+    int fd = path != NULL ? open(path, O_RDONLY) : -1, ret = -1;
+    free(path);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1)) != NULL &&
+        read_full(fd, buf, st.st_size, 0) == 0 &&
+        mem_apply(*imm, buf, st.st_size, 1) >= 0)
+      ret = 0;
+    free(buf);
+    close(fd);
+    if (ret) return -1;
+  }
+  if ((*imm)->bytes == 0) {
+    mem_unref(*imm);
+    *imm = NULL;
+    remove_wals(db, wals[nr_wals - 1] + 1);
+  }
+  return 0;
+}
+
+static int lsm_open(kvdb_t *db) {
+  struct kvdb_lsm *lsm = calloc(1, sizeof *lsm);
+  lsm_table_t **tables[LSM_LEVELS] = { NULL };
+  size_t nr_tables[LSM_LEVELS] = { 0 }, nr_wals = 0;
+  lsm_memtable_t *mem = NULL, *imm = NULL;
+  long next_number = 1, wal_number = 0, highest, *wals = NULL;
+  char *path = NULL;
+  int ret = -1;
+  if (lsm == NULL) return -1;
+  db->lsm = lsm;
+  lsm->lock_fd = -1;
+  if (pthread_mutex_init(&lsm->lock, NULL)) goto fret1;
+  if (pthread_cond_init(&lsm->cond, NULL)) goto fret2;
+  path = malloc(strlen(db->path) + 8);
+  if (path == NULL) goto fret3;
+  sprintf(path, "%s/LOCK", db->path);
+  lsm->lock_fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (lsm->lock_fd < 0 || flock(lsm->lock_fd, LOCK_EX | LOCK_NB)) goto fret3;
+  if (manifest_read(db, tables, nr_tables, &next_number, &wal_number))
+    goto fret3;
+  highest = lsm_scan(db, tables, nr_tables, wal_number, &wals, &nr_wals);
+  if (highest < 0 || replay_wals(db, wals, nr_wals, &imm)) goto fret3;
+  lsm->next_number = highest + 1 > next_number ? highest + 1 : next_number;
+  if ((mem = mem_new(lsm->next_number)) == NULL) goto fret3;
+  if ((db->fp = create_wal(db, lsm->next_number++)) == NULL) goto fret3;
+  db->fd = fileno(db->fp);
+  if ((lsm->current = version_new(mem, imm, tables, nr_tables)) == NULL)
+    goto fret4;
+  if (pthread_create(&lsm->thread, NULL, lsm_background, db)) goto fret4;
+  ret = 0;
+  goto fret3;
 fret4:
-  free(ret);
+  fclose(db->fp);
+  version_unref(lsm->current);
 fret3:
-  free(tmp);
+  free(path);
+  free(wals);
+  mem_unref(mem);
+  mem_unref(imm);
+  for (int level = 0; level < LSM_LEVELS; level++) {
+    for (size_t i = 0; i < nr_tables[level]; i++)
+      table_unref(tables[level][i]);
+    free(tables[level]);
+  }
+  if (ret == 0) return 0;
+  if (lsm->lock_fd >= 0) close(lsm->lock_fd);
+  pthread_cond_destroy(&lsm->cond);
 fret2:
-  flock(fileno(db->fp), LOCK_UN);
+  pthread_mutex_destroy(&lsm->lock);
 fret1:
-  pthread_mutex_unlock(&db->mutex);
-  return NULL;
+  free(lsm);
+  db->lsm = NULL;
+  return -1;
 }
 
-int kvdb_traverse(kvdb_t *db, void (*callback)(char*, char*)) {
-  // BUG: no error checking
-  long pos;
-  kvdb_entry_t entry;
-  char *buf = NULL;
+// The background thread flushes what is immutable before it stops; the
+// memtable is left to its write-ahead log.
+static int lsm_close(kvdb_t *db) {
+  struct kvdb_lsm *lsm = db->lsm;
+  int ret;
+  pthread_mutex_lock(&lsm->lock);
+  lsm->stop = 1;
+  pthread_cond_broadcast(&lsm->cond);
+  pthread_mutex_unlock(&lsm->lock);
+  pthread_join(lsm->thread, NULL);
+  ret = lsm->error ? -1 : 0;
+  lsm_free_views(lsm);
+  version_unref(lsm->current);
+  close(lsm->lock_fd);
+  pthread_cond_destroy(&lsm->cond);
+  pthread_mutex_destroy(&lsm->lock);
+  free(lsm);
+  db->lsm = NULL;
+  fclose(db->fp);
+  db->fp = NULL;
+  free(db->path);
+  cache_free(db->cache);
+  db->path = NULL;
+  db->cache = NULL;
+  pthread_mutex_destroy(&db->mutex);
+  pthread_mutex_destroy(&db->commit_mutex);
+  pthread_cond_destroy(&db->commit_cond);
+  return ret;
+}
+
+int kvdb_open_lsm(kvdb_t *db, const char *dirname) {
+  if (mkdir(dirname, 0777) && errno != EEXIST) return -1;
+  memset(db, 0, sizeof *db);
+  db->commit_tail = &db->commit_head;
+  db->commit_pos = -1;
+  db->path = strdup(dirname);
+  db->cache = cache_new();
+  if (db->path == NULL || db->cache == NULL) goto fret1;
+  if (pthread_mutex_init(&db->mutex, NULL)) goto fret1;
+  if (pthread_mutex_init(&db->commit_mutex, NULL)) goto fret2;
+  if (pthread_cond_init(&db->commit_cond, NULL)) goto fret3;
+  if (lsm_open(db)) goto fret4;
+  return 0;
+fret4:
+  pthread_cond_destroy(&db->commit_cond);
+fret3:
+  pthread_mutex_destroy(&db->commit_mutex);
+fret2:
+  pthread_mutex_destroy(&db->mutex);
+fret1:
+  free(db->path);
+  cache_free(db->cache);
+  db->path = NULL;
+  db->cache = NULL;
+  return -1;
+}
+
+// Iterators over a log copy up to KVDB_ITER_BATCH entries at a time out
+// of the ordered index, holding db->mutex only while they do.  Over an
+// LSM tree they merge the memtables and tables of the version current
+// when they were made, which they keep.
+#define KVDB_ITER_BATCH     64
+
+struct kvdb_iter {
+  kvdb_t *db;
+  char *prefix;
+  uint32_t prefix_length;   // without the NUL
+  const char *key, *value;  // key is NULL before a seek and past the end
+  uint32_t key_length, value_length;    // NULs included
+  // over a log: entries copied out, each as a key length and a value
+  // length of 32 bits followed by the key and the value
+  char *buf, *last;
+  size_t length, cap, pos, last_length, last_cap;
+  int more;                 // whether the ordered index goes on
+  // over an LSM tree
+  lsm_version_t *version;
+  lsm_iter_t *it;
+};
+
+static int has_prefix(const kvdb_iter_t *it, const char *key,
+    uint32_t key_length) {
+  return key_length > it->prefix_length &&
+      memcmp(key, it->prefix, it->prefix_length) == 0;
+}
+
+static void iter_load(kvdb_iter_t *it) {
+  uint32_t lengths[2];
+  it->key = NULL;
+  if (it->pos >= it->length) return;
+  memcpy(lengths, it->buf + it->pos, sizeof lengths);
+  it->key = it->buf + it->pos + sizeof lengths;
+  it->key_length = lengths[0];
+  it->value = it->key + lengths[0];
+  it->value_length = lengths[1];
+}
+
+// Copies the entries from key on, or after it if after is set, out of
+// the ordered index, as far as they have the prefix.
+static int iter_fill(kvdb_iter_t *it, const char *key, uint32_t key_length,
+    int after) {
+  kvdb_t *db = it->db;
+  kvdb_order_node_t *node;
+  int ret = -1;
+  it->length = it->pos = 0;
+  it->more = 0;
   if (pthread_mutex_lock(&db->mutex)) return -1;
-  if (flock(fileno(db->fp), LOCK_SH)) goto fret1;
-  if (update_size(db)) goto fret2;
-  if (fseek(db->fp, 0, SEEK_SET)) goto fret2;
-  while ((pos = ftell(db->fp)) < db->size) {
-    if (pos < 0) goto fret2;
-    if (fread(&entry, 1, sizeof entry, db->fp) < 1) goto fret2;
-    buf = malloc(entry.key_length + entry.value_length);
-    if (buf == NULL) goto fret2;
-    if (fread(buf, 1, entry.key_length + entry.value_length, db->fp) < 1) 
-      goto fret3;
-    callback(buf, buf + entry.key_length);
-    free(buf);
+  if (log_lock(db, LOCK_SH)) goto fret1;
+  if (update_size(db, LOCK_SH) || (db->order == NULL && order_build(db)))
+    goto fret2;
+  node = order_seek(db, key, key_length, NULL);
+  if (after && node != NULL && compare_keys(order_key(db, node),
+        node->key_length, key, key_length) == 0)
+    node = node->next[0];
+  for (int n = 0; node != NULL; node = node->next[0], n++) {
+    kvdb_entry_t entry;
+    uint32_t lengths[2];
+    const char *value;
+    char *raw = NULL;
+    int failed;
+    if (n == KVDB_ITER_BATCH) {
+      it->more = 1;
+      break;
+    }
+    if (!has_prefix(it, order_key(db, node), node->key_length)) break;
+    memcpy(&entry, db->map + node->pos, sizeof entry);
+    value = order_key(db, node) + entry.key_length;
+    lengths[0] = entry.key_length;
+    lengths[1] = entry.value_length;
+    if (node->compressed && (value = raw = inflate_value(db, value,
+            entry.value_length, &lengths[1])) == NULL)
+      goto fret2;
+    failed = buf_append(&it->buf, &it->length, &it->cap, lengths,
+        sizeof lengths) ||
+      buf_append(&it->buf, &it->length, &it->cap, order_key(db, node),
+        entry.key_length) ||
+      buf_append(&it->buf, &it->length, &it->cap, value, lengths[1]);
+    free(raw);
+    raw = NULL;
+    if (failed) goto fret2;
   }
-  flock(fileno(db->fp), LOCK_UN);
+  ret = 0;
+fret2:
+  log_unlock(db);
+fret1:
+  free_retired(db, KVDB_RETIRED_LOGS);
   pthread_mutex_unlock(&db->mutex);
+  return ret;
+}
+
+// Skips deletions, and ends the iteration once the keys lose the prefix.
+static int lsm_iter_settle(kvdb_iter_t *it, int ret) {
+  lsm_iter_t *i = it->it;
+  while (ret == 0 && i->key != NULL && i->value_length == 0)
+    ret = i->next(i);
+  it->key = NULL;
+  if (ret == 0 && i->key != NULL && has_prefix(it, i->key, i->key_length)) {
+    it->key = i->key;
+    it->key_length = i->key_length;
+    it->value = i->value;
+    it->value_length = i->value_length;
+  }
+  return ret;
+}
+
+kvdb_iter_t *kvdb_iter_new(kvdb_t *db, const char *prefix) {
+  kvdb_iter_t *it = calloc(1, sizeof *it);
+  if (it == NULL) return NULL;
+  it->db = db;
+  it->prefix = strdup(prefix != NULL ? prefix : "");
+  if (it->prefix == NULL) goto fret;
+  it->prefix_length = strlen(it->prefix);
+  if (db->lsm != NULL) {
+    it->version = version_get(db->lsm);
+    if ((it->it = version_iter(it->version)) == NULL) goto fret;
+  }
+  return it;
+fret:
+  kvdb_iter_free(it);
+  return NULL;
+}
+
+int kvdb_iter_seek(kvdb_iter_t *it, const char *key) {
+  const char *from = it->prefix;
+  uint32_t from_length = it->prefix_length;
+  // the first key with the prefix may come after key
+  if (key != NULL && compare_keys(key, strlen(key) + 1, from, from_length)
+      > 0) {
+    from = key;
+    from_length = strlen(key) + 1;
+  }
+  if (it->db->lsm != NULL)
+    return lsm_iter_settle(it, it->it->seek(it->it, from, from_length));
+  if (iter_fill(it, from, from_length, 0)) {
+    it->key = NULL;
+    return -1;
+  }
+  iter_load(it);
+  return 0;
+}
+
+int kvdb_iter_next(kvdb_iter_t *it) {
+  if (it->key == NULL) return 0;
+  if (it->db->lsm != NULL) return lsm_iter_settle(it, it->it->next(it->it));
+  it->pos += 2 * sizeof(uint32_t) + it->key_length + it->value_length;
+  if (it->pos >= it->length && it->more) {
+    // the key goes with the buffer
+    it->last_length = 0;
+    if (buf_append(&it->last, &it->last_length, &it->last_cap, it->key,
+          it->key_length) ||
+        iter_fill(it, it->last, it->last_length, 1)) {
+      it->key = NULL;
+      return -1;
+    }
+  }
+  iter_load(it);
   return 0;
+}
+
+const char *kvdb_iter_key(const kvdb_iter_t *it, size_t *length) {
+  if (it->key != NULL && length != NULL) *length = it->key_length - 1;
+  return it->key;
+}
+
+const char *kvdb_iter_value(const kvdb_iter_t *it, size_t *length) {
+  if (it->key == NULL) return NULL;
+  if (length != NULL) *length = it->value_length - 1;
+  return it->value;
+}
+
+void kvdb_iter_free(kvdb_iter_t *it) {
+  if (it == NULL) return;
+  if (it->it != NULL) it->it->free(it->it);
+  version_unref(it->version);
+  free(it->prefix);
+  free(it->buf);
+  free(it->last);
+  free(it);
+}
+
+// Asynchronous calls go to KVDB_ASYNC_THREADS threads by the hash of
+// their key, so that the requests on a key are served in the order they
+// came.  A thread takes the puts at the head of its queue as one batch,
+// and group commit puts the batches of the threads under one fsync.
+// Served requests wait until kvdb_async_poll runs their callbacks; an
+// eventfd counts them meanwhile, to wake up event loops.
+#define KVDB_ASYNC_THREADS  4
+#define KVDB_ASYNC_BATCH    256
+
+typedef struct kvdb_request {
+  struct kvdb_request *next;
+  int put;
+  int status;
+  char *key;                // the value of a put follows it
+  void *value;              // NULL deletes, or of a get, from malloc
+  size_t key_length, value_length;
+  kvdb_callback_t callback;
+  void *arg;
+} kvdb_request_t;
+
+struct kvdb_async_queue {
+  struct kvdb_async *async;
+  pthread_t thread;
+  pthread_cond_t cond;
+  kvdb_request_t *head, **tail;
+};
+
+struct kvdb_async {
+  kvdb_t *db;
+  pthread_mutex_t mutex;    // of the queues and the done list
+  int stopping;
+  int fd;                   // eventfd
+  kvdb_request_t *done, **done_tail;
+  struct kvdb_async_queue queues[KVDB_ASYNC_THREADS];
+};
+
+// Serves a batch of puts, or a get.
+static void async_serve(kvdb_t *db, kvdb_request_t *first, size_t n) {
+  kvdb_bop_t ops[KVDB_ASYNC_BATCH];
+  kvdb_request_t *r = first;
+  int status;
+  if (!first->put) {
+    first->value = kvdb_get2(db, first->key, first->key_length,
+        &first->value_length);
+    first->status = 0;
+    return;
+  }
+  for (size_t i = 0; i < n; i++, r = r->next) {
+    ops[i].key = r->key;
+    ops[i].key_length = r->key_length;
+    ops[i].value = r->value;
+    ops[i].value_length = r->value_length;
+  }
+  status = write_ops(db, ops, n);
+  for (r = first; r != NULL; r = r->next) r->status = status;
+}
+
+// Runs until told to stop with nothing left in its queue.
+static void *async_thread(void *arg) {
+  struct kvdb_async_queue *q = arg;
+  struct kvdb_async *a = q->async;
+  pthread_mutex_lock(&a->mutex);
+  for (;;) {
+    kvdb_request_t *first = q->head, *last = first;
+    size_t n = 1;
+    if (first == NULL) {
+      if (a->stopping) break;
+      pthread_cond_wait(&q->cond, &a->mutex);
+      continue;
+    }
+    while (first->put && n < KVDB_ASYNC_BATCH && last->next != NULL &&
+        last->next->put) {
+      last = last->next;
+      n++;
+    }
+    if ((q->head = last->next) == NULL) q->tail = &q->head;
+    last->next = NULL;
+    pthread_mutex_unlock(&a->mutex);
+    async_serve(a->db, first, n);
+    pthread_mutex_lock(&a->mutex);
+    *a->done_tail = first;
+    a->done_tail = &last->next;
+    eventfd_write(a->fd, 1);
+  }
+  pthread_mutex_unlock(&a->mutex);
+  return NULL;
+}
+
+// Runs the callbacks of the requests served so far, in the calling
+// thread, and returns their number.
+static int async_run(struct kvdb_async *a) {
+  kvdb_request_t *r, *next;
+  eventfd_t count;
+  int n = 0;
+  // before taking the list: requests served after this count again
+  eventfd_read(a->fd, &count);
+  pthread_mutex_lock(&a->mutex);
+  r = a->done;
+  a->done = NULL;
+  a->done_tail = &a->done;
+  pthread_mutex_unlock(&a->mutex);
+  for (; r != NULL; r = next, n++) {
+    void *value = r->put ? NULL : r->value;
+    next = r->next;
+    if (r->callback != NULL)
+      r->callback(r->arg, r->status, value, r->value_length);
+    else
+      free(value);
+    free(r);
+  }
+  return n;
+}
+
+// Lets the first n threads finish their queues and go.
+static void async_stop(struct kvdb_async *a, int n) {
+  pthread_mutex_lock(&a->mutex);
+  a->stopping = 1;
+  for (int i = 0; i < n; i++) pthread_cond_signal(&a->queues[i].cond);
+  pthread_mutex_unlock(&a->mutex);
+  for (int i = 0; i < n; i++) {
+    pthread_join(a->queues[i].thread, NULL);
+    pthread_cond_destroy(&a->queues[i].cond);
+  }
+}
+
+// The threads start with the first asynchronous call on db.
+static struct kvdb_async *async_get(kvdb_t *db) {
+  struct kvdb_async *a = __atomic_load_n(&db->async, __ATOMIC_ACQUIRE);
+  struct kvdb_async *expected = NULL;
+  int i;
+  if (a != NULL) return a;
+  if ((a = calloc(1, sizeof *a)) == NULL) return NULL;
+  a->db = db;
+  a->done_tail = &a->done;
+  a->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (a->fd < 0) goto fret1;
+  if (pthread_mutex_init(&a->mutex, NULL)) goto fret2;
+  for (i = 0; i < KVDB_ASYNC_THREADS; i++) {
+    struct kvdb_async_queue *q = &a->queues[i];
+    q->async = a;
+    q->tail = &q->head;
+    if (pthread_cond_init(&q->cond, NULL)) goto fret3;
+    if (pthread_create(&q->thread, NULL, async_thread, q)) {
+      pthread_cond_destroy(&q->cond);
+      goto fret3;
+    }
+  }
+  if (__atomic_compare_exchange_n(&db->async, &expected, a, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return a;
+  // another thread has started them first
 fret3:
-  free(buf);
+  async_stop(a, i);
+  pthread_mutex_destroy(&a->mutex);
 fret2:
-  flock(fileno(db->fp), LOCK_UN);
+  close(a->fd);
 fret1:
-  pthread_mutex_unlock(&db->mutex);
-  return -1;
+  free(a);
+  return expected;
+}
+
+// Serves what is queued and runs the callbacks not run yet.
+static void async_free(kvdb_t *db) {
+  struct kvdb_async *a = db->async;
+  if (a == NULL) return;
+  async_stop(a, KVDB_ASYNC_THREADS);
+  async_run(a);
+  pthread_mutex_destroy(&a->mutex);
+  close(a->fd);
+  free(a);
+  db->async = NULL;
+}
+
+static int async_submit(kvdb_t *db, kvdb_request_t *r) {
+  struct kvdb_async *a = async_get(db);
+  struct kvdb_async_queue *q;
+  if (a == NULL) {
+    free(r);
+    return -1;
+  }
+  q = &a->queues[hash_key(r->key, r->key_length) % KVDB_ASYNC_THREADS];
+  r->next = NULL;
+  pthread_mutex_lock(&a->mutex);
+  *q->tail = r;
+  q->tail = &r->next;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&a->mutex);
+  return 0;
+}
+
+int kvdb_get_async(kvdb_t *db, const void *key, size_t key_length,
+    kvdb_callback_t callback, void *arg) {
+  kvdb_request_t *r;
+  if (!lengths_valid(key_length, 0)) return -1;
+  if ((r = malloc(sizeof *r + key_length)) == NULL) return -1;
+  r->put = 0;
+  r->key = (char *)(r + 1);
+  memcpy(r->key, key, key_length);
+  r->key_length = key_length;
+  r->value = NULL;
+  r->value_length = 0;
+  r->callback = callback;
+  r->arg = arg;
+  return async_submit(db, r);
+}
+
+int kvdb_put_async(kvdb_t *db, const void *key, size_t key_length,
+    const void *value, size_t value_length, kvdb_callback_t callback,
+    void *arg) {
+  kvdb_request_t *r;
+  if (value == NULL) value_length = 0;
+  if (!lengths_valid(key_length, value_length)) return -1;
+  if ((r = malloc(sizeof *r + key_length + value_length)) == NULL)
+    return -1;
+  r->put = 1;
+  r->key = (char *)(r + 1);
+  memcpy(r->key, key, key_length);
+  r->key_length = key_length;
+  r->value = NULL;
+  if (value != NULL) {
+    r->value = r->key + key_length;
+    memcpy(r->value, value, value_length);
+  }
+  r->value_length = value_length;
+  r->callback = callback;
+  r->arg = arg;
+  return async_submit(db, r);
+}
+
+int kvdb_async_fd(kvdb_t *db) {
+  struct kvdb_async *a = async_get(db);
+  return a != NULL ? a->fd : -1;
+}
+
+int kvdb_async_poll(kvdb_t *db) {
+  struct kvdb_async *a = __atomic_load_n(&db->async, __ATOMIC_ACQUIRE);
+  return a != NULL ? async_run(a) : 0;
 }
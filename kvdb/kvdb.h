@@ -1,25 +1,140 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sys/types.h>
+
+struct kvdb_slot;
+struct kvdb_write;
+struct kvdb_map;
+struct kvdb_readers;
+struct kvdb_lsm;
+struct kvdb_order;
+struct kvdb_dict;
+struct kvdb_cache;
+struct kvdb_async;
 
 struct kvdb {
   int fd;
   FILE *fp;
   pthread_mutex_t mutex;
   long size;
+  long last_pos;          // of the last record before size
+  int checksums;          // the log starts with the format marker
+  int compression;        // whether writes compress values
+  int exclusive;          // the process holds the flock for good
+  struct kvdb_dict *dict; // shared by compressed values, or NULL
+  // compaction may replace the file at path with a new one
+  char *path;
+  uint64_t dev, ino;
+  unsigned long generation; // of the file, for the cache
+  // read-only shared mapping of the log, larger than the file so that it
+  // rarely has to be replaced
+  char *map;
+  size_t map_length;
+  // readers take no lock; they start over if seq changes under them, and
+  // what writers replace is freed once no reader can be using it: index
+  // arrays on the next catch-up or mutation, mappings of the log on the
+  // next mutation
+  unsigned seq;
+  int reader_phase;
+  struct kvdb_readers *readers;
+  struct kvdb_map *retired;
+  // in-memory index of the log up to size: latest entry of every key
+  struct kvdb_slot *slots;
+  size_t nr_slots, nr_used;
+  long live_bytes;        // bytes of the entries the index points to
+  // the live keys in order, for iterators; NULL until the first one
+  struct kvdb_order *order;
+  // the slots may live in a private mapping of the checkpoint file
+  void *index_map;
+  size_t index_map_length;
+  // checkpoint of the index and the log offset it was taken at
+  char *index_path;
+  long index_size;
+  // writes waiting for the next group commit
+  pthread_mutex_t commit_mutex;
+  pthread_cond_t commit_cond;
+  struct kvdb_write *commit_head, **commit_tail;
+  int committing;
+  long commit_delay;
+  long commit_pos;        // offset of the commit in progress, or -1
+  // decompressed values and blocks of tables read lately
+  struct kvdb_cache *cache;
+  // queues and threads of the asynchronous calls, from the first one on
+  struct kvdb_async *async;
+  // NULL unless opened as an LSM tree, where fd and fp are the
+  // write-ahead log and size its length
+  struct kvdb_lsm *lsm;
 };
 
 typedef struct kvdb kvdb_t;
+typedef struct kvdb_iter kvdb_iter_t;
+typedef struct kvdb_value kvdb_value_t;
+
+struct kvdb_stats {
+  uint64_t cache_hits, cache_misses;
+  size_t cache_bytes, cache_entries;
+};
+
+// Called by kvdb_async_poll for a finished asynchronous call: status is
+// 0 or -1; value is what a get found, from malloc, or NULL.
+typedef void (*kvdb_callback_t)(void *arg, int status, void *value,
+    size_t length);
+
+struct kvdb_op {
+  const char *key;
+  const char *value;      // NULL deletes the key
+};
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 int kvdb_open(kvdb_t *db, const char *filename);
+int kvdb_open_lsm(kvdb_t *db, const char *dirname);
 int kvdb_close(kvdb_t *db);
 int kvdb_put(kvdb_t *db, const char *key, const char *value);
+int kvdb_delete(kvdb_t *db, const char *key);
+int kvdb_put2(kvdb_t *db, const void *key, size_t key_length,
+    const void *value, size_t value_length);
+void *kvdb_get2(kvdb_t *db, const void *key, size_t key_length,
+    size_t *value_length);
+int kvdb_write_batch(kvdb_t *db, const struct kvdb_op *ops, size_t n);
 char *kvdb_get(kvdb_t *db, const char *key);
+const char *kvdb_get_view(kvdb_t *db, const char *key, size_t *length);
 int kvdb_traverse(kvdb_t *db, void (*callback)(char*, char*));
+int kvdb_checkpoint(kvdb_t *db);
+int kvdb_compact(kvdb_t *db);
+int kvdb_lock_exclusive(kvdb_t *db);
+void kvdb_set_commit_delay(kvdb_t *db, long usec);
+void kvdb_set_compression(kvdb_t *db, int enable);
+void kvdb_set_cache_size(kvdb_t *db, size_t bytes);
+void kvdb_get_stats(kvdb_t *db, struct kvdb_stats *stats);
+
+int kvdb_get_async(kvdb_t *db, const void *key, size_t key_length,
+    kvdb_callback_t callback, void *arg);
+int kvdb_put_async(kvdb_t *db, const void *key, size_t key_length,
+    const void *value, size_t value_length, kvdb_callback_t callback,
+    void *arg);
+int kvdb_async_fd(kvdb_t *db);
+int kvdb_async_poll(kvdb_t *db);
+
+kvdb_iter_t *kvdb_iter_new(kvdb_t *db, const char *prefix);
+int kvdb_iter_seek(kvdb_iter_t *it, const char *key);
+int kvdb_iter_next(kvdb_iter_t *it);
+const char *kvdb_iter_key(const kvdb_iter_t *it, size_t *length);
+const char *kvdb_iter_value(const kvdb_iter_t *it, size_t *length);
+void kvdb_iter_free(kvdb_iter_t *it);
+
+kvdb_value_t *kvdb_value_open(kvdb_t *db, const void *key,
+    size_t key_length, size_t *length);
+ssize_t kvdb_value_read(kvdb_value_t *v, void *buf, size_t length,
+    size_t offset);
+kvdb_value_t *kvdb_value_create(kvdb_t *db, const void *key,
+    size_t key_length);
+int kvdb_value_write(kvdb_value_t *v, const void *buf, size_t length);
+int kvdb_value_commit(kvdb_value_t *v);
+void kvdb_value_close(kvdb_value_t *v);
 
 #ifdef __cplusplus
 }
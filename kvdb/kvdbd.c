@@ -0,0 +1,806 @@
+// kvdbd: serves a kvdb database over TCP in the protocol of Redis (RESP),
+// so that redis-cli and redis-benchmark work against it.
+//
+//   kvdbd [-p port] [-b address] path
+//
+// One thread owns the database, which it keeps locked for good with
+// kvdb_lock_exclusive, and runs an epoll loop over nonblocking sockets.
+// Clients may pipeline: every command that has arrived runs at once, and
+// the replies go out together.  The writes of all clients in a round of
+// the loop are committed as one kvdb_write_batch, with one fsync, before
+// any of their replies goes out, or before a read that has to see them.
+// A key or value with a NUL does not fit that batch of strings: its
+// command commits what is queued and writes on its own, so an MSET or a
+// DEL with one is not atomic.
+//
+// Commands:
+//   PING [message], ECHO message, QUIT
+//   GET key, MGET key..., EXISTS key...
+//   SET key value, MSET key value..., DEL key...
+//   SCAN cursor [MATCH prefix*] [COUNT count]
+//       the cursor is 0 to start, then what the last call returned, until
+//       that is 0 again; every call returns the cursor and up to count
+//       (10 by default) keys in order, each followed by its value
+//   INFO, and COMMAND, CONFIG, SELECT 0 for the tools, which only get
+//   empty answers
+#define _GNU_SOURCE
+#include "kvdb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_EVENTS      256
+#define READ_BYTES      (64 << 10)
+#define MAX_ARGS        (1 << 20)
+#define MAX_BULK        (512L << 20)
+#define MAX_LINE        (64 << 10)  // of an inline command or a header
+#define OUT_LIMIT       (1 << 20)   // replies waiting that stop a client
+#define BATCH_BYTES     (8 << 20)   // writes that are committed at once
+#define SCAN_COUNT      10
+
+typedef struct buf {
+  char *data;
+  size_t length, cap;
+} buf_t;
+
+typedef struct client {
+  int fd;
+  buf_t in, out;
+  size_t parsed;          // bytes of in run already
+  size_t sent;            // bytes of out sent already
+  int events;             // what epoll watches for
+  int closing;            // close once out is sent
+  int stalled;            // stopped running commands for out to drain
+  int dirty;              // on the list of clients to send to
+  struct client *next_dirty;
+} client_t;
+
+typedef struct arg {
+  const char *p;
+  size_t length;
+} arg_t;
+
+// A reply to writes not committed yet, at offset reply of the output of
+// client c, taking length bytes.
+typedef struct pending {
+  client_t *c;
+  size_t reply, length;
+} pending_t;
+
+static kvdb_t db;
+static int epfd, stop_flag;
+static client_t **clients;
+static size_t nr_clients, nr_connected;
+static client_t *dirty;
+static arg_t *args;
+static size_t args_cap;
+static uint64_t nr_commands, nr_commits;
+
+// The writes of the round: keys and values with their NULs in data, at
+// the offsets in ops, where a value of -1 deletes the key.
+static struct {
+  buf_t data;
+  long (*ops)[2];
+  size_t nr_ops, ops_cap;
+  pending_t *replies;
+  size_t nr_replies, replies_cap;
+} batch;
+
+static void die(const char *what) {
+  perror(what);
+  exit(EXIT_FAILURE);
+}
+
+static int buf_reserve(buf_t *b, size_t len) {
+  if (b->length + len > b->cap) {
+    size_t n = b->cap ? b->cap : 256;
+    char *p;
+    while (n < b->length + len) n *= 2;
+    p = realloc(b->data, n);
+    if (p == NULL) return -1;
+    b->data = p;
+    b->cap = n;
+  }
+  return 0;
+}
+
+static int buf_append(buf_t *b, const void *data, size_t len) {
+  if (buf_reserve(b, len)) return -1;
+  memcpy(b->data + b->length, data, len);
+  b->length += len;
+  return 0;
+}
+
+static int grow(void **array, size_t *cap, size_t n, size_t size) {
+  if (n >= *cap) {
+    size_t c = *cap ? *cap * 2 : 64;
+    void *p;
+    while (c <= n) c *= 2;
+    p = realloc(*array, c * size);
+    if (p == NULL) return -1;
+    *array = p;
+    *cap = c;
+  }
+  return 0;
+}
+
+// Replies.  A client that cannot have its reply is closed.
+static void reply(client_t *c, const void *data, size_t len) {
+  if (buf_append(&c->out, data, len)) c->closing = 1;
+}
+
+static void reply_str(client_t *c, const char *s) {
+  reply(c, s, strlen(s));
+}
+
+static void reply_header(client_t *c, char type, long n) {
+  char line[32];
+  reply(c, line, sprintf(line, "%c%ld\r\n", type, n));
+}
+
+static void reply_bulk(client_t *c, const void *data, size_t len) {
+  reply_header(c, '$', len);
+  reply(c, data, len);
+  reply(c, "\r\n", 2);
+}
+
+static void reply_error(client_t *c, const char *msg) {
+  reply_str(c, "-ERR ");
+  reply_str(c, msg);
+  reply(c, "\r\n", 2);
+}
+
+// Commits the writes of the round.  Should that fail, their replies say
+// so instead, last first so that the offsets of the others still hold.
+static void commit(void) {
+  struct kvdb_op *ops;
+  static const char failed[] = "-ERR write failed\r\n";
+  int ret = -1;
+  if (batch.nr_ops == 0) return;
+  ops = malloc(batch.nr_ops * sizeof *ops);
+  if (ops != NULL) {
+    for (size_t i = 0; i < batch.nr_ops; i++) {
+      ops[i].key = batch.data.data + batch.ops[i][0];
+      ops[i].value = batch.ops[i][1] < 0 ? NULL :
+          batch.data.data + batch.ops[i][1];
+    }
+    ret = kvdb_write_batch(&db, ops, batch.nr_ops);
+    free(ops);
+  }
+  nr_commits++;
+  for (size_t i = batch.nr_replies; ret && i-- > 0; ) {
+    pending_t *r = &batch.replies[i];
+    buf_t *out = &r->c->out;
+    size_t n = sizeof failed - 1;
+    if (buf_reserve(out, n)) {
+      r->c->closing = 1;
+      continue;
+    }
+    memmove(out->data + r->reply + n, out->data + r->reply + r->length,
+        out->length - r->reply - r->length);
+    memcpy(out->data + r->reply, failed, n);
+    out->length += n - r->length;
+  }
+  batch.data.length = 0;
+  batch.nr_ops = batch.nr_replies = 0;
+}
+
+static int has_nul(const arg_t *a) {
+  return memchr(a->p, '\0', a->length) != NULL;
+}
+
+// Queues a put, or a deletion if value is NULL.  Returns -1 if it has
+// to be written on its own: kvdb_write_batch takes strings only.
+static int queue_write(const arg_t *key, const arg_t *value) {
+  long offsets[2] = { batch.data.length, -1 };
+  if (grow((void **)&batch.ops, &batch.ops_cap, batch.nr_ops,
+        sizeof *batch.ops) ||
+      buf_append(&batch.data, key->p, key->length) ||
+      buf_append(&batch.data, "", 1))
+    return -1;
+  if (value != NULL) {
+    offsets[1] = batch.data.length;
+    if (buf_append(&batch.data, value->p, value->length) ||
+        buf_append(&batch.data, "", 1))
+      return -1;
+  }
+  memcpy(batch.ops[batch.nr_ops++], offsets, sizeof offsets);
+  return 0;
+}
+
+// Sends reply once the writes queued so far are committed.
+static void reply_later(client_t *c, const char *s) {
+  pending_t *r;
+  if (grow((void **)&batch.replies, &batch.replies_cap, batch.nr_replies,
+        sizeof *batch.replies)) {
+    // no way to tell the client should the commit fail
+    commit();
+    reply_str(c, s);
+    return;
+  }
+  r = &batch.replies[batch.nr_replies++];
+  r->c = c;
+  r->reply = c->out.length;
+  r->length = strlen(s);
+  reply_str(c, s);
+  if (batch.data.length >= BATCH_BYTES) commit();
+}
+
+// Whether the write of key and value, which may be NULL, has to be made
+// on its own rather than queued.
+static int direct(const arg_t *key, const arg_t *value) {
+  return has_nul(key) || (value != NULL && has_nul(value));
+}
+
+// Writes at once, after what is queued.
+static int put_direct(const arg_t *key, const arg_t *value) {
+  commit();
+  return kvdb_put2(&db, key->p, key->length,
+      value != NULL ? value->p : NULL, value != NULL ? value->length : 0);
+}
+
+static int exists(const arg_t *key) {
+  size_t length;
+  void *value = kvdb_get2(&db, key->p, key->length, &length);
+  free(value);
+  return value != NULL;
+}
+
+// The decimal number from p to end.
+static int parse_long(const char *p, const char *end, long *value) {
+  char *q;
+  if (p == end) return -1;
+  *value = strtol(p, &q, 10);
+  return q == end ? 0 : -1;
+}
+
+static int arg_equals(const arg_t *a, const char *s) {
+  return a->length == strlen(s) && strncasecmp(a->p, s, a->length) == 0;
+}
+
+static void cmd_ping(client_t *c, int argc, arg_t *argv) {
+  if (argc == 1) reply_str(c, "+PONG\r\n");
+  else reply_bulk(c, argv[1].p, argv[1].length);
+}
+
+static void cmd_echo(client_t *c, int argc, arg_t *argv) {
+  reply_bulk(c, argv[1].p, argv[1].length);
+}
+
+static void cmd_quit(client_t *c, int argc, arg_t *argv) {
+  reply_str(c, "+OK\r\n");
+  c->closing = 1;
+}
+
+static void reply_value(client_t *c, const arg_t *key) {
+  size_t length;
+  void *value = kvdb_get2(&db, key->p, key->length, &length);
+  if (value == NULL) {
+    reply_str(c, "$-1\r\n");
+    return;
+  }
+  reply_bulk(c, value, length);
+  free(value);
+}
+
+static void cmd_get(client_t *c, int argc, arg_t *argv) {
+  commit();
+  reply_value(c, &argv[1]);
+}
+
+static void cmd_mget(client_t *c, int argc, arg_t *argv) {
+  commit();
+  reply_header(c, '*', argc - 1);
+  for (int i = 1; i < argc; i++) reply_value(c, &argv[i]);
+}
+
+static void cmd_exists(client_t *c, int argc, arg_t *argv) {
+  long n = 0;
+  commit();
+  for (int i = 1; i < argc; i++) n += exists(&argv[i]);
+  reply_header(c, ':', n);
+}
+
+static void cmd_set(client_t *c, int argc, arg_t *argv) {
+  if (argc > 3) {
+    reply_error(c, "syntax error");
+    return;
+  }
+  if (direct(&argv[1], &argv[2])) {
+    // the reply stands whatever becomes of the batch
+    if (put_direct(&argv[1], &argv[2])) reply_error(c, "write failed");
+    else reply_str(c, "+OK\r\n");
+  } else if (queue_write(&argv[1], &argv[2])) {
+    reply_error(c, "write failed");
+  } else {
+    reply_later(c, "+OK\r\n");
+  }
+}
+
+static void cmd_mset(client_t *c, int argc, arg_t *argv) {
+  int failed = 0, one_by_one = 0;
+  if (argc % 2 == 0) {
+    reply_error(c, "wrong number of arguments for 'mset' command");
+    return;
+  }
+  // in one batch, unless a key or value is not a string
+  for (int i = 1; i < argc; i += 2)
+    one_by_one |= direct(&argv[i], &argv[i + 1]);
+  for (int i = 1; i < argc; i += 2)
+    failed |= one_by_one ? put_direct(&argv[i], &argv[i + 1]) :
+        queue_write(&argv[i], &argv[i + 1]);
+  if (failed) reply_error(c, "write failed");
+  else if (one_by_one) reply_str(c, "+OK\r\n");
+  else reply_later(c, "+OK\r\n");
+}
+
+static void cmd_del(client_t *c, int argc, arg_t *argv) {
+  char line[32];
+  long n = 0;
+  int failed = 0, one_by_one = 0;
+  commit();
+  for (int i = 1; i < argc; i++) one_by_one |= direct(&argv[i], NULL);
+  for (int i = 1; i < argc; i++) {
+    int seen = 0;
+    for (int j = 1; j < i && !seen; j++)
+      seen = argv[j].length == argv[i].length &&
+          memcmp(argv[j].p, argv[i].p, argv[i].length) == 0;
+    if (seen || !exists(&argv[i])) continue;
+    failed |= one_by_one ? put_direct(&argv[i], NULL) :
+        queue_write(&argv[i], NULL);
+    n++;
+  }
+  sprintf(line, ":%ld\r\n", n);
+  if (failed) reply_error(c, "write failed");
+  else if (one_by_one) reply_str(c, line);
+  else reply_later(c, line);
+}
+
+static int hex_digit(char ch) {
+  if (ch >= '0' && ch <= '9') return ch - '0';
+  if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+  return -1;
+}
+
+// The cursor is the next key in hex, which no key can be confused with.
+static void cmd_scan(client_t *c, int argc, arg_t *argv) {
+  char *prefix = NULL, *start = NULL;
+  long count = SCAN_COUNT, n = 0;
+  buf_t entries = { NULL };
+  kvdb_iter_t *it = NULL;
+  const char *key;
+  size_t length;
+  for (int i = 2; i < argc; i += 2) {
+    if (i + 1 == argc) goto syntax;
+    if (arg_equals(&argv[i], "count")) {
+      if (parse_long(argv[i + 1].p, argv[i + 1].p + argv[i + 1].length,
+            &count) || count <= 0)
+        goto syntax;
+    } else if (arg_equals(&argv[i], "match")) {
+      const arg_t *m = &argv[i + 1];
+      // prefix* only, which the iterators take
+      if (m->length == 0 || m->p[m->length - 1] != '*' ||
+          strcspn(m->p, "*?[\\") != m->length - 1 || has_nul(m))
+        goto syntax;
+      free(prefix);
+      prefix = strndup(m->p, m->length - 1);
+      if (prefix == NULL) goto fail;
+    } else {
+      goto syntax;
+    }
+  }
+  if (!arg_equals(&argv[1], "0")) {
+    if (argv[1].length % 2) goto syntax;
+    if ((start = malloc(argv[1].length / 2 + 1)) == NULL) goto fail;
+    for (size_t i = 0; i < argv[1].length; i += 2) {
+      int hi = hex_digit(argv[1].p[i]), lo = hex_digit(argv[1].p[i + 1]);
+      if (hi < 0 || lo < 0) goto syntax;
+      start[i / 2] = hi << 4 | lo;
+    }
+    start[argv[1].length / 2] = '\0';
+  }
+  commit();
+  if ((it = kvdb_iter_new(&db, prefix)) == NULL ||
+      kvdb_iter_seek(it, start))
+    goto fail;
+  for (; (key = kvdb_iter_key(it, &length)) != NULL && n < count; n++) {
+    char line[32];
+    const char *value;
+    size_t value_length;
+    value = kvdb_iter_value(it, &value_length);
+    if (buf_append(&entries, line, sprintf(line, "$%zu\r\n", length)) ||
+        buf_append(&entries, key, length) ||
+        buf_append(&entries, "\r\n", 2) ||
+        buf_append(&entries, line,
+          sprintf(line, "$%zu\r\n", value_length)) ||
+        buf_append(&entries, value, value_length) ||
+        buf_append(&entries, "\r\n", 2) ||
+        kvdb_iter_next(it))
+      goto fail;
+  }
+  reply_str(c, "*2\r\n");
+  if (key == NULL) {
+    reply_bulk(c, "0", 1);
+  } else {
+    reply_header(c, '$', length * 2);
+    for (size_t i = 0; i < length; i++) {
+      char hex[3];
+      sprintf(hex, "%02x", (unsigned char)key[i]);
+      reply(c, hex, 2);
+    }
+    reply(c, "\r\n", 2);
+  }
+  reply_header(c, '*', n * 2);
+  reply(c, entries.data, entries.length);
+  goto out;
+syntax:
+  reply_error(c, "syntax error");
+  goto out;
+fail:
+  reply_error(c, strerror(errno));
+out:
+  kvdb_iter_free(it);
+  free(entries.data);
+  free(start);
+  free(prefix);
+}
+
+static void cmd_info(client_t *c, int argc, arg_t *argv) {
+  struct kvdb_stats st;
+  char info[512];
+  kvdb_get_stats(&db, &st);
+  snprintf(info, sizeof info,
+      "# Server\r\nserver:kvdbd\r\n"
+      "# Clients\r\nconnected_clients:%zu\r\n"
+      "# Stats\r\ntotal_commands_processed:%llu\r\ntotal_commits:%llu\r\n"
+      "cache_hits:%llu\r\ncache_misses:%llu\r\n"
+      "cache_bytes:%zu\r\ncache_entries:%zu\r\n",
+      nr_connected, (unsigned long long)nr_commands,
+      (unsigned long long)nr_commits, (unsigned long long)st.cache_hits,
+      (unsigned long long)st.cache_misses, st.cache_bytes,
+      st.cache_entries);
+  reply_bulk(c, info, strlen(info));
+}
+
+static void cmd_empty(client_t *c, int argc, arg_t *argv) {
+  reply_str(c, "*0\r\n");
+}
+
+static void cmd_select(client_t *c, int argc, arg_t *argv) {
+  if (arg_equals(&argv[1], "0")) reply_str(c, "+OK\r\n");
+  else reply_error(c, "DB index is out of range");
+}
+
+static const struct command {
+  const char *name;
+  int min_args, max_args;   // the name included; -1 for any number
+  void (*run)(client_t *c, int argc, arg_t *argv);
+} commands[] = {
+  { "ping",     1,  2, cmd_ping },
+  { "echo",     2,  2, cmd_echo },
+  { "quit",     1,  1, cmd_quit },
+  { "get",      2,  2, cmd_get },
+  { "mget",     2, -1, cmd_mget },
+  { "exists",   2, -1, cmd_exists },
+  { "set",      3, -1, cmd_set },
+  { "mset",     3, -1, cmd_mset },
+  { "del",      2, -1, cmd_del },
+  { "scan",     2, -1, cmd_scan },
+  { "info",     1, -1, cmd_info },
+  { "command",  1, -1, cmd_empty },
+  { "config",   1, -1, cmd_empty },
+  { "select",   2,  2, cmd_select },
+};
+
+static void run_command(client_t *c, int argc, arg_t *argv) {
+  nr_commands++;
+  for (size_t i = 0; i < sizeof commands / sizeof *commands; i++) {
+    const struct command *cmd = &commands[i];
+    if (!arg_equals(&argv[0], cmd->name)) continue;
+    if (argc < cmd->min_args || (cmd->max_args >= 0 && argc > cmd->max_args)) {
+      char msg[64];
+      snprintf(msg, sizeof msg, "wrong number of arguments for '%s' command",
+          cmd->name);
+      reply_error(c, msg);
+    } else {
+      cmd->run(c, argc, argv);
+    }
+    return;
+  }
+  reply_error(c, "unknown command");
+}
+
+// The end of the line at p, at its CR or, for inline commands, its LF
+// alone, or NULL if it has not all arrived.
+static const char *line_end(const char *p, const char *end) {
+  const char *q = memchr(p, '\n', end - p);
+  return q != NULL && q > p && q[-1] == '\r' ? q - 1 : q;
+}
+
+// Parses the command at the start of the unparsed input into args, as a
+// multibulk array or an inline command of words, and sets *next past it.
+// Returns 1 if it did, 0 if the command has not all arrived and -1 if it
+// is malformed, which includes lines longer than MAX_LINE.
+static int parse(client_t *c, long *argc, const char **next) {
+  const char *p = c->in.data + c->parsed, *end = c->in.data + c->in.length;
+  const char *eol = line_end(p, end);
+  long n;
+  *argc = 0;
+  if (eol == NULL) return end - p > MAX_LINE ? -1 : 0;
+  if (eol - p > MAX_LINE) return -1;
+  if (*p != '*') {
+    // inline: the words of the line, if any
+    for (const char *q = p; ; q++) {
+      const char *word = q;
+      while (q < eol && *q != ' ' && *q != '\t') q++;
+      if (q > word) {
+        if (grow((void **)&args, &args_cap, *argc, sizeof *args)) return -1;
+        args[*argc].p = word;
+        args[(*argc)++].length = q - word;
+      }
+      if (q == eol) break;
+    }
+    *next = eol + (*eol == '\r' ? 2 : 1);
+    return 1;
+  }
+  if (*eol != '\r' || parse_long(p + 1, eol, &n) || n <= 0 || n > MAX_ARGS ||
+      grow((void **)&args, &args_cap, n, sizeof *args))
+    return -1;
+  for (p = eol + 2; *argc < n; (*argc)++) {
+    long len;
+    if ((eol = line_end(p, end)) == NULL) return end - p > MAX_LINE ? -1 : 0;
+    if (*p != '$' || *eol != '\r' || parse_long(p + 1, eol, &len) ||
+        len < 0 || len > MAX_BULK)
+      return -1;
+    p = eol + 2;
+    if (end - p < len + 2) return 0;
+    if (p[len] != '\r' || p[len + 1] != '\n') return -1;
+    args[*argc].p = p;
+    args[*argc].length = len;
+    p += len + 2;
+  }
+  *next = p;
+  return 1;
+}
+
+static void mark_dirty(client_t *c) {
+  if (c->dirty) return;
+  c->dirty = 1;
+  c->next_dirty = dirty;
+  dirty = c;
+}
+
+// Runs the commands that have arrived, until the replies pile up.
+static void run_client(client_t *c) {
+  c->stalled = 0;
+  while (!c->closing) {
+    const char *next;
+    long argc;
+    int ret;
+    if (c->out.length - c->sent >= OUT_LIMIT) {
+      c->stalled = 1;
+      break;
+    }
+    if ((ret = parse(c, &argc, &next)) < 0) {
+      reply_error(c, "Protocol error");
+      c->closing = 1;
+    }
+    if (ret <= 0) break;
+    // inline commands may have blank lines between them
+    if (argc > 0) run_command(c, argc, args);
+    c->parsed = next - c->in.data;
+  }
+  if (c->parsed == c->in.length) {
+    c->in.length = c->parsed = 0;
+  } else if (c->parsed > c->in.length / 2) {
+    memmove(c->in.data, c->in.data + c->parsed, c->in.length - c->parsed);
+    c->in.length -= c->parsed;
+    c->parsed = 0;
+  }
+  mark_dirty(c);
+}
+
+// Reads what has arrived; a client that has stopped sending is closed
+// once its replies are out.
+static void read_client(client_t *c) {
+  for (;;) {
+    ssize_t n;
+    if (buf_reserve(&c->in, READ_BYTES)) {
+      c->closing = 1;
+      return;
+    }
+    n = read(c->fd, c->in.data + c->in.length, c->in.cap - c->in.length);
+    if (n > 0) {
+      c->in.length += n;
+      if ((size_t)n < c->in.cap - c->in.length + n) return;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n == 0 || errno != EAGAIN) c->closing = 1;
+    return;
+  }
+}
+
+static void close_client(client_t *c) {
+  epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  clients[c->fd] = NULL;
+  nr_connected--;
+  free(c->in.data);
+  free(c->out.data);
+  free(c);
+}
+
+// Watches for input unless the client is going or has commands to run
+// already, and for room to send replies.
+static void watch(client_t *c) {
+  struct epoll_event ev;
+  ev.events = (!c->closing && !c->stalled ? EPOLLIN : 0) |
+      (c->sent < c->out.length ? EPOLLOUT : 0);
+  ev.data.ptr = c;
+  if (ev.events != (uint32_t)c->events &&
+      epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0)
+    c->events = ev.events;
+}
+
+// Sends what it can of the replies, all committed by now.
+static void send_client(client_t *c) {
+  while (c->sent < c->out.length) {
+    ssize_t n = send(c->fd, c->out.data + c->sent, c->out.length - c->sent,
+        MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      if (errno != EAGAIN) c->out.length = c->sent = 0, c->closing = 1;
+      break;
+    }
+    c->sent += n;
+  }
+  if (c->sent == c->out.length) c->out.length = c->sent = 0;
+}
+
+static void accept_clients(int lfd) {
+  for (;;) {
+    struct epoll_event ev;
+    int one = 1, fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    client_t *c;
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      return;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    if ((size_t)fd >= nr_clients) {
+      size_t n = nr_clients, cap = nr_clients;
+      if (grow((void **)&clients, &cap, fd, sizeof *clients)) {
+        close(fd);
+        continue;
+      }
+      memset(clients + n, 0, (cap - n) * sizeof *clients);
+      nr_clients = cap;
+    }
+    if ((c = calloc(1, sizeof *c)) == NULL) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->events = ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+      close(fd);
+      free(c);
+      continue;
+    }
+    clients[fd] = c;
+    nr_connected++;
+  }
+}
+
+static void on_signal(int sig) {
+  stop_flag = 1;
+}
+
+static void usage(char *prog) {
+  fprintf(stderr, "%s [-p port] [-b address] path\n", prog);
+  fprintf(stderr, "\t -p port to listen on, default 6379\n");
+  fprintf(stderr, "\t -b address to listen on, default 127.0.0.1\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  struct epoll_event ev, events[MAX_EVENTS];
+  struct sockaddr_in addr = { .sin_family = AF_INET };
+  struct sigaction act = { .sa_handler = on_signal };
+  const char *address = "127.0.0.1";
+  int port = 6379, lfd, one = 1, c;
+  while ((c = getopt(argc, argv, "p:b:")) != -1) {
+    switch (c) {
+      case 'p': port = atoi(optarg); break;
+      case 'b': address = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || port <= 0 || port > 65535) usage(argv[0]);
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) usage(argv[0]);
+
+  if (kvdb_open(&db, argv[optind])) die("kvdb_open");
+  if (kvdb_lock_exclusive(&db)) die("kvdb_lock_exclusive");
+  // no SA_RESTART: epoll_wait returns on a signal
+  sigaction(SIGINT, &act, NULL);
+  sigaction(SIGTERM, &act, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (lfd < 0) die("socket");
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof addr)) die("bind");
+  if (listen(lfd, 512)) die("listen");
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) die("epoll_create1");
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev)) die("epoll_ctl");
+
+  while (!stop_flag) {
+    int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      die("epoll_wait");
+    }
+    for (int i = 0; i < n; i++) {
+      client_t *cl = events[i].data.ptr;
+      if (cl == NULL) {
+        accept_clients(lfd);
+        continue;
+      }
+      // replies from earlier rounds first, which may make room for more
+      if (events[i].events & EPOLLOUT) send_client(cl);
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        read_client(cl);
+      run_client(cl);
+    }
+    // until no client that has stalled can go on
+    while (dirty != NULL) {
+      client_t *cl, *again = NULL;
+      commit();
+      while ((cl = dirty) != NULL) {
+        dirty = cl->next_dirty;
+        cl->dirty = 0;
+        send_client(cl);
+        if (cl->closing && cl->sent == cl->out.length) {
+          close_client(cl);
+        } else if (cl->stalled && cl->out.length - cl->sent < OUT_LIMIT) {
+          cl->next_dirty = again;
+          again = cl;
+        } else {
+          watch(cl);
+        }
+      }
+      for (; again != NULL; again = cl) {
+        cl = again->next_dirty;
+        run_client(again);
+      }
+    }
+  }
+
+  commit();
+  for (size_t i = 0; i < nr_clients; i++)
+    if (clients[i] != NULL) close_client(clients[i]);
+  free(clients);
+  free(args);
+  free(batch.data.data);
+  free(batch.ops);
+  free(batch.replies);
+  close(lfd);
+  close(epfd);
+  return kvdb_close(&db) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
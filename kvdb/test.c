@@ -0,0 +1,468 @@
+// Randomized tests of kvdb against a reference map, on a log file
+// (test.db) and on an LSM tree (test.lsm), each with compression off and
+// on.  Every round draws random puts, binary puts, deletions, batches,
+// asynchronous puts, checkpoints, compactions and reopens, then compares
+// kvdb_get, kvdb_get2, kvdb_get_view, iterators with and without a
+// prefix and asynchronous gets with the map, and takes many views with
+// no write in between, from one thread and from several.  Prints the
+// failed checks and exits with 1 if there are any.
+#define _GNU_SOURCE
+#include "kvdb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#define TEST_FILE       "test.db"
+#define TEST_DIR        "test.lsm"
+#define NUM_KEYS        400
+#define NUM_ROUNDS      40
+#define OPS_PER_ROUND   300
+#define MAX_VALUE       4096
+#define MAX_BATCH       16
+#define NUM_ASYNC       200
+#define NUM_VIEWS       100000
+#define VIEW_THREADS    4
+
+// every tenth key has a NUL inside, for kvdb_put2 and kvdb_get2 only
+typedef struct {
+  char key[16];
+  size_t key_length;
+  int present;
+  char *value;
+  size_t value_length;
+} ref_t;
+
+static ref_t refs[NUM_KEYS];
+static ref_t *sorted[NUM_KEYS];   // by key, as iterators go
+static kvdb_t db;
+static int use_lsm, use_compression;
+static uint64_t seed = 0x9e3779b97f4a7c15ull;
+static int failures = 0;
+static long compressed_views = 0;
+
+#define check(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: %s failed (%s, compression %s)\n", \
+          __FILE__, __LINE__, #cond, use_lsm ? "lsm" : "log", \
+          use_compression ? "on" : "off"); \
+      if (++failures >= 20) exit(EXIT_FAILURE); \
+    } \
+  } while (0)
+
+static void die(const char *what) {
+  perror(what);
+  exit(EXIT_FAILURE);
+}
+
+static uint64_t next_random(void) {
+  seed ^= seed >> 12;
+  seed ^= seed << 25;
+  seed ^= seed >> 27;
+  return seed * 0x2545f4914f6cdd1dull;
+}
+
+static size_t random_below(size_t n) {
+  return next_random() % n;
+}
+
+static void remove_dir(const char *path) {
+  DIR *dir = opendir(path);
+  struct dirent *de;
+  char name[512];
+  if (dir == NULL) return;
+  while ((de = readdir(dir)) != NULL) {
+    if (de->d_name[0] == '.') continue;
+    snprintf(name, sizeof name, "%s/%s", path, de->d_name);
+    unlink(name);
+  }
+  closedir(dir);
+  rmdir(path);
+}
+
+static void remove_db(void) {
+  unlink(TEST_FILE);
+  unlink(TEST_FILE ".idx");
+  unlink(TEST_FILE ".compact");
+  remove_dir(TEST_DIR);
+}
+
+static void open_db(void) {
+  if (use_lsm ? kvdb_open_lsm(&db, TEST_DIR) : kvdb_open(&db, TEST_FILE))
+    die("kvdb_open");
+  kvdb_set_compression(&db, use_compression);
+  // small enough to evict, so that reads go to the file too
+  kvdb_set_cache_size(&db, 16 << 10);
+}
+
+// the order of kvdb: bytes, then the shorter key first
+static int compare_key(const ref_t *r, const char *key, size_t length) {
+  int c = memcmp(r->key, key, r->key_length < length ? r->key_length : length);
+  return c ? c : (r->key_length > length) - (r->key_length < length);
+}
+
+static int compare_refs(const void *a, const void *b) {
+  const ref_t *y = *(ref_t *const *)b;
+  return compare_key(*(ref_t *const *)a, y->key, y->key_length);
+}
+
+static void init_keys(void) {
+  for (int i = 0; i < NUM_KEYS; i++) {
+    ref_t *r = &refs[i];
+    if (i % 10 == 9) {
+      r->key_length = snprintf(r->key, sizeof r->key, "b%03d", i) + 2;
+      r->key[r->key_length - 1] = 'z';
+    } else {
+      r->key_length = snprintf(r->key, sizeof r->key, "k%04d", i);
+    }
+    sorted[i] = r;
+  }
+  qsort(sorted, NUM_KEYS, sizeof *sorted, compare_refs);
+}
+
+static int is_string(const char *p, size_t length) {
+  return memchr(p, '\0', length) == NULL;
+}
+
+// Empty, short, long and compressible, or binary if binary is set.
+static size_t random_value(char *buf, int binary) {
+  size_t length;
+  switch (random_below(binary ? 4 : 3)) {
+    case 0:
+      return 0;
+    case 1:
+      length = 1 + random_below(20);
+      for (size_t i = 0; i < length; i++) buf[i] = 'a' + random_below(26);
+      return length;
+    case 2:
+      length = 100 + random_below(MAX_VALUE - 100);
+      for (size_t i = 0; i < length; i++) buf[i] = "abcdefgh"[i % 8];
+      buf[random_below(length)] = 'A' + random_below(26);
+      return length;
+    default:
+      length = 1 + random_below(200);
+      for (size_t i = 0; i < length; i++) buf[i] = random_below(4);
+      return length;
+  }
+}
+
+static void ref_set(ref_t *r, const char *value, size_t length) {
+  free(r->value);
+  r->value = NULL;
+  r->value_length = 0;
+  r->present = value != NULL;
+  if (value == NULL) return;
+  if ((r->value = malloc(length + 1)) == NULL) die("malloc");
+  memcpy(r->value, value, length);
+  r->value[length] = '\0';
+  r->value_length = length;
+}
+
+static ref_t *random_ref(int binary) {
+  for (;;) {
+    ref_t *r = &refs[random_below(NUM_KEYS)];
+    if (binary || is_string(r->key, r->key_length)) return r;
+  }
+}
+
+static void put_string(void) {
+  char buf[MAX_VALUE + 1];
+  ref_t *r = random_ref(0);
+  size_t length = random_value(buf, 0);
+  buf[length] = '\0';
+  check(kvdb_put(&db, r->key, buf) == 0);
+  ref_set(r, buf, length);
+}
+
+static void put_binary(void) {
+  char buf[MAX_VALUE];
+  ref_t *r = random_ref(1);
+  size_t length = random_value(buf, 1);
+  check(kvdb_put2(&db, r->key, r->key_length, buf, length) == 0);
+  ref_set(r, buf, length);
+}
+
+static void delete_key(void) {
+  ref_t *r = random_ref(0);
+  check(kvdb_delete(&db, r->key) == 0);
+  ref_set(r, NULL, 0);
+}
+
+// Later operations on a key win, so the map takes them in order.
+static void write_batch(void) {
+  struct kvdb_op ops[MAX_BATCH];
+  static char bufs[MAX_BATCH][MAX_VALUE + 1];
+  size_t n = 1 + random_below(MAX_BATCH), lengths[MAX_BATCH];
+  ref_t *rs[MAX_BATCH];
+  for (size_t i = 0; i < n; i++) {
+    rs[i] = random_ref(0);
+    ops[i].key = rs[i]->key;
+    ops[i].value = NULL;
+    if (random_below(4)) {
+      lengths[i] = random_value(bufs[i], 0);
+      bufs[i][lengths[i]] = '\0';
+      ops[i].value = bufs[i];
+    }
+  }
+  check(kvdb_write_batch(&db, ops, n) == 0);
+  for (size_t i = 0; i < n; i++)
+    ref_set(rs[i], ops[i].value, ops[i].value != NULL ? lengths[i] : 0);
+}
+
+static void done_put(void *arg, int status, void *value, size_t length) {
+  int *pending = arg;
+  check(status == 0 && value == NULL);
+  (*pending)--;
+}
+
+// A get queued after puts on its key finds the last of them.
+typedef struct {
+  int *pending;
+  ref_t *r;
+  char *value;            // expected, or NULL
+  size_t value_length;
+} async_get_t;
+
+static void done_get(void *arg, int status, void *value, size_t length) {
+  async_get_t *g = arg;
+  check(status == 0);
+  check((value != NULL) == (g->value != NULL));
+  if (value != NULL && g->value != NULL)
+    check(length == g->value_length &&
+        memcmp(value, g->value, length) == 0);
+  (*g->pending)--;
+  free(g->value);
+  free(g);
+  free(value);
+}
+
+static void async_ops(int close_pending) {
+  char buf[MAX_VALUE];
+  int pending = 0, fd = kvdb_async_fd(&db);
+  check(fd >= 0);
+  for (int i = 0; i < NUM_ASYNC; i++) {
+    ref_t *r = random_ref(1);
+    if (random_below(2)) {
+      size_t length = random_value(buf, 1);
+      const char *value = random_below(5) ? buf : NULL;
+      check(kvdb_put_async(&db, r->key, r->key_length, value, length,
+            done_put, &pending) == 0);
+      ref_set(r, value, length);
+    } else {
+      async_get_t *g = calloc(1, sizeof *g);
+      if (g == NULL) die("calloc");
+      g->pending = &pending;
+      g->r = r;
+      if (r->present) {
+        if ((g->value = malloc(r->value_length + 1)) == NULL) die("malloc");
+        memcpy(g->value, r->value, r->value_length);
+        g->value_length = r->value_length;
+      }
+      check(kvdb_get_async(&db, r->key, r->key_length, done_get, g) == 0);
+    }
+    pending++;
+  }
+  // kvdb_close serves the rest and runs their callbacks
+  if (close_pending) {
+    check(kvdb_close(&db) == 0);
+    check(pending == 0);
+    open_db();
+    return;
+  }
+  while (pending > 0) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    // the count may take in requests an earlier poll ran already
+    check(poll(&pfd, 1, 10000) == 1);
+    kvdb_async_poll(&db);
+  }
+}
+
+static void check_key(ref_t *r) {
+  size_t length = -1;
+  char *value = kvdb_get2(&db, r->key, r->key_length, &length);
+  check((value != NULL) == r->present);
+  if (value != NULL && r->present) {
+    check(length == r->value_length &&
+        memcmp(value, r->value, length) == 0);
+    check(value[length] == '\0');
+  }
+  free(value);
+  if (!is_string(r->key, r->key_length)) return;
+  value = kvdb_get(&db, r->key);
+  check((value != NULL) == r->present);
+  if (value != NULL && r->present)
+    check(memcmp(value, r->value, r->value_length + 1) == 0);
+  free(value);
+  errno = 0;
+  const char *view = kvdb_get_view(&db, r->key, &length);
+  if (view == NULL && errno == ENOTSUP) {
+    // only a log stores values compressed, and only when told to
+    check(!use_lsm && use_compression && r->present);
+    compressed_views++;
+  } else {
+    check((view != NULL) == r->present);
+    if (view != NULL && r->present)
+      check(length == r->value_length &&
+          memcmp(view, r->value, length + 1) == 0);
+  }
+}
+
+// Compares an iterator from key, or from the start, with the map.
+static void check_iter(const char *prefix, const char *key) {
+  size_t prefix_length = prefix != NULL ? strlen(prefix) : 0;
+  kvdb_iter_t *it = kvdb_iter_new(&db, prefix);
+  int i = 0;
+  check(it != NULL);
+  if (it == NULL) return;
+  check(kvdb_iter_seek(it, key) == 0);
+  for (;; i++) {
+    const char *k, *v;
+    size_t key_length, value_length;
+    ref_t *r = NULL;
+    // the next key of the map the iterator has to stop at
+    for (; i < NUM_KEYS; i++) {
+      r = sorted[i];
+      if (!r->present || r->key_length < prefix_length ||
+          memcmp(r->key, prefix, prefix_length))
+        continue;
+      if (key != NULL && compare_key(r, key, strlen(key)) < 0) continue;
+      break;
+    }
+    k = kvdb_iter_key(it, &key_length);
+    if (i == NUM_KEYS) {
+      check(k == NULL);
+      break;
+    }
+    check(k != NULL);
+    if (k == NULL) break;
+    check(key_length == r->key_length && memcmp(k, r->key, key_length) == 0);
+    v = kvdb_iter_value(it, &value_length);
+    check(v != NULL && value_length == r->value_length &&
+        memcmp(v, r->value, value_length) == 0);
+    check(kvdb_iter_next(it) == 0);
+  }
+  kvdb_iter_free(it);
+}
+
+static void check_all(void) {
+  char prefix[4];
+  ref_t *r = random_ref(0);
+  for (int i = 0; i < NUM_KEYS; i++) check_key(&refs[i]);
+  check_iter(NULL, NULL);
+  check_iter(NULL, r->key);
+  // "k01", "b03": a tenth of the keys of one kind
+  snprintf(prefix, sizeof prefix, "%.3s", random_ref(1)->key);
+  check_iter(prefix, NULL);
+  check_iter(prefix, r->key);
+}
+
+// Takes n views from key start on, every one checked, as is the last
+// one of the thread before the next: it has to stay valid until then.
+static void views(size_t start, size_t n) {
+  const char *last = NULL;
+  ref_t *last_ref = NULL;
+  for (size_t i = start; i < start + n; i++) {
+    ref_t *r = &refs[i * 7 % NUM_KEYS];
+    const char *view;
+    size_t length;
+    if (!is_string(r->key, r->key_length)) continue;
+    if (last != NULL)
+      check(memcmp(last, last_ref->value, last_ref->value_length + 1) == 0);
+    last = NULL;
+    errno = 0;
+    view = kvdb_get_view(&db, r->key, &length);
+    if (view == NULL && errno == ENOTSUP) continue;
+    check((view != NULL) == r->present);
+    if (view == NULL || !r->present) continue;
+    check(length == r->value_length &&
+        memcmp(view, r->value, length + 1) == 0);
+    last = view;
+    last_ref = r;
+  }
+}
+
+static void *view_thread(void *arg) {
+  views((uintptr_t)arg * NUM_VIEWS, NUM_VIEWS / VIEW_THREADS);
+  return NULL;
+}
+
+// A process that only reads must not keep every view it took.
+static void check_views(void) {
+  pthread_t threads[VIEW_THREADS];
+  size_t before = mallinfo2().uordblks;
+  views(0, NUM_VIEWS);
+  check(mallinfo2().uordblks < before + (1 << 20));
+  for (uintptr_t i = 0; i < VIEW_THREADS; i++)
+    if (pthread_create(&threads[i], NULL, view_thread, (void *)i))
+      die("pthread_create");
+  for (int i = 0; i < VIEW_THREADS; i++) pthread_join(threads[i], NULL);
+}
+
+static void run(void) {
+  for (int i = 0; i < NUM_KEYS; i++) ref_set(&refs[i], NULL, 0);
+  remove_db();
+  open_db();
+  for (int round = 0; round < NUM_ROUNDS; round++) {
+    for (int i = 0; i < OPS_PER_ROUND; i++) {
+      switch (random_below(10)) {
+        case 0: case 1: case 2: put_string(); break;
+        case 3: case 4: put_binary(); break;
+        case 5: case 6: delete_key(); break;
+        default: write_batch(); break;
+      }
+    }
+    switch (random_below(6)) {
+      case 0:
+        check(kvdb_compact(&db) == 0);
+        break;
+      case 1:
+        check(kvdb_checkpoint(&db) == 0);
+        break;
+      case 2:
+        check(kvdb_close(&db) == 0);
+        open_db();
+        break;
+      case 3:
+        async_ops(0);
+        break;
+      case 4:
+        async_ops(1);
+        break;
+    }
+    check_all();
+  }
+  check_views();
+  check(kvdb_close(&db) == 0);
+  // and once more as found by a fresh open
+  open_db();
+  check_all();
+  check_views();
+  check(kvdb_close(&db) == 0);
+  remove_db();
+}
+
+int main() {
+  init_keys();
+  for (use_lsm = 0; use_lsm < 2; use_lsm++) {
+    for (use_compression = 0; use_compression < 2; use_compression++) {
+      compressed_views = 0;
+      run();
+      if (!use_lsm && use_compression) check(compressed_views > 0);
+      printf("%s, compression %s: done\n", use_lsm ? "lsm" : "log",
+          use_compression ? "on" : "off");
+    }
+  }
+  for (int i = 0; i < NUM_KEYS; i++) ref_set(&refs[i], NULL, 0);
+  if (failures > 0) {
+    printf("%d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("all passed\n");
+  return 0;
+}
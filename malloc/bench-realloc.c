@@ -0,0 +1,85 @@
+// Vector-style growth patterns through the standard realloc interface.
+// Run it once as is and once with LD_PRELOAD=./libfastmalloc.so to
+// compare the allocators ("make bench-realloc" does both).
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <sys/time.h>
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (ptr == NULL) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+// Grows a buffer from `from` to `to` bytes, multiplying its capacity by
+// num/den each step and writing the new part like push_back would.
+static void grow_geometric(size_t from, size_t to, int num, int den) {
+  size_t cap = 0, next = from;
+  char *buf = NULL;
+  while (cap < to) {
+    buf = xrealloc(buf, next);
+    memset(buf + cap, (int)cap, next - cap);
+    cap = next;
+    next = cap * num / den;
+    if (next <= cap) next = cap + 1;
+  }
+  free(buf);
+}
+
+// Grows a buffer by a fixed increment, the worst case for copying.
+static void grow_linear(size_t step, size_t to) {
+  char *buf = NULL;
+  for (size_t cap = step; cap <= to; cap += step) {
+    buf = xrealloc(buf, cap);
+    buf[cap - 1] = 1;
+  }
+  free(buf);
+}
+
+// Many small vectors growing side by side, each by a few bytes.
+#define NUM_VECTORS 1024
+static void grow_small_vectors(size_t step, size_t to) {
+  static char *vec[NUM_VECTORS];
+  for (size_t cap = step; cap <= to; cap += step) {
+    for (int i = 0; i < NUM_VECTORS; i++) {
+      vec[i] = xrealloc(vec[i], cap);
+      vec[i][cap - 1] = 1;
+    }
+  }
+  for (int i = 0; i < NUM_VECTORS; i++) {
+    free(vec[i]);
+    vec[i] = NULL;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 4;
+  const char *allocator =
+    dlsym(RTLD_DEFAULT, "do_malloc") ? "fastmalloc" : "glibc";
+  double t;
+
+#define BENCH(name, stmt) do { \
+    t = now(); \
+    for (int i = 0; i < rounds; i++) stmt; \
+    printf("%s,%s,%.6f\n", name, allocator, (now() - t) / rounds); \
+  } while (0)
+
+  BENCH("double-to-256M", grow_geometric(16, 256 << 20, 2, 1));
+  BENCH("x1.5-to-256M", grow_geometric(16, 256 << 20, 3, 2));
+  BENCH("linear-4K-to-16M", grow_linear(4096, 16 << 20));
+  BENCH("linear-64K-to-256M", grow_linear(64 << 10, 256 << 20));
+  BENCH("small-vectors-8-to-4K", grow_small_vectors(8, 4096));
+  return 0;
+}
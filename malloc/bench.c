@@ -0,0 +1,497 @@
+// Multi-threaded allocator benchmarks through the standard malloc
+// interface.  Run it as is for glibc, or with
+// LD_PRELOAD=./libfastmalloc.so for our allocator; "make bench" runs
+// every workload with both and collects the results in bench.csv.
+//
+// Workloads:
+//   larson      random free/malloc over a slot array, handed on to a
+//               new thread every few thousand operations
+//   xmalloc     producer threads allocate, consumer threads free
+//   threadtest  allocate a batch of objects, then free all of them
+//   realloc     buffers growing and shrinking by realloc
+//   frag        mixed sizes with a shifting live set, tracking RSS
+//   listwalk    walk a linked list built among short-lived objects
+//   falseshare  threads allocate small counters at the same time, then
+//               each increments its own; -v reports how many of them
+//               share a cache line with another thread's counter
+//
+// Output is one CSV line:
+//   workload,allocator,threads,ops,seconds,ops_per_sec,peak_rss_kb,rss_kb
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+static int num_threads = 1;
+static double run_time = 1.0;
+static int verbose_flag = 0;
+static int done_flag = 0;
+
+#define is_done()   __atomic_load_n(&done_flag, __ATOMIC_RELAXED)
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static uint64_t rng(uint64_t *seed) {
+  *seed ^= *seed >> 12;
+  *seed ^= *seed << 25;
+  *seed ^= *seed >> 27;
+  return *seed * 0x2545f4914f6cdd1dull;
+}
+
+static size_t rand_size(uint64_t *seed, size_t lo, size_t hi) {
+  return lo + rng(seed) % (hi - lo + 1);
+}
+
+// log-uniform, so that small sizes dominate like in real programs
+static size_t rand_log_size(uint64_t *seed, size_t lo, size_t hi) {
+  size_t sz = lo << (rng(seed) % (64 - __builtin_clzl(hi / lo)));
+  return sz + rng(seed) % sz;
+}
+
+static void *xmalloc(size_t size) {
+  void *ptr = malloc(size);
+  if (ptr == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  *(volatile char *)ptr = 1;
+  return ptr;
+}
+
+static long current_rss_kb() {
+  long pages = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp == NULL) return 0;
+  if (fscanf(fp, "%*s %ld", &pages) != 1) pages = 0;
+  fclose(fp);
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+typedef struct worker {
+  pthread_t tid;
+  int id;
+  uint64_t seed;
+  uint64_t ops;
+} __attribute__((aligned(64))) worker;
+
+static worker *workers;
+
+//=========================================================
+// larson
+//=========================================================
+
+#define LARSON_SLOTS    1000
+#define LARSON_ROUNDS   10000
+
+typedef struct larson_chain {
+  void *slots[LARSON_SLOTS];
+  uint64_t seed;
+  uint64_t ops;
+} larson_chain;
+
+static int larson_running = 0;
+
+static void *larson_thread(void *arg) {
+  larson_chain *c = arg;
+  for (int i = 0; i < LARSON_ROUNDS && !is_done(); i++) {
+    int k = rng(&c->seed) % LARSON_SLOTS;
+    free(c->slots[k]);
+    c->slots[k] = xmalloc(rand_size(&c->seed, 16, 1024));
+    c->ops++;
+  }
+  // like a server handing its connection state to a fresh thread
+  pthread_t tid;
+  if (is_done() || pthread_create(&tid, NULL, larson_thread, c))
+    __atomic_sub_fetch(&larson_running, 1, __ATOMIC_RELEASE);
+  else
+    pthread_detach(tid);
+  return NULL;
+}
+
+static uint64_t run_larson() {
+  larson_chain *chains = calloc(num_threads, sizeof(larson_chain));
+  uint64_t ops = 0;
+  for (int i = 0; i < num_threads; i++) {
+    chains[i].seed = i + 1;
+    for (int k = 0; k < LARSON_SLOTS; k++)
+      chains[i].slots[k] = xmalloc(rand_size(&chains[i].seed, 16, 1024));
+  }
+  larson_running = num_threads;
+  for (int i = 0; i < num_threads; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, larson_thread, &chains[i])) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
+  }
+  usleep(run_time * 1e6);
+  __atomic_store_n(&done_flag, 1, __ATOMIC_RELAXED);
+  while (__atomic_load_n(&larson_running, __ATOMIC_ACQUIRE) > 0)
+    usleep(1000);
+  for (int i = 0; i < num_threads; i++) {
+    ops += chains[i].ops;
+    for (int k = 0; k < LARSON_SLOTS; k++) free(chains[i].slots[k]);
+  }
+  free(chains);
+  return ops;
+}
+
+//=========================================================
+// generic worker threads
+//=========================================================
+
+static uint64_t run_workers(void *(*fn)(void *)) {
+  uint64_t ops = 0;
+  workers = calloc(num_threads, sizeof(worker));
+  for (int i = 0; i < num_threads; i++) {
+    workers[i].id = i;
+    workers[i].seed = i + 1;
+    if (pthread_create(&workers[i].tid, NULL, fn, &workers[i])) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+  usleep(run_time * 1e6);
+  __atomic_store_n(&done_flag, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(workers[i].tid, NULL);
+    ops += workers[i].ops;
+  }
+  free(workers);
+  return ops;
+}
+
+//=========================================================
+// xmalloc: cross-thread free through single-producer,
+// single-consumer rings; -t gives the number of pairs
+//=========================================================
+
+#define RING_SIZE   1024
+
+typedef struct ring {
+  void *slot[RING_SIZE];
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+} ring;
+
+static ring *rings;
+
+static void *xmalloc_producer(void *arg) {
+  worker *w = arg;
+  ring *r = &rings[w->id / 2];
+  while (!is_done()) {
+    uint64_t head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+      sched_yield();
+      continue;
+    }
+    r->slot[head % RING_SIZE] = xmalloc(rand_size(&w->seed, 16, 512));
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+static void *xmalloc_consumer(void *arg) {
+  worker *w = arg;
+  ring *r = &rings[w->id / 2];
+  while (!is_done()) {
+    uint64_t tail = r->tail;
+    if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+      sched_yield();
+      continue;
+    }
+    free(r->slot[tail % RING_SIZE]);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    w->ops++;
+  }
+  return NULL;
+}
+
+static void *xmalloc_thread(void *arg) {
+  worker *w = arg;
+  return w->id % 2 ? xmalloc_consumer(arg) : xmalloc_producer(arg);
+}
+
+static uint64_t run_xmalloc() {
+  int pairs = num_threads;
+  rings = aligned_alloc(64, sizeof(ring) * pairs);
+  memset(rings, 0, sizeof(ring) * pairs);
+  num_threads = pairs * 2;
+  uint64_t ops = run_workers(xmalloc_thread);
+  num_threads = pairs;
+  for (int i = 0; i < pairs; i++)
+    for (uint64_t k = rings[i].tail; k != rings[i].head; k++)
+      free(rings[i].slot[k % RING_SIZE]);
+  free(rings);
+  return ops;
+}
+
+//=========================================================
+// threadtest
+//=========================================================
+
+#define THREADTEST_OBJECTS  1000
+
+static void *threadtest_thread(void *arg) {
+  worker *w = arg;
+  void *obj[THREADTEST_OBJECTS];
+  while (!is_done()) {
+    for (int i = 0; i < THREADTEST_OBJECTS; i++) obj[i] = xmalloc(64);
+    for (int i = 0; i < THREADTEST_OBJECTS; i++) free(obj[i]);
+    w->ops += THREADTEST_OBJECTS;
+  }
+  return NULL;
+}
+
+//=========================================================
+// realloc
+//=========================================================
+
+#define REALLOC_BUFFERS 256
+
+static void *realloc_thread(void *arg) {
+  worker *w = arg;
+  char *buf[REALLOC_BUFFERS] = { NULL };
+  size_t len[REALLOC_BUFFERS] = { 0 };
+  while (!is_done()) {
+    int k = rng(&w->seed) % REALLOC_BUFFERS;
+    size_t sz = len[k] ? len[k] * (rand_size(&w->seed, 1, 8)) / 4
+        : rand_size(&w->seed, 1, 256);
+    if (sz == 0) sz = 1;
+    if (sz > (1 << 20)) sz = rand_size(&w->seed, 1, 256);
+    char *p = realloc(buf[k], sz);
+    if (p == NULL) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    p[sz - 1] = 1;
+    buf[k] = p;
+    len[k] = sz;
+    w->ops++;
+  }
+  for (int i = 0; i < REALLOC_BUFFERS; i++) free(buf[i]);
+  return NULL;
+}
+
+//=========================================================
+// frag: a live set of mixed-size objects where most of each
+// generation dies and the sizes drift over time
+//=========================================================
+
+#define FRAG_OBJECTS    20000
+
+static long peak_rss_sampled = 0, last_rss = 0;
+
+static void *frag_thread(void *arg) {
+  worker *w = arg;
+  void **obj = calloc(FRAG_OBJECTS, sizeof(void *));
+  for (int gen = 0; !is_done(); gen++) {
+    // sizes move between small and large objects every generation
+    size_t hi = (gen % 4 == 3) ? 65536 : 64 << (gen % 4 * 2);
+    for (int i = 0; i < FRAG_OBJECTS && !is_done(); i++) {
+      if (obj[i] != NULL) {
+        // a tenth of the objects survives each generation
+        if (rng(&w->seed) % 10 == 0) continue;
+        free(obj[i]);
+      }
+      obj[i] = xmalloc(rand_log_size(&w->seed, 16, hi));
+      w->ops++;
+    }
+  }
+  for (int i = 0; i < FRAG_OBJECTS; i++) free(obj[i]);
+  free(obj);
+  return NULL;
+}
+
+static void *rss_sampler(void *arg) {
+  double start = now();
+  while (!is_done()) {
+    long rss = current_rss_kb();
+    if (rss > peak_rss_sampled) peak_rss_sampled = rss;
+    last_rss = rss;
+    if (verbose_flag) fprintf(stderr, "%.2f,%ld\n", now() - start, rss);
+    usleep(50000);
+  }
+  return NULL;
+}
+
+static uint64_t run_frag() {
+  pthread_t sampler;
+  pthread_create(&sampler, NULL, rss_sampler, NULL);
+  uint64_t ops = run_workers(frag_thread);
+  pthread_join(sampler, NULL);
+  return ops;
+}
+
+//=========================================================
+// listwalk: nodes are allocated among short-lived objects of
+// other sizes, then the list is walked over and over
+//=========================================================
+
+#define LIST_NODES  100000
+
+typedef struct node {
+  struct node *next;
+  long payload[3];
+} node;
+
+static void *listwalk_thread(void *arg) {
+  worker *w = arg;
+  node *head = NULL;
+  void *noise[64] = { NULL };
+  for (int i = 0; i < LIST_NODES; i++) {
+    node *n = xmalloc(sizeof(node));
+    n->next = head;
+    n->payload[0] = i;
+    head = n;
+    int k = rng(&w->seed) % 64;
+    free(noise[k]);
+    noise[k] = xmalloc(rand_size(&w->seed, 16, 256));
+  }
+  for (int i = 0; i < 64; i++) free(noise[i]);
+  long sum = 0;
+  while (!is_done()) {
+    for (node *n = head; n != NULL; n = n->next) sum += n->payload[0];
+    w->ops += LIST_NODES;
+  }
+  while (head != NULL) {
+    node *next = head->next;
+    free(head);
+    head = next;
+  }
+  return (void *)sum;
+}
+
+//=========================================================
+// falseshare
+//=========================================================
+
+#define FALSESHARE_COUNTERS 64
+
+static long **counters;
+static pthread_barrier_t falseshare_barrier;
+
+static void *falseshare_thread(void *arg) {
+  worker *w = arg;
+  long **mine = counters + w->id * FALSESHARE_COUNTERS;
+  // interleave the allocations of all threads as much as possible
+  pthread_barrier_wait(&falseshare_barrier);
+  for (int i = 0; i < FALSESHARE_COUNTERS; i++) {
+    mine[i] = xmalloc(sizeof(long));
+    *mine[i] = 0;
+    sched_yield();
+  }
+  pthread_barrier_wait(&falseshare_barrier);
+  while (!is_done()) {
+    for (int i = 0; i < FALSESHARE_COUNTERS; i++)
+      (*(volatile long *)mine[i])++;
+    w->ops += FALSESHARE_COUNTERS;
+  }
+  return NULL;
+}
+
+static int cmp_line(const void *a, const void *b) {
+  uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t run_falseshare() {
+  int n = num_threads * FALSESHARE_COUNTERS;
+  counters = calloc(n, sizeof(long *));
+  pthread_barrier_init(&falseshare_barrier, NULL, num_threads);
+  uint64_t ops = run_workers(falseshare_thread);
+  if (verbose_flag) {
+    // sort (line, owner) pairs and count counters on mixed lines
+    uintptr_t *lines = calloc(n, sizeof(uintptr_t));
+    int shared = 0;
+    for (int i = 0; i < n; i++)
+      lines[i] = ((uintptr_t)counters[i] & -64) | (i / FALSESHARE_COUNTERS);
+    qsort(lines, n, sizeof(uintptr_t), cmp_line);
+    for (int i = 0; i < n; i++) {
+      uintptr_t line = lines[i] & -64;
+      if ((i > 0 && (lines[i - 1] & -64) == line && lines[i - 1] != lines[i])
+          || (i + 1 < n && (lines[i + 1] & -64) == line
+            && lines[i + 1] != lines[i]))
+        shared++;
+    }
+    fprintf(stderr, "%d of %d counters share a cache line with another "
+        "thread\n", shared, n);
+    free(lines);
+  }
+  for (int i = 0; i < n; i++) free(counters[i]);
+  free(counters);
+  pthread_barrier_destroy(&falseshare_barrier);
+  return ops;
+}
+
+//=========================================================
+
+static void usage(char *prog) {
+  printf("%s -w workload [-t threads] [-d seconds] [-v]\n", prog);
+  printf("\t -w larson, xmalloc, threadtest, realloc, frag, listwalk\n");
+  printf("\t    or falseshare\n");
+  printf("\t -t number of threads (producer/consumer pairs for xmalloc)\n");
+  printf("\t -d run time in seconds, default 1.0\n");
+  printf("\t -v print RSS over time as seconds,kb to stderr (frag), or\n");
+  printf("\t    the number of counters on shared lines (falseshare)\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  const char *workload = NULL;
+  int c;
+  while ((c = getopt(argc, argv, "w:t:d:v")) != -1) {
+    switch (c) {
+      case 'w': workload = optarg; break;
+      case 't': num_threads = atoi(optarg); break;
+      case 'd': run_time = atof(optarg); break;
+      case 'v': verbose_flag = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (workload == NULL || num_threads < 1) usage(argv[0]);
+
+  const char *allocator =
+    dlsym(RTLD_DEFAULT, "do_malloc") ? "fastmalloc" : "glibc";
+  uint64_t ops;
+  double start = now();
+  if (strcmp(workload, "larson") == 0) {
+    ops = run_larson();
+  } else if (strcmp(workload, "xmalloc") == 0) {
+    ops = run_xmalloc();
+  } else if (strcmp(workload, "threadtest") == 0) {
+    ops = run_workers(threadtest_thread);
+  } else if (strcmp(workload, "realloc") == 0) {
+    ops = run_workers(realloc_thread);
+  } else if (strcmp(workload, "frag") == 0) {
+    ops = run_frag();
+  } else if (strcmp(workload, "listwalk") == 0) {
+    ops = run_workers(listwalk_thread);
+  } else if (strcmp(workload, "falseshare") == 0) {
+    ops = run_falseshare();
+  } else {
+    usage(argv[0]);
+    return 1;
+  }
+  double elapsed = now() - start;
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  long rss = last_rss ? last_rss : current_rss_kb();
+  printf("%s,%s,%d,%llu,%.3f,%.0f,%ld,%ld\n", workload, allocator,
+      num_threads, (unsigned long long)ops, elapsed, ops / elapsed,
+      ru.ru_maxrss, rss);
+  return 0;
+}
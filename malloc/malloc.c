@@ -5,10 +5,16 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <execinfo.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/auxv.h>
+#include <sched.h>
 
 //=========================================================
 // Your implementations HERE
@@ -27,6 +33,91 @@ static const size_t page_size = 1024 * 64;
 #define PAGE_MINI_BLOCK     0
 #define PAGE_HUGE_BLOCK     1
 
+// every block returned by do_malloc is aligned to this boundary
+#define MALLOC_ALIGNMENT    16
+
+// Built with -DMALLOC_HARDENED, every block ends in a canary and do_free
+// checks it, catches double and invalid frees, and holds freed mini
+// blocks back in a poisoned quarantine.  Huge blocks are followed by a
+// guard page unless MALLOC_GUARD_PAGES is 0.  The default build has none
+// of it: CANARY_SIZE and GUARD_SIZE are 0 and the checks compile away.
+#ifdef MALLOC_HARDENED
+#ifndef MALLOC_GUARD_PAGES
+#define MALLOC_GUARD_PAGES  1
+#endif
+#define CANARY_SIZE         sizeof(uint64_t)
+#define GUARD_SIZE          (MALLOC_GUARD_PAGES ? (size_t)getpagesize() : 0)
+#else
+#define CANARY_SIZE         0
+#define GUARD_SIZE          0
+#endif
+
+// A block never starts at the beginning of its page, where the header
+// is; a huge block aligned to page_size or more starts right at the end
+// of its header page.
+static inline void *page_of(void *ptr) {
+  return (void *)(((uintptr_t)ptr - 1) & (-page_size));
+}
+
+//========================================================
+//  SEGMENTS
+//========================================================
+
+// Pages are carved from 32 MiB segments aligned to the 2 MiB huge page
+// size instead of being mapped one by one.  A segment is a single VMA
+// the kernel can back with transparent huge pages, and on NUMA machines
+// it is bound to the node of the thread that mapped it.
+static const size_t huge_page_size = 1024 * 1024 * 2;
+static const size_t segment_size = 1024 * 1024 * 32;
+
+#define MAX_NUMA_NODE   8
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1
+#endif
+
+static int numa_node_count = 0;
+
+static void init_numa_node_count(void) {
+  char path[64];
+  int n = 0;
+  while (n < MAX_NUMA_NODE) {
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%d", n);
+    if (access(path, F_OK)) break;
+    n++;
+  }
+  numa_node_count = n;
+}
+
+static inline int current_numa_node(void) {
+  unsigned cpu, node;
+  if (numa_node_count <= 1 || getcpu(&cpu, &node)) return 0;
+  return node % numa_node_count;
+}
+
+// Asks for transparent huge pages and prefers memory on the given node.
+// Both are hints, so errors are ignored.
+static void advise_backing(void *addr, size_t len, int node) {
+  madvise(addr, len, MADV_HUGEPAGE);
+  if (numa_node_count > 1) {
+    unsigned long nodemask = 1UL << node;
+    syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &nodemask,
+        sizeof(nodemask) * 8, 0);
+  }
+}
+
+static void *map_segment(int node) {
+  uint8_t *area = mmap(NULL, segment_size + huge_page_size,
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (area == MAP_FAILED) return NULL;
+  size_t margin = (huge_page_size - ((uintptr_t)area & (huge_page_size - 1)))
+      & (huge_page_size - 1);
+  if (margin) munmap(area, margin);
+  munmap(area + margin + segment_size, huge_page_size - margin);
+  advise_backing(area + margin, segment_size, node);
+  return area + margin;
+}
+
 //========================================================
 //  FREE PAGE MANAGEMENT
 //========================================================
@@ -35,123 +126,418 @@ typedef struct free_page {
   void *next_page;
 } free_page;
 
-static free_page *free_page_head = NULL;
-static int free_page_count = 0;
+// Free pages are kept per NUMA node.  Up to 32 of them stay committed;
+// the rest are handed back to the kernel with MADV_DONTNEED but keep
+// their address space, so segments are never split or unmapped.
+typedef struct page_pool {
+  pthread_mutex_t mutex;
+  free_page *free_page_head;
+  int free_page_count;
+  free_page *clean_page_head;
+  int clean_page_count;
+  int segment_count;
+  uint8_t *segment;
+  size_t segment_used;
+} page_pool;
 
-static pthread_mutex_t fp_mutex = PTHREAD_MUTEX_INITIALIZER;
+static page_pool page_pools[MAX_NUMA_NODE] = {
+  [0 ... MAX_NUMA_NODE - 1] = { .mutex = PTHREAD_MUTEX_INITIALIZER },
+};
 
-static void release_free_page(free_page *page);
-static free_page *alloc_free_page() {
-  pthread_mutex_lock(&fp_mutex);
-  free_page *current_page = free_page_head;
-  if (current_page != NULL) {
-    free_page_head = free_page_head->next_page;
-    free_page_count--;
-    pthread_mutex_unlock(&fp_mutex);
+static free_page *alloc_free_page(int node) {
+  page_pool *pool = &page_pools[node];
+  free_page *current_page;
+  pthread_mutex_lock(&pool->mutex);
+  if ((current_page = pool->free_page_head) != NULL) {
+    pool->free_page_head = current_page->next_page;
+    pool->free_page_count--;
+  } else if ((current_page = pool->clean_page_head) != NULL) {
+    pool->clean_page_head = current_page->next_page;
+    pool->clean_page_count--;
   } else {
-    pthread_mutex_unlock(&fp_mutex);
-    void *page = mmap(NULL, page_size << 1, PROT_READ | PROT_WRITE, 
-        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (page == NULL) return NULL;
-    size_t margin = ((uintptr_t)page) & (page_size - 1);
-    if (margin == 0) {
-      current_page = page;
-      release_free_page((free_page *)(page + page_size));
-    } else {
-      current_page = (free_page *)((uint8_t *)(page) + 
-          (page_size - margin));
-      munmap(page, page_size - margin);
-      munmap((uint8_t *)(current_page) + page_size, margin);
+    if (pool->segment == NULL || pool->segment_used == segment_size) {
+      pool->segment = map_segment(node);
+      pool->segment_used = 0;
+      if (pool->segment != NULL) pool->segment_count++;
+    }
+    if (pool->segment != NULL) {
+      current_page = (free_page *)(pool->segment + pool->segment_used);
+      pool->segment_used += page_size;
     }
   }
+  pthread_mutex_unlock(&pool->mutex);
   return current_page;
 }
 
-static void release_free_page(free_page *page) {
-  pthread_mutex_lock(&fp_mutex);
-  if (free_page_count >= 32) {
-    pthread_mutex_unlock(&fp_mutex);
-    munmap(page, page_size);
+static void release_free_page(free_page *page, int node) {
+  page_pool *pool = &page_pools[node];
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->free_page_count >= 32) {
+    pthread_mutex_unlock(&pool->mutex);
+    madvise(page, page_size, MADV_DONTNEED);
+    pthread_mutex_lock(&pool->mutex);
+    page->next_page = pool->clean_page_head;
+    pool->clean_page_head = page;
+    pool->clean_page_count++;
   } else {
-    page->next_page = free_page_head;
-    free_page_head = page;
-    free_page_count++;
-    pthread_mutex_unlock(&fp_mutex);
+    page->next_page = pool->free_page_head;
+    pool->free_page_head = page;
+    pool->free_page_count++;
   }
+  pthread_mutex_unlock(&pool->mutex);
 }
 
+//========================================================
+//  SIZE CLASSES
+//========================================================
+
+// Mini blocks are rounded up to one of these sizes: multiples of 16 up
+// to 128 bytes, then four classes per power of two.  A mini page only
+// holds blocks of a single class, so the block size of any pointer can
+// be recovered from its page header.
+static const uint32_t size_classes[] = {
+     16,    32,    48,    64,    80,    96,   112,   128,
+    160,   192,   224,   256,   320,   384,   448,   512,
+    640,   768,   896,  1024,  1280,  1536,  1792,  2048,
+   2560,  3072,  3584,  4096,  5120,  6144,  7168,  8192,
+  10240, 12288, 14336, 16384,
+};
+
+#define NUM_SIZE_CLASS  (sizeof(size_classes) / sizeof(size_classes[0]))
+
+static inline int size_class(size_t sz) {
+  if (sz <= 128) return sz ? (sz - 1) >> 4 : 0;
+  int lg = 63 - __builtin_clzl(sz - 1);
+  return 8 + (lg - 7) * 4 + (((sz - 1) >> (lg - 2)) & 3);
+}
+
+//========================================================
+//  STATISTICS
+//========================================================
+
+// Counters are kept per thread and only ever increase; do_malloc_stat
+// sums them over all threads.  The counter block of an exited thread is
+// handed to the next new thread, so the sums stay exact without any
+// merging on thread exit.
+typedef struct thread_stat {
+  struct thread_stat *next;
+  int in_use;
+  uint64_t pages_alloc, pages_free;
+  uint64_t huge_alloc, huge_free;
+  uint64_t huge_alloc_bytes, huge_free_bytes;
+  uint64_t mini_alloc[NUM_SIZE_CLASS];
+  uint64_t mini_free[NUM_SIZE_CLASS];
+} thread_stat;
+
+static thread_stat *thread_stat_head = NULL;
+static pthread_mutex_t stat_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread thread_stat *my_thread_stat
+    __attribute__((tls_model("initial-exec"))) = NULL;
+
+static void register_thread(void);
+
+static void release_thread_stat(void) {
+  thread_stat *st = my_thread_stat;
+  if (st == NULL) return;
+  my_thread_stat = NULL;
+  __atomic_store_n(&st->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static thread_stat *acquire_thread_stat(void) {
+  thread_stat *st;
+  pthread_mutex_lock(&stat_mutex);
+  for (st = thread_stat_head; st != NULL; st = st->next)
+    if (!__atomic_load_n(&st->in_use, __ATOMIC_ACQUIRE)) break;
+  if (st == NULL) {
+    // counter blocks are never unmapped
+    st = mmap(NULL, sizeof(thread_stat), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (st == MAP_FAILED) die("malloc: cannot map statistics\n");
+    st->next = thread_stat_head;
+    thread_stat_head = st;
+  }
+  st->in_use = 1;
+  pthread_mutex_unlock(&stat_mutex);
+  // registering may allocate, so publish the block first
+  my_thread_stat = st;
+  register_thread();
+  return st;
+}
+
+static inline thread_stat *get_thread_stat(void) {
+  thread_stat *st = my_thread_stat;
+  if (__builtin_expect(st == NULL, 0)) st = acquire_thread_stat();
+  return st;
+}
+
+// only the owning thread writes its counters; readers may see them at
+// any time
+#define STAT_ADD(field, n) do { \
+    thread_stat *st_ = get_thread_stat(); \
+    __atomic_store_n(&st_->field, st_->field + (n), __ATOMIC_RELAXED); \
+  } while (0)
+
 //========================================================
 //  MINI PAGES
 //========================================================
 
+#define CACHE_LINE  64
+
+// The header takes two cache lines: the first is only written by the
+// thread owning the page, the second only by do_free.  Blocks start
+// after both, so neither kind of update touches user data.
 typedef struct page_mini_block {
   uint16_t page_type;
   uint16_t active;
+  uint16_t size_class;
+  uint16_t node;
   uint32_t used_block;
-  uint32_t freed_block;
   uint32_t ptr;
-} page_mini_block;
+  uint32_t freed_block __attribute__((aligned(CACHE_LINE)));
+#ifdef MALLOC_HARDENED
+  // one bit per block, set while the block is allocated; room for
+  // page_size / MALLOC_ALIGNMENT blocks
+  uint64_t live_map[1024 * 64 / MALLOC_ALIGNMENT / 64]
+      __attribute__((aligned(CACHE_LINE)));
+#endif
+} __attribute__((aligned(CACHE_LINE))) page_mini_block;
+
+#ifdef MALLOC_HARDENED
+static void harden_mini_blocks(page_mini_block *page, void **ptrs, size_t n);
+#endif
 
-#define NUM_PAGE_MINI_BLOCK   4
-page_mini_block *current_page_mini_block[NUM_PAGE_MINI_BLOCK];
+// Each thread allocates from pages of its own, one per size class, so
+// blocks of different threads never share a cache line.
+static __thread page_mini_block *thread_pages[NUM_SIZE_CLASS]
+    __attribute__((tls_model("initial-exec")));
+static __thread int thread_registered
+    __attribute__((tls_model("initial-exec"))) = 0;
 
-static page_mini_block *alloc_page_mini_block() {
-  page_mini_block *page = (page_mini_block *)alloc_free_page();
+static page_mini_block *alloc_page_mini_block(int cls) {
+  int node = current_numa_node();
+  page_mini_block *page = (page_mini_block *)alloc_free_page(node);
   if (page == NULL) return NULL;
+  page->node = node;
   page->page_type = PAGE_MINI_BLOCK;
   page->active = 1;
+  page->size_class = cls;
   page->used_block = 0;
   page->freed_block = 0;
   page->ptr = page_size;
+#ifdef MALLOC_HARDENED
+  memset(page->live_map, 0, sizeof(page->live_map));
+#endif
+  STAT_ADD(pages_alloc, 1);
   return page;
 }
 
-static void free_mini_block(page_mini_block *page);
-static void *alloc_mini_block(size_t sz) {
-  void *ret;
-  // try to find a page with enough space by atomic xchg operation
-  page_mini_block *page = NULL;
-  for (int i = 0; i < NUM_PAGE_MINI_BLOCK; i++) {
-    page = __atomic_exchange_n(current_page_mini_block + i, page, 
-        __ATOMIC_SEQ_CST);
-    if (page != NULL && sizeof(page_mini_block) + sz <= page->ptr)
-      goto alloc_page_succ;
-  }
-  // fail to find a suitable page, allocate a new one
-  page = alloc_page_mini_block();
-  if (page == NULL) return NULL;
-alloc_page_succ:
-  ret = (uint8_t *)page + (page->ptr -= sz);
-  page->used_block++;
+static void free_mini_blocks(page_mini_block *page, uint32_t count);
 
-  // put back the page into the list
-  void *expected = NULL;
-  for (int i = 0; i < NUM_PAGE_MINI_BLOCK; i++) {
-    if (__atomic_compare_exchange_n(current_page_mini_block + i, 
-          &expected, page, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
-      goto putback_succ;
-    expected = NULL;
-  }
-  // fail to put back the page
+// Gives up the allocating side of a page that its owner no longer
+// allocates from.  The page is returned to the free page pool as soon
+// as all its blocks have been freed.
+static void retire_page_mini_block(page_mini_block *page) {
   // add a reference count to avoid atomicity violation
   page->used_block++;
-  // mark the page inactive; once the page becomes inactive, 
+  // mark the page inactive; once the page becomes inactive,
   // the number of used blocks never increases
   __atomic_store_n(&page->active, 0, __ATOMIC_SEQ_CST);
   // decrease the reference count
-  free_mini_block(page);
-putback_succ:
-  return ret;
+  free_mini_blocks(page, 1);
 }
 
-static void free_mini_block(page_mini_block *page) {
-  uint32_t freed_block = __atomic_add_fetch(&page->freed_block, 1, 
+// Carves up to n blocks of class cls from the current page of this
+// thread.  Returns the number of blocks stored in ptrs, which is 0 only
+// if out of memory.
+static size_t alloc_mini_blocks(int cls, void **ptrs, size_t n) {
+  size_t sz = size_classes[cls];
+  page_mini_block *page = thread_pages[cls];
+  if (__builtin_expect(page == NULL
+        || sizeof(page_mini_block) + sz > page->ptr, 0)) {
+    // registering may allocate, and install or fill up a page of cls
+    if (!thread_registered) {
+      register_thread();
+      return alloc_mini_blocks(cls, ptrs, n);
+    }
+    if (page != NULL) retire_page_mini_block(page);
+    thread_pages[cls] = page = alloc_page_mini_block(cls);
+    if (page == NULL) return 0;
+  }
+  if (n > (page->ptr - sizeof(page_mini_block)) / sz)
+    n = (page->ptr - sizeof(page_mini_block)) / sz;
+  for (size_t i = 0; i < n; i++)
+    ptrs[i] = (uint8_t *)page + (page->ptr -= sz);
+  page->used_block += n;
+#ifdef MALLOC_HARDENED
+  harden_mini_blocks(page, ptrs, n);
+#endif
+  STAT_ADD(mini_alloc[cls], n);
+  return n;
+}
+
+static void *alloc_mini_block(int cls) {
+  void *ret;
+  return alloc_mini_blocks(cls, &ret, 1) ? ret : NULL;
+}
+
+static void free_mini_blocks(page_mini_block *page, uint32_t count) {
+  uint32_t freed_block = __atomic_add_fetch(&page->freed_block, count,
       __ATOMIC_SEQ_CST);
-  if (__atomic_load_n(&page->active, __ATOMIC_SEQ_CST) == 0 
-      && page->used_block == freed_block)
-    release_free_page((free_page *)page);
+  if (__atomic_load_n(&page->active, __ATOMIC_SEQ_CST) == 0
+      && page->used_block == freed_block) {
+    STAT_ADD(pages_free, 1);
+    release_free_page((free_page *)page, page->node);
+  }
+}
+
+// Blocks are carved downwards from the end of the page, so a block
+// starts at a multiple of the block size below the page end.  This also
+// works for pointers into the middle of a block.
+static size_t mini_block_usable_size(page_mini_block *page, void *ptr) {
+  size_t sz = size_classes[page->size_class];
+  size_t off = (uint8_t *)page + page_size - (uint8_t *)ptr;
+  return off - (off - 1) / sz * sz;
+}
+
+//================================================
+//  THREAD EXIT
+//================================================
+
+// An exiting thread retires its pages and hands its counter block on.
+// Should the thread allocate again from a later destructor, it
+// registers anew and pthread runs this once more.
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+static void thread_exit(void *arg) {
+  for (int i = 0; i < NUM_SIZE_CLASS; i++) {
+    if (thread_pages[i] != NULL) {
+      retire_page_mini_block(thread_pages[i]);
+      thread_pages[i] = NULL;
+    }
+  }
+  release_thread_stat();
+  thread_registered = 0;
+}
+
+static void create_thread_key(void) {
+  pthread_key_create(&thread_key, thread_exit);
+}
+
+static void register_thread(void) {
+  if (thread_registered) return;
+  // pthread_setspecific may allocate
+  thread_registered = 1;
+  pthread_once(&thread_key_once, create_thread_key);
+  pthread_setspecific(thread_key, (void *)1);
+}
+
+#ifdef MALLOC_HARDENED
+//================================================
+//  HARDENED MODE
+//================================================
+
+// A canary is a per-process secret mixed with its own address, so that
+// a canary copied from another block does not pass.
+static uint64_t canary_secret = 0;
+
+static uint64_t canary_of(void *where) {
+  uint64_t secret = __atomic_load_n(&canary_secret, __ATOMIC_RELAXED);
+  if (__builtin_expect(secret == 0, 0)) {
+    // the same for every thread, so racing threads agree on it
+    void *random = (void *)getauxval(AT_RANDOM);
+    if (random != NULL) memcpy(&secret, random, sizeof(secret));
+    secret = (secret ^ (uintptr_t)&canary_secret) | 1;
+    __atomic_store_n(&canary_secret, secret, __ATOMIC_RELAXED);
+  }
+  return secret ^ (uintptr_t)where;
+}
+
+static inline void set_canary(void *where) {
+  *(uint64_t *)where = canary_of(where);
 }
 
+static inline int check_canary(void *where) {
+  return *(uint64_t *)where == canary_of(where);
+}
+
+// Index of the block starting at ptr, counted from the end of the page,
+// or -1 if no block of the page starts at ptr.
+static int mini_block_index(page_mini_block *page, void *ptr) {
+  size_t sz = size_classes[page->size_class];
+  size_t off = (uint8_t *)page + page_size - (uint8_t *)ptr;
+  if ((uint8_t *)ptr < (uint8_t *)(page + 1) || off % sz) return -1;
+  return off / sz - 1;
+}
+
+static void harden_mini_blocks(page_mini_block *page, void **ptrs, size_t n) {
+  size_t sz = size_classes[page->size_class];
+  for (size_t i = 0; i < n; i++) {
+    int idx = mini_block_index(page, ptrs[i]);
+    __atomic_fetch_or(&page->live_map[idx / 64], 1ull << (idx % 64),
+        __ATOMIC_RELAXED);
+    set_canary((uint8_t *)ptrs[i] + sz - CANARY_SIZE);
+  }
+}
+
+static void check_free_mini_block(page_mini_block *page, void *ptr) {
+  size_t sz = size_classes[page->size_class];
+  int idx = mini_block_index(page, ptr);
+  if (idx < 0) die("free(): invalid pointer %p\n", ptr);
+  uint64_t bit = 1ull << (idx % 64);
+  if (!(__atomic_fetch_and(&page->live_map[idx / 64], ~bit,
+          __ATOMIC_RELAXED) & bit))
+    die("free(): double free or invalid pointer %p\n", ptr);
+  if (!check_canary((uint8_t *)ptr + sz - CANARY_SIZE))
+    die("free(): buffer overflow past the end of %p\n", ptr);
+}
+
+// Freed mini blocks are filled with POISON_BYTE and held back, oldest
+// first, until newer ones push them out.  Only then do they count as
+// freed in their page; a block whose poison has changed by that time was
+// written after it was freed.
+#define QUARANTINE_SLOTS    4096
+#define QUARANTINE_BYTES    (4 << 20)
+#define POISON_BYTE         0xdf
+
+static void *quarantine[QUARANTINE_SLOTS];
+static size_t quarantine_head = 0;
+static size_t quarantine_count = 0;
+static size_t quarantine_bytes = 0;
+static pthread_mutex_t quarantine_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *find_poison_change(uint8_t *ptr, size_t sz) {
+  for (size_t i = 0; i < sz; i++)
+    if (ptr[i] != POISON_BYTE) return ptr + i;
+  return NULL;
+}
+
+static void quarantine_mini_block(page_mini_block *page, void *ptr) {
+  size_t sz = size_classes[page->size_class];
+  memset(ptr, POISON_BYTE, sz);
+  pthread_mutex_lock(&quarantine_mutex);
+  while (quarantine_count == QUARANTINE_SLOTS || (quarantine_count > 0
+        && quarantine_bytes + sz > QUARANTINE_BYTES)) {
+    void *old = quarantine[quarantine_head];
+    page_mini_block *old_page = page_of(old);
+    size_t old_sz = size_classes[old_page->size_class];
+    void *changed = find_poison_change(old, old_sz);
+    if (changed != NULL) {
+      pthread_mutex_unlock(&quarantine_mutex);
+      die("free(): write after free at %p in block %p\n", changed, old);
+    }
+    quarantine_head = (quarantine_head + 1) % QUARANTINE_SLOTS;
+    quarantine_count--;
+    quarantine_bytes -= old_sz;
+    free_mini_blocks(old_page, 1);
+  }
+  quarantine[(quarantine_head + quarantine_count++) % QUARANTINE_SLOTS] = ptr;
+  quarantine_bytes += sz;
+  pthread_mutex_unlock(&quarantine_mutex);
+}
+#endif
+
 //================================================
 //  HUGE PAGES
 //================================================
@@ -160,44 +546,433 @@ typedef struct page_huge_block {
   uint16_t page_type;
   uint16_t active;
   size_t tot_size;
+#ifdef MALLOC_HARDENED
+  void *block;
+#endif
 } page_huge_block;
 
-static void *alloc_huge_block(size_t size) {
-  size_t tot_size = size + sizeof(page_huge_block) + page_size;
-  page_huge_block *page = mmap(NULL, tot_size,
+static inline size_t round_sys_page(size_t size) {
+  return (size + getpagesize() - 1) & -(size_t)getpagesize();
+}
+
+// The block starts `alignment` bytes into its first page, or right
+// after that page if the alignment is page_size or more.  A smaller
+// alignment leaves room for the header, rounded up to MALLOC_ALIGNMENT
+// as the hardened header is 24 bytes.
+static void *alloc_huge_block(size_t size, size_t alignment) {
+  size_t header = (sizeof(page_huge_block) + MALLOC_ALIGNMENT - 1)
+      & ~(size_t)(MALLOC_ALIGNMENT - 1);
+  if (alignment < header) alignment = header;
+  size_t off = alignment < page_size ? alignment : page_size;
+  size_t slack = alignment < page_size ? page_size : alignment;
+  if (size > SIZE_MAX - slack - page_size * 2) return NULL;
+  size_t len = round_sys_page(off + size + CANARY_SIZE) + slack + GUARD_SIZE;
+  uint8_t *area = mmap(NULL, len,
       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (page == MAP_FAILED) return NULL;
-  size_t margin = (uintptr_t)page & (page_size - 1);
-  munmap(page, page_size - margin);
-  tot_size -= page_size - margin;
-  page = (page_huge_block *)((uint8_t*)page + (page_size - margin));
+  if (area == MAP_FAILED) return NULL;
+  uint8_t *ptr;
+  if (alignment < page_size)
+    ptr = (uint8_t *)(((uintptr_t)area + page_size - 1) & -page_size) + off;
+  else
+    ptr = (uint8_t *)(((uintptr_t)area + off + slack - 1) & -slack);
+  page_huge_block *page = (page_huge_block *)(ptr - off);
+  size_t tot_size = area + len - (uint8_t *)page;
+  if ((uint8_t *)page > area) munmap(area, (uint8_t *)page - area);
+#ifdef MALLOC_HARDENED
+  // the block ends in its canary, right before the guard page
+  size_t end = round_sys_page(off + size + CANARY_SIZE);
+  if (tot_size > end + GUARD_SIZE)
+    munmap((uint8_t *)page + end + GUARD_SIZE, tot_size - end - GUARD_SIZE);
+  if (GUARD_SIZE) mprotect((uint8_t *)page + end, GUARD_SIZE, PROT_NONE);
+  tot_size = end;
+#endif
+  if (tot_size >= huge_page_size)
+    advise_backing(page, tot_size, current_numa_node());
   page->page_type = PAGE_HUGE_BLOCK;
   page->active = 1;
   page->tot_size = tot_size;
-  return page + sizeof(page_huge_block);
+#ifdef MALLOC_HARDENED
+  page->block = ptr;
+  set_canary((uint8_t *)page + tot_size - CANARY_SIZE);
+#endif
+  STAT_ADD(huge_alloc, 1);
+  STAT_ADD(huge_alloc_bytes, tot_size);
+  return ptr;
 }
 
 static void free_huge_block(page_huge_block *page) {
-  munmap(page, page->tot_size);
+  STAT_ADD(huge_free, 1);
+  STAT_ADD(huge_free_bytes, page->tot_size);
+  munmap(page, page->tot_size + GUARD_SIZE);
+}
+
+#ifndef MALLOC_HARDENED
+// Resizes a huge block without copying its contents: shrinking unmaps
+// the tail, growing extends the mapping in place if the address space
+// behind it is free, and otherwise moves the pages with mremap to a
+// reserved range that is aligned to page_size.
+static void *realloc_huge_block(page_huge_block *page, void *ptr,
+    size_t size) {
+  size_t off = (uint8_t *)ptr - (uint8_t *)page;
+  if (size > SIZE_MAX - off - page_size * 2) return NULL;
+  size_t tot_size = round_sys_page(off + size);
+  if (tot_size <= page->tot_size) {
+    if (tot_size < page->tot_size) {
+      munmap((uint8_t *)page + tot_size, page->tot_size - tot_size);
+      STAT_ADD(huge_free_bytes, page->tot_size - tot_size);
+    }
+    page->tot_size = tot_size;
+    return ptr;
+  }
+  // leave headroom so that a series of small growths needs few remaps;
+  // pages that are never touched cost no memory
+  if (tot_size < page->tot_size + page->tot_size / 4)
+    tot_size = round_sys_page(page->tot_size + page->tot_size / 4);
+  if (mremap(page, page->tot_size, tot_size, 0) != MAP_FAILED) {
+    STAT_ADD(huge_alloc_bytes, tot_size - page->tot_size);
+    page->tot_size = tot_size;
+    return ptr;
+  }
+  uint8_t *area = mmap(NULL, tot_size + page_size, PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (area == MAP_FAILED) return NULL;
+  size_t margin = (page_size - ((uintptr_t)area & (page_size - 1)))
+      & (page_size - 1);
+  page_huge_block *new_page = mremap(page, page->tot_size, tot_size,
+      MREMAP_MAYMOVE | MREMAP_FIXED, area + margin);
+  if (new_page == MAP_FAILED) {
+    munmap(area, tot_size + page_size);
+    return NULL;
+  }
+  if (margin) munmap(area, margin);
+  munmap(area + margin + tot_size, page_size - margin);
+  STAT_ADD(huge_alloc_bytes, tot_size - new_page->tot_size);
+  new_page->tot_size = tot_size;
+  return (uint8_t *)new_page + off;
 }
+#endif
+
+static size_t huge_block_usable_size(page_huge_block *page, void *ptr) {
+  return (uint8_t *)page + page->tot_size - (uint8_t *)ptr;
+}
+
+#ifdef MALLOC_HARDENED
+// Huge blocks are unmapped as soon as they are freed, so any later use,
+// a second free included, faults instead of being quarantined.
+static void check_free_huge_block(page_huge_block *page, void *ptr) {
+  if (ptr != page->block) die("free(): invalid pointer %p\n", ptr);
+  if (!check_canary((uint8_t *)page + page->tot_size - CANARY_SIZE))
+    die("free(): buffer overflow past the end of %p\n", ptr);
+}
+#endif
+
+//================================================
+//  HEAP PROFILER
+//================================================
+
+// Every prof_sample_bytes allocated bytes on average, the allocation is
+// recorded with its backtrace.  Samples are grouped in buckets by stack
+// and written in the legacy heap profile format understood by pprof.
+// All tables live in memory mapped once, outside of the heap.
+
+#define PROF_MAX_DEPTH      32
+#define PROF_NUM_BUCKET     (1 << 14)
+#define PROF_NUM_SAMPLE     (1 << 16)
+#define PROF_NUM_FILTER     (1 << 16)
+
+typedef struct prof_bucket {
+  uint64_t hash;
+  int depth;
+  void *stack[PROF_MAX_DEPTH];
+  uint64_t alloc_count, alloc_bytes;
+  uint64_t free_count, free_bytes;
+} prof_bucket;
+
+typedef struct prof_sample {
+  void *ptr;
+  size_t size;
+  prof_bucket *bucket;
+} prof_sample;
+
+// marks an unused sample slot that ends no probe sequence
+#define PROF_DELETED        ((void *)1)
+
+static int prof_active = 0;
+static size_t prof_sample_bytes = 0;
+static prof_bucket *prof_buckets = NULL;
+static prof_sample *prof_samples = NULL;
+// number of live samples per hash of the pointer, so that do_free only
+// takes prof_mutex for pointers that may have been sampled; wide enough
+// for all PROF_NUM_SAMPLE samples to share one counter
+static uint32_t *prof_filter = NULL;
+static pthread_mutex_t prof_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread long prof_countdown
+    __attribute__((tls_model("initial-exec"))) = 0;
+static __thread int prof_busy
+    __attribute__((tls_model("initial-exec"))) = 0;
+static __thread uint64_t prof_seed
+    __attribute__((tls_model("initial-exec"))) = 0;
+
+static inline uint64_t prof_hash_ptr(void *ptr) {
+  return ((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ull;
+}
+
+// next distance to sample, uniform in [0.5, 1.5) x prof_sample_bytes
+static long prof_next_countdown(void) {
+  if (prof_seed == 0) prof_seed = (uintptr_t)&prof_seed | 1;
+  prof_seed ^= prof_seed << 13;
+  prof_seed ^= prof_seed >> 7;
+  prof_seed ^= prof_seed << 17;
+  return prof_sample_bytes / 2 + prof_seed % prof_sample_bytes;
+}
+
+static prof_bucket *prof_find_bucket(void **stack, int depth) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (int i = 0; i < depth; i++)
+    hash = (hash ^ (uintptr_t)stack[i]) * 0x100000001b3ull;
+  for (size_t i = 0; i < PROF_NUM_BUCKET; i++) {
+    prof_bucket *b = &prof_buckets[(hash + i) & (PROF_NUM_BUCKET - 1)];
+    if (b->depth == 0) {
+      b->hash = hash;
+      b->depth = depth;
+      memcpy(b->stack, stack, depth * sizeof(void *));
+      return b;
+    }
+    if (b->hash == hash && b->depth == depth
+        && memcmp(b->stack, stack, depth * sizeof(void *)) == 0)
+      return b;
+  }
+  return NULL;
+}
+
+// Returns -1 if the sample table is full.
+static int prof_insert(void *ptr, size_t size, prof_bucket *b) {
+  uint64_t hash = prof_hash_ptr(ptr);
+  for (size_t i = 0; i < PROF_NUM_SAMPLE; i++) {
+    prof_sample *smp = &prof_samples[(hash + i) & (PROF_NUM_SAMPLE - 1)];
+    if (smp->ptr == NULL || smp->ptr == PROF_DELETED) {
+      smp->ptr = ptr;
+      smp->size = size;
+      smp->bucket = b;
+      __atomic_add_fetch(&prof_filter[hash >> 48], 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static void prof_record(void *ptr, size_t size) {
+  void *stack[PROF_MAX_DEPTH + 2];
+  prof_countdown = prof_next_countdown();
+  // backtrace() allocates when it is first called
+  prof_busy = 1;
+  int depth = backtrace(stack, PROF_MAX_DEPTH + 2) - 2;
+  prof_busy = 0;
+  if (depth <= 0) return;
+  pthread_mutex_lock(&prof_mutex);
+  prof_bucket *b = prof_find_bucket(stack + 2, depth);
+  // a sample that is not in the table would never be seen freed
+  if (b != NULL && prof_insert(ptr, size, b) == 0) {
+    b->alloc_count++;
+    b->alloc_bytes += size;
+  }
+  pthread_mutex_unlock(&prof_mutex);
+}
+
+static inline void prof_malloc(void *ptr, size_t size) {
+  if (__builtin_expect(!__atomic_load_n(&prof_active, __ATOMIC_RELAXED), 1)
+      || ptr == NULL || prof_busy)
+    return;
+  if ((prof_countdown -= size) < 0) prof_record(ptr, size);
+}
+
+// Removes the sample of ptr, if any, and returns its bucket.
+static prof_bucket *prof_forget(void *ptr, size_t *size) {
+  prof_bucket *b = NULL;
+  uint64_t hash = prof_hash_ptr(ptr);
+  if (prof_filter == NULL
+      || !__atomic_load_n(&prof_filter[hash >> 48], __ATOMIC_RELAXED))
+    return NULL;
+  pthread_mutex_lock(&prof_mutex);
+  for (size_t i = 0; i < PROF_NUM_SAMPLE; i++) {
+    prof_sample *smp = &prof_samples[(hash + i) & (PROF_NUM_SAMPLE - 1)];
+    if (smp->ptr == NULL) break;
+    if (smp->ptr == ptr) {
+      b = smp->bucket;
+      *size = smp->size;
+      smp->ptr = PROF_DELETED;
+      __atomic_sub_fetch(&prof_filter[hash >> 48], 1, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&prof_mutex);
+  return b;
+}
+
+static inline void prof_free(void *ptr) {
+  size_t size;
+  prof_bucket *b = prof_forget(ptr, &size);
+  if (b != NULL) {
+    __atomic_add_fetch(&b->free_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->free_bytes, size, __ATOMIC_RELAXED);
+  }
+}
+
+#ifndef MALLOC_HARDENED
+// A sampled block that moved keeps its sample and its bucket.
+static void prof_move(void *old_ptr, void *new_ptr, size_t size) {
+  size_t old_size;
+  prof_bucket *b = prof_forget(old_ptr, &old_size);
+  if (b == NULL) return;
+  pthread_mutex_lock(&prof_mutex);
+  int ret = prof_insert(new_ptr, size, b);
+  pthread_mutex_unlock(&prof_mutex);
+  // the old block is free and the new one goes unseen
+  if (ret < 0) {
+    __atomic_add_fetch(&b->free_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->free_bytes, old_size, __ATOMIC_RELAXED);
+  }
+}
+#endif
+
+static int prof_write(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write(fd, buf, len);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+//================================================
+//  FORK SAFETY
+//================================================
+
+// A child forked while another thread holds a mutex would deadlock
+// on its first page allocation.  All other shared state is updated with
+// atomic operations and stays consistent across fork().
+static void fork_prepare(void) {
+  pthread_mutex_lock(&prof_mutex);
+#ifdef MALLOC_HARDENED
+  pthread_mutex_lock(&quarantine_mutex);
+#endif
+  pthread_mutex_lock(&stat_mutex);
+  for (int i = 0; i < MAX_NUMA_NODE; i++)
+    pthread_mutex_lock(&page_pools[i].mutex);
+}
+
+static void fork_parent(void) {
+  for (int i = 0; i < MAX_NUMA_NODE; i++)
+    pthread_mutex_unlock(&page_pools[i].mutex);
+  pthread_mutex_unlock(&stat_mutex);
+#ifdef MALLOC_HARDENED
+  pthread_mutex_unlock(&quarantine_mutex);
+#endif
+  pthread_mutex_unlock(&prof_mutex);
+}
+
+static void fork_child(void) {
+  for (int i = 0; i < MAX_NUMA_NODE; i++)
+    pthread_mutex_init(&page_pools[i].mutex, NULL);
+  pthread_mutex_init(&stat_mutex, NULL);
+#ifdef MALLOC_HARDENED
+  pthread_mutex_init(&quarantine_mutex, NULL);
+#endif
+  pthread_mutex_init(&prof_mutex, NULL);
+}
+
+__attribute__((constructor))
+static void malloc_init(void) {
+  init_numa_node_count();
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+//================================================
+//  INTERFACES
+//================================================
 
 void *do_malloc(size_t size) {
   void *ret;
-  if (size < page_size / 4) {
-    ret = alloc_mini_block(size);
+  if (size < page_size / 4 - CANARY_SIZE) {
+    ret = alloc_mini_block(size_class(size + CANARY_SIZE));
   } else {
-    ret = alloc_huge_block(size);
+    ret = alloc_huge_block(size, MALLOC_ALIGNMENT);
+  }
+  if (ret == NULL) errno = ENOMEM;
+  prof_malloc(ret, size);
+  return ret;
+}
+
+// Blocks of a size class that is a multiple of the alignment are
+// aligned, as they sit at a multiple of their size below the end of a
+// page.  Larger alignments are served by huge blocks.
+void *do_memalign(size_t alignment, size_t size) {
+  void *ret = NULL;
+  if (alignment == 0 || (alignment & (alignment - 1))) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (alignment <= MALLOC_ALIGNMENT) return do_malloc(size);
+  if (size < page_size / 4 - CANARY_SIZE) {
+    for (int cls = size_class(size + CANARY_SIZE); cls < NUM_SIZE_CLASS;
+        cls++) {
+      if (size_classes[cls] % alignment == 0) {
+        ret = alloc_mini_block(cls);
+        goto done;
+      }
+    }
   }
+  ret = alloc_huge_block(size, alignment);
+done:
+  if (ret == NULL) errno = ENOMEM;
+  prof_malloc(ret, size);
   return ret;
 }
 
+size_t do_malloc_batch(size_t size, void **ptrs, size_t n) {
+  size_t count = 0;
+  if (size < page_size / 4 - CANARY_SIZE) {
+    int cls = size_class(size + CANARY_SIZE);
+    while (count < n) {
+      size_t k = alloc_mini_blocks(cls, ptrs + count, n - count);
+      if (k == 0) break;
+      count += k;
+    }
+  } else {
+    while (count < n
+        && (ptrs[count] = alloc_huge_block(size, MALLOC_ALIGNMENT)) != NULL)
+      count++;
+  }
+  if (count < n) errno = ENOMEM;
+  for (size_t i = 0; i < count; i++) prof_malloc(ptrs[i], size);
+  return count;
+}
+
 void do_free(void *ptr) {
-  void *page = (void *)((uintptr_t)(ptr) & (-page_size));
+  if (ptr == NULL) return;
+  prof_free(ptr);
+  void *page = page_of(ptr);
   switch (*(uint16_t *)page) {
     case PAGE_MINI_BLOCK:
-      free_mini_block(page);
+#ifdef MALLOC_HARDENED
+      check_free_mini_block(page, ptr);
+#endif
+      STAT_ADD(mini_free[((page_mini_block *)page)->size_class], 1);
+#ifdef MALLOC_HARDENED
+      quarantine_mini_block(page, ptr);
+#else
+      free_mini_blocks(page, 1);
+#endif
       break;
     case PAGE_HUGE_BLOCK:
+#ifdef MALLOC_HARDENED
+      check_free_huge_block(page, ptr);
+#endif
       free_huge_block(page);
       break;
     default:
@@ -205,3 +980,232 @@ void do_free(void *ptr) {
   }
 }
 
+// Runs of pointers into the same mini page are released with a single
+// atomic update of the page header.
+void do_free_batch(void **ptrs, size_t n) {
+#ifdef MALLOC_HARDENED
+  for (size_t i = 0; i < n; i++) do_free(ptrs[i]);
+  return;
+#endif
+  for (size_t i = 0; i < n; ) {
+    if (ptrs[i] == NULL) {
+      i++;
+      continue;
+    }
+    page_mini_block *page = page_of(ptrs[i]);
+    if (page->page_type != PAGE_MINI_BLOCK) {
+      do_free(ptrs[i++]);
+      continue;
+    }
+    size_t j = i;
+    for (; j < n && ptrs[j] != NULL && page_of(ptrs[j]) == page; j++)
+      prof_free(ptrs[j]);
+    STAT_ADD(mini_free[page->size_class], j - i);
+    free_mini_blocks(page, j - i);
+    i = j;
+  }
+}
+
+void *do_realloc(void *ptr, size_t size) {
+  size_t old_size;
+  if (ptr == NULL) return do_malloc(size);
+  if (size == 0) {
+    do_free(ptr);
+    return NULL;
+  }
+  void *page = page_of(ptr), *ret;
+  // hardened builds always move the block, so that the old one is
+  // checked and quarantined like any other
+  switch (*(uint16_t *)page) {
+    case PAGE_MINI_BLOCK:
+      old_size = mini_block_usable_size(page, ptr) - CANARY_SIZE;
+#ifndef MALLOC_HARDENED
+      // stay in place while the block fits, unless a smaller size
+      // class would take it and the block would be less than half used
+      if (size <= old_size && (size > old_size / 2 ||
+            size_class(size + CANARY_SIZE) ==
+            ((page_mini_block *)page)->size_class))
+        return ptr;
+#endif
+      break;
+    case PAGE_HUGE_BLOCK:
+#ifndef MALLOC_HARDENED
+      if (size >= page_size / 4) {
+        ret = realloc_huge_block(page, ptr, size);
+        if (ret == NULL) errno = ENOMEM;
+        else if (ret != ptr) prof_move(ptr, ret, size);
+        return ret;
+      }
+#endif
+      old_size = huge_block_usable_size(page, ptr) - CANARY_SIZE;
+      break;
+    default:
+      die("realloc(): Heap corruption detected!\n");
+      return NULL;
+  }
+  ret = do_malloc(size);
+  if (ret == NULL) return NULL;
+  memcpy(ret, ptr, old_size < size ? old_size : size);
+  do_free(ptr);
+  return ret;
+}
+
+size_t do_malloc_usable_size(void *ptr) {
+  if (ptr == NULL) return 0;
+  void *page = page_of(ptr);
+  switch (*(uint16_t *)page) {
+    case PAGE_MINI_BLOCK:
+      return mini_block_usable_size(page, ptr) - CANARY_SIZE;
+    case PAGE_HUGE_BLOCK:
+      return huge_block_usable_size(page, ptr) - CANARY_SIZE;
+    default:
+      die("malloc_usable_size(): Heap corruption detected!\n");
+  }
+  return 0;
+}
+
+// Sums the counters of all threads; live_blocks receives the number of
+// live mini blocks per size class.
+static void collect_stat(struct malloc_stat *stat, uint64_t *live_blocks) {
+  uint64_t pages = 0, huge_blocks = 0, huge_bytes = 0;
+  memset(stat, 0, sizeof(*stat));
+  memset(live_blocks, 0, sizeof(uint64_t) * NUM_SIZE_CLASS);
+  pthread_mutex_lock(&stat_mutex);
+  for (thread_stat *st = thread_stat_head; st != NULL; st = st->next) {
+    pages += __atomic_load_n(&st->pages_alloc, __ATOMIC_RELAXED)
+        - __atomic_load_n(&st->pages_free, __ATOMIC_RELAXED);
+    huge_blocks += __atomic_load_n(&st->huge_alloc, __ATOMIC_RELAXED)
+        - __atomic_load_n(&st->huge_free, __ATOMIC_RELAXED);
+    huge_bytes += __atomic_load_n(&st->huge_alloc_bytes, __ATOMIC_RELAXED)
+        - __atomic_load_n(&st->huge_free_bytes, __ATOMIC_RELAXED);
+    for (int i = 0; i < NUM_SIZE_CLASS; i++)
+      live_blocks[i] += __atomic_load_n(&st->mini_alloc[i], __ATOMIC_RELAXED)
+          - __atomic_load_n(&st->mini_free[i], __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&stat_mutex);
+  stat->pages_in_use = pages;
+  stat->huge_blocks = huge_blocks;
+  stat->huge_bytes = huge_bytes;
+  for (int i = 0; i < NUM_SIZE_CLASS; i++) {
+    stat->mini_blocks += live_blocks[i];
+    stat->mini_bytes += live_blocks[i] * size_classes[i];
+  }
+  for (int i = 0; i < MAX_NUMA_NODE; i++) {
+    page_pool *pool = &page_pools[i];
+    pthread_mutex_lock(&pool->mutex);
+    stat->segment_bytes += pool->segment_count * segment_size;
+    stat->pages_pooled += pool->free_page_count;
+    stat->pages_released += pool->clean_page_count;
+    pthread_mutex_unlock(&pool->mutex);
+  }
+}
+
+void do_malloc_stat(struct malloc_stat *stat) {
+  uint64_t live_blocks[NUM_SIZE_CLASS];
+  collect_stat(stat, live_blocks);
+}
+
+void do_malloc_stats(void) {
+  struct malloc_stat st;
+  uint64_t live_blocks[NUM_SIZE_CLASS];
+  collect_stat(&st, live_blocks);
+  size_t page_bytes = st.pages_in_use * page_size;
+  fprintf(stderr, "segments:      %zu bytes\n", st.segment_bytes);
+  fprintf(stderr, "pages in use:  %zu (%zu bytes)\n",
+      st.pages_in_use, page_bytes);
+  fprintf(stderr, "pages pooled:  %zu committed, %zu released\n",
+      st.pages_pooled, st.pages_released);
+  fprintf(stderr, "mini blocks:   %zu (%zu bytes)\n",
+      st.mini_blocks, st.mini_bytes);
+  fprintf(stderr, "huge blocks:   %zu (%zu bytes)\n",
+      st.huge_blocks, st.huge_bytes);
+  // memory in mini pages that does not hold a live block: the unused
+  // tail of current pages and blocks freed in pages still in use
+  fprintf(stderr, "fragmentation: %.1f%%\n", page_bytes == 0 ? 0.0 :
+      100.0 * (page_bytes - st.mini_bytes) / page_bytes);
+  fprintf(stderr, "%10s %12s %14s\n", "class", "live blocks", "live bytes");
+  for (int i = 0; i < NUM_SIZE_CLASS; i++) {
+    if (live_blocks[i] == 0) continue;
+    fprintf(stderr, "%10u %12llu %14llu\n", size_classes[i],
+        (unsigned long long)live_blocks[i],
+        (unsigned long long)live_blocks[i] * size_classes[i]);
+  }
+}
+
+int do_malloc_prof_start(size_t sample_bytes) {
+  pthread_mutex_lock(&prof_mutex);
+  if (prof_buckets == NULL) {
+    size_t len = sizeof(prof_bucket) * PROF_NUM_BUCKET
+        + sizeof(prof_sample) * PROF_NUM_SAMPLE
+        + sizeof(uint32_t) * PROF_NUM_FILTER;
+    uint8_t *tables = mmap(NULL, len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (tables == MAP_FAILED) {
+      pthread_mutex_unlock(&prof_mutex);
+      return -1;
+    }
+    prof_buckets = (prof_bucket *)tables;
+    prof_samples = (prof_sample *)(prof_buckets + PROF_NUM_BUCKET);
+    prof_filter = (uint32_t *)(prof_samples + PROF_NUM_SAMPLE);
+  }
+  prof_sample_bytes = sample_bytes ? sample_bytes : 512 * 1024;
+  pthread_mutex_unlock(&prof_mutex);
+  // load the unwinder now rather than on the first sample
+  void *stack[1];
+  prof_busy = 1;
+  backtrace(stack, 1);
+  prof_busy = 0;
+  __atomic_store_n(&prof_active, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void do_malloc_prof_stop(void) {
+  __atomic_store_n(&prof_active, 0, __ATOMIC_RELEASE);
+}
+
+int do_malloc_prof_dump(const char *path) {
+  char buf[1024];
+  uint64_t inuse_count = 0, inuse_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return -1;
+  int ret = 0;
+  pthread_mutex_lock(&prof_mutex);
+  for (size_t i = 0; prof_buckets != NULL && i < PROF_NUM_BUCKET; i++) {
+    prof_bucket *b = &prof_buckets[i];
+    alloc_count += b->alloc_count;
+    alloc_bytes += b->alloc_bytes;
+    inuse_count += b->alloc_count - b->free_count;
+    inuse_bytes += b->alloc_bytes - b->free_bytes;
+  }
+  int len = snprintf(buf, sizeof buf,
+      "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+      (unsigned long long)inuse_count, (unsigned long long)inuse_bytes,
+      (unsigned long long)alloc_count, (unsigned long long)alloc_bytes,
+      prof_sample_bytes);
+  ret |= prof_write(fd, buf, len);
+  for (size_t i = 0; prof_buckets != NULL && i < PROF_NUM_BUCKET; i++) {
+    prof_bucket *b = &prof_buckets[i];
+    if (b->depth == 0) continue;
+    len = snprintf(buf, sizeof buf, "%llu: %llu [%llu: %llu] @",
+        (unsigned long long)(b->alloc_count - b->free_count),
+        (unsigned long long)(b->alloc_bytes - b->free_bytes),
+        (unsigned long long)b->alloc_count,
+        (unsigned long long)b->alloc_bytes);
+    for (int j = 0; j < b->depth; j++)
+      len += snprintf(buf + len, sizeof buf - len, " %p", b->stack[j]);
+    buf[len++] = '\n';
+    ret |= prof_write(fd, buf, len);
+  }
+  pthread_mutex_unlock(&prof_mutex);
+  // pprof symbolizes the addresses with the mappings of the process
+  ret |= prof_write(fd, "\nMAPPED_LIBRARIES:\n", 19);
+  int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (maps >= 0) {
+    ssize_t n;
+    while ((n = read(maps, buf, sizeof buf)) > 0)
+      ret |= prof_write(fd, buf, n);
+    close(maps);
+  }
+  if (close(fd)) ret = -1;
+  return ret ? -1 : 0;
+}
@@ -3,7 +3,39 @@
 
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 void* do_malloc(size_t size);
 void do_free(void *ptr);
+void* do_realloc(void *ptr, size_t size);
+size_t do_malloc_usable_size(void *ptr);
+void* do_memalign(size_t alignment, size_t size);
+
+size_t do_malloc_batch(size_t size, void **ptrs, size_t n);
+void do_free_batch(void **ptrs, size_t n);
+
+struct malloc_stat {
+  size_t segment_bytes;   /* address space reserved for mini pages */
+  size_t pages_in_use;    /* mini pages holding blocks */
+  size_t pages_pooled;    /* free pages kept committed */
+  size_t pages_released;  /* free pages returned to the kernel */
+  size_t mini_blocks;     /* live mini blocks */
+  size_t mini_bytes;      /* live mini blocks, in size class bytes */
+  size_t huge_blocks;     /* live huge blocks */
+  size_t huge_bytes;      /* memory mapped for live huge blocks */
+};
+
+void do_malloc_stat(struct malloc_stat *stat);
+void do_malloc_stats(void);
+
+int do_malloc_prof_start(size_t sample_bytes);
+void do_malloc_prof_stop(void);
+int do_malloc_prof_dump(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* ifndef __MALLOC_H__ */
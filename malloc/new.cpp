@@ -0,0 +1,128 @@
+#include "malloc.h"
+#include <new>
+#include <cstdlib>
+
+//=========================================================
+// C++ allocation functions for libfastmalloc.so
+//=========================================================
+
+static void *new_block(std::size_t size) {
+  for (;;) {
+    void *ret = do_malloc(size);
+    if (ret != nullptr) return ret;
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) throw std::bad_alloc();
+    handler();
+  }
+}
+
+static void *new_aligned_block(std::size_t size, std::align_val_t al) {
+  for (;;) {
+    void *ret;
+    if (posix_memalign(&ret, static_cast<std::size_t>(al), size) == 0)
+      return ret;
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) throw std::bad_alloc();
+    handler();
+  }
+}
+
+void *operator new(std::size_t size) {
+  return new_block(size);
+}
+
+void *operator new[](std::size_t size) {
+  return new_block(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  try {
+    return new_block(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  try {
+    return new_block(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void *operator new(std::size_t size, std::align_val_t al) {
+  return new_aligned_block(size, al);
+}
+
+void *operator new[](std::size_t size, std::align_val_t al) {
+  return new_aligned_block(size, al);
+}
+
+void *operator new(std::size_t size, std::align_val_t al,
+    const std::nothrow_t &) noexcept {
+  try {
+    return new_aligned_block(size, al);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void *operator new[](std::size_t size, std::align_val_t al,
+    const std::nothrow_t &) noexcept {
+  try {
+    return new_aligned_block(size, al);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void operator delete(void *ptr) noexcept {
+  do_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+  do_free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  do_free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  do_free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+  do_free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept {
+  do_free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+  do_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+  do_free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+  do_free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+  do_free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+    const std::nothrow_t &) noexcept {
+  do_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t,
+    const std::nothrow_t &) noexcept {
+  do_free(ptr);
+}
@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+
+#include "malloc.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+//=========================================================
+// Standard malloc API on top of do_malloc/do_free, built
+// into libfastmalloc.so for use with LD_PRELOAD.
+//=========================================================
+
+void *malloc(size_t size) {
+  return do_malloc(size);
+}
+
+void free(void *ptr) {
+  do_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  size_t tot;
+  if (__builtin_mul_overflow(nmemb, size, &tot)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  void *ret = do_malloc(tot);
+  if (ret != NULL) memset(ret, 0, tot);
+  return ret;
+}
+
+void *realloc(void *ptr, size_t size) {
+  return do_realloc(ptr, size);
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+  size_t tot;
+  if (__builtin_mul_overflow(nmemb, size, &tot)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return do_realloc(ptr, tot);
+}
+
+static int valid_alignment(size_t alignment) {
+  return alignment != 0 && (alignment & (alignment - 1)) == 0;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (!valid_alignment(alignment) || alignment % sizeof(void *))
+    return EINVAL;
+  // the error is returned, errno stays as it was
+  int saved_errno = errno;
+  void *ret = do_memalign(alignment, size);
+  int err = errno;
+  errno = saved_errno;
+  if (ret == NULL) return err;
+  *memptr = ret;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  return do_memalign(alignment, size);
+}
+
+// Like glibc, rounds any other alignment up to a power of two.
+void *memalign(size_t alignment, size_t size) {
+  if (!valid_alignment(alignment)) {
+    if (alignment > SIZE_MAX / 2 + 1) {
+      errno = EINVAL;
+      return NULL;
+    }
+    size_t pow2 = 1;
+    while (pow2 < alignment) pow2 <<= 1;
+    alignment = pow2;
+  }
+  return do_memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+  return do_memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+  size_t sys_page = sysconf(_SC_PAGESIZE);
+  if (size > SIZE_MAX - sys_page) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return do_memalign(sys_page, (size + sys_page - 1) & -sys_page);
+}
+
+size_t malloc_usable_size(void *ptr) {
+  return do_malloc_usable_size(ptr);
+}
+
+void malloc_stats(void) {
+  do_malloc_stats();
+}
+
+//=========================================================
+// Environment:
+//   FASTMALLOC_STATS=1          print statistics at exit
+//   FASTMALLOC_PROF=<path>      write a heap profile at exit
+//   FASTMALLOC_PROF_SAMPLE=<n>  sample every n bytes on average
+//=========================================================
+
+static const char *prof_path;
+
+static void print_stats_at_exit(void) {
+  do_malloc_stats();
+}
+
+static void dump_prof_at_exit(void) {
+  do_malloc_prof_dump(prof_path);
+}
+
+__attribute__((constructor))
+static void preload_init(void) {
+  const char *env = getenv("FASTMALLOC_STATS");
+  if (env != NULL && *env != '\0' && *env != '0')
+    atexit(print_stats_at_exit);
+  prof_path = getenv("FASTMALLOC_PROF");
+  if (prof_path != NULL && *prof_path != '\0') {
+    env = getenv("FASTMALLOC_PROF_SAMPLE");
+    if (do_malloc_prof_start(env ? strtoull(env, NULL, 0) : 0) == 0)
+      atexit(dump_prof_at_exit);
+  }
+}
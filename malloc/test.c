@@ -12,6 +12,7 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -110,6 +111,22 @@ static void new_free(void *ptr) {
     do_log(ptr, 0);
     do_free(ptr);
 }
+
+static size_t new_malloc_batch(size_t size, void **ptrs, size_t n) {
+    assert(size != 0);
+    size_t count = do_malloc_batch(size, ptrs, n);
+    for (size_t i = 0; i < count; ++i) {
+        do_log(ptrs[i], size);
+    }
+    return count;
+}
+
+static void new_free_batch(void **ptrs, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        do_log(ptrs[i], 0);
+    }
+    do_free_batch(ptrs, n);
+}
 //=========================================================
 
 
@@ -175,6 +192,7 @@ long lran2(struct lran2_st* d)
 
 int debug_flag = 0;
 int verbose_flag = 0;
+int batch_flag = 0;
 #define num_workers_default 4
 int num_workers = num_workers_default;
 /* double run_time = 5.0; */
@@ -272,6 +290,12 @@ void *mem_allocator (void *arg) {
 
   while (!atomic_load(&done_flag)) {
     struct batch *b = xmalloc(sizeof(*b));
+    if (batch_flag && object_size > 0) {
+      size_t n = new_malloc_batch(object_size, b->objects, OBJECTS_PER_BATCH);
+      assert(n == OBJECTS_PER_BATCH);
+      enqueue_batch(b);
+      continue;
+    }
     for (int i = 0; i < OBJECTS_PER_BATCH; i++) {
       size_t siz = object_size > 0 ? object_size : possible_sizes[lran2(&lr)%n_sizes];
       b->objects[i] = xmalloc(siz);
@@ -288,8 +312,12 @@ void *mem_releaser(void *arg) {
   while(!atomic_load(&done_flag)) {
     struct batch *b = dequeue_batch();
     if (b) {
-      for (int i = 0; i < OBJECTS_PER_BATCH; i++) {
-	xfree(b->objects[i]);
+      if (batch_flag) {
+	new_free_batch(b->objects, OBJECTS_PER_BATCH);
+      } else {
+	for (int i = 0; i < OBJECTS_PER_BATCH; i++) {
+	  xfree(b->objects[i]);
+	}
       }
       xfree(b);
     }
@@ -363,12 +391,30 @@ int run_memory_free_test()
 	return(0);
 }
 
+// Every block, mini or huge, hardened or not, is aligned to 16 bytes,
+// and memaligned ones to what was asked for.
+static void check_alignment(void) {
+  static const size_t sizes[] = {1, 8, 100, 4000, 16000, 48000, 144000,
+      100000, 1 << 20};
+  for (size_t i = 0; i < sizeof sizes / sizeof *sizes; i++) {
+    void *ptr = do_malloc(sizes[i]);
+    assert(ptr != NULL && (uintptr_t)ptr % 16 == 0);
+    do_free(ptr);
+    for (size_t align = 16; align <= 8192; align *= 2) {
+      ptr = do_memalign(align, sizes[i]);
+      assert(ptr != NULL && (uintptr_t)ptr % align == 0);
+      do_free(ptr);
+    }
+  }
+}
+
 void usage(char *prog)
 {
 	printf("%s [-w workers] [-t run_time] [-d] [-v]\n", prog);
 	printf("\t -w number of producer threads (and number of consumer threads), default %d\n", num_workers_default);
 	printf("\t -t run time in seconds, default 20.0 seconds.\n");
 	printf("\t -s size of object to allocate (default %d bytes) (specify -1 to get many different object sizes)\n", DEFAULT_OBJECT_SIZE);
+	printf("\t -b allocate and free each batch with do_malloc_batch/do_free_batch\n");
 	printf("\t -d debug mode\n");
 	printf("\t -v verbose mode (-v -v produces more verbose)\n");
 	exit(1);
@@ -378,7 +424,7 @@ int main(int argc, char **argv)
 {
     new_malloc_init();
 	int c;
-	while ((c = getopt(argc, argv, "w:t:ds:v")) != -1) {
+	while ((c = getopt(argc, argv, "w:t:bds:v")) != -1) {
 
 		switch (c) {
 
@@ -388,6 +434,9 @@ int main(int argc, char **argv)
 		case 't':
 			run_time = atof(optarg);
 			break;
+		case 'b':
+			batch_flag = 1;
+			break;
 		case 'd':
 			debug_flag = 1;
 			break;
@@ -406,6 +455,7 @@ int main(int argc, char **argv)
 	thread_ids = (pthread_t *) xmalloc(sizeof(pthread_t) * num_workers * 2);
 	counters = (struct counter *) xmalloc(sizeof(*counters) * num_workers);
 
+	check_alignment();
 	run_memory_free_test();
 	while (batches) {
 	  struct batch *b = batches;